@@ -29,11 +29,27 @@ SOURCES += \
     vtextdocumentlayout.cpp \
     vtextedit.cpp \
     vlinenumberarea.cpp \
-    vimageresourcemanager2.cpp
+    vimageresourcemanager2.cpp \
+    vimagestore.cpp \
+    vimagediskcache.cpp \
+    vcodeblockindex.cpp \
+    vminimap.cpp \
+    vpiecetable.cpp \
+    vsearchengine.cpp \
+    vhighlighter.cpp \
+    vexporter.cpp
 
 HEADERS += \
         mainwindow.h \
     vtextdocumentlayout.h \
     vtextedit.h \
     vlinenumberarea.h \
-    vimageresourcemanager2.h
+    vimageresourcemanager2.h \
+    vimagestore.h \
+    vimagediskcache.h \
+    vcodeblockindex.h \
+    vminimap.h \
+    vpiecetable.h \
+    vsearchengine.h \
+    vhighlighter.h \
+    vexporter.h
@@ -1,9 +1,250 @@
 #include "mainwindow.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QTextDocument>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFontDatabase>
+#include <QThreadPool>
+#include <QThread>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QPageLayout>
+
+#include "vtextdocumentlayout.h"
+#include "vimageresourcemanager2.h"
+#include "vexporter.h"
+
+// Lines of the document laid out by the benchmark.
+static const int c_benchmarkLines = 1000000;
+
+// Options to export a file.
+struct ExportOptions
+{
+    // pdf or png.
+    QString m_format;
+
+    QDir m_outputDir;
+
+    // Text width in pixels.
+    qreal m_width;
+
+    // Page height in pixels of png.
+    qreal m_pageHeight;
+
+    // Page layout of pdf.
+    QPageLayout m_pageLayout;
+
+    // Maximum count of the threads encoding the pages of one file.
+    int m_encodingThreads;
+};
+
+// Export file @p_filePath with @p_options.
+// The document is created and painted on the calling thread.
+static bool exportFile(const QString &p_filePath, const ExportOptions &p_options)
+{
+    QFile file(p_filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "failed to read file" << p_filePath;
+        return false;
+    }
+
+    // No images are added, so nothing is decoded into QPixmap off the GUI thread.
+    VImageResourceManager2 imageMgr;
+    QTextDocument doc;
+    VTextDocumentLayout *layout = new VTextDocumentLayout(&doc, &imageMgr);
+    // Pages are split by the real metrics of all the blocks.
+    layout->setFrameBudget(0);
+    doc.setDocumentLayout(layout);
+    doc.setPageSize(QSizeF(p_options.m_width, -1));
+    doc.setPlainText(QString::fromUtf8(file.readAll()));
+
+    VExporter exporter(&doc);
+    exporter.setEncodingThreadCount(p_options.m_encodingThreads);
+    const QString baseName = QFileInfo(p_filePath).completeBaseName();
+    if (p_options.m_format == "pdf") {
+        return exporter.exportPdf(p_options.m_outputDir.filePath(baseName + ".pdf"),
+                                  p_options.m_pageLayout);
+    }
+
+    return exporter.exportImages(p_options.m_outputDir.filePath(baseName + "_%1.png"),
+                                 p_options.m_pageHeight);
+}
+
+// Export a file on a thread of the pool.
+class VExportFileTask : public QRunnable
+{
+public:
+    VExportFileTask(const QString &p_filePath,
+                    const ExportOptions &p_options,
+                    QAtomicInt *p_failures)
+        : m_filePath(p_filePath),
+          m_options(p_options),
+          m_failures(p_failures)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        if (!exportFile(m_filePath, m_options)) {
+            m_failures->ref();
+        }
+    }
+
+private:
+    QString m_filePath;
+
+    ExportOptions m_options;
+
+    QAtomicInt *m_failures;
+};
+
+// Parse page size @p_size in the format of <width>x<height> in millimeters.
+static bool parsePageSize(const QString &p_size, QSizeF &p_pageSize)
+{
+    const QStringList parts = p_size.split(QLatin1Char('x'));
+    if (parts.size() != 2) {
+        return false;
+    }
+
+    bool widthOk = false, heightOk = false;
+    p_pageSize = QSizeF(parts[0].toDouble(&widthOk), parts[1].toDouble(&heightOk));
+    return widthOk && heightOk && !p_pageSize.isEmpty();
+}
+
+// Export each file of the positional arguments without showing any window.
+// Files are exported on worker threads in parallel, each in its own document.
+// Return the count of files failed to export.
+static int exportFiles(const QCommandLineParser &p_parser)
+{
+    ExportOptions options;
+    options.m_format = p_parser.value("export");
+    if (options.m_format != "pdf" && options.m_format != "png") {
+        qWarning() << "unknown export format" << options.m_format;
+        return 1;
+    }
+
+    // Reject the options of the other format instead of ignoring them.
+    if (options.m_format == "pdf" && p_parser.isSet("page-height")) {
+        qWarning() << "--page-height applies to png only, use --page-size for pdf";
+        return 1;
+    } else if (options.m_format == "png" && (p_parser.isSet("page-size") || p_parser.isSet("margin"))) {
+        qWarning() << "--page-size and --margin apply to pdf only, use --page-height for png";
+        return 1;
+    }
+
+    QSizeF pageSize;
+    if (!parsePageSize(p_parser.value("page-size"), pageSize)) {
+        qWarning() << "invalid page size" << p_parser.value("page-size");
+        return 1;
+    }
+
+    const qreal margin = p_parser.value("margin").toDouble();
+    options.m_pageLayout = QPageLayout(QPageSize(pageSize, QPageSize::Millimeter),
+                                       QPageLayout::Portrait,
+                                       QMarginsF(margin, margin, margin, margin),
+                                       QPageLayout::Millimeter);
+
+    options.m_outputDir = QDir(p_parser.value("output"));
+    if (!options.m_outputDir.mkpath(".")) {
+        qWarning() << "failed to create output directory" << options.m_outputDir.path();
+        return 1;
+    }
+
+    options.m_width = p_parser.value("width").toDouble();
+    options.m_pageHeight = p_parser.value("page-height").toDouble();
+
+    const QStringList files = p_parser.positionalArguments();
+    QAtomicInt failures(0);
+    if (files.size() > 1 && QFontDatabase::supportsThreadedFontRendering()) {
+        // Files are spread over the threads, so each one encodes its own pages.
+        options.m_encodingThreads = 1;
+
+        QThreadPool pool;
+        for (const auto &filePath : files) {
+            pool.start(new VExportFileTask(filePath, options, &failures));
+        }
+
+        pool.waitForDone();
+    } else {
+        options.m_encodingThreads = QThread::idealThreadCount();
+        for (const auto &filePath : files) {
+            if (!exportFile(filePath, options)) {
+                failures.ref();
+            }
+        }
+    }
+
+    return failures.load();
+}
+
+// Lay out a document of c_benchmarkLines short lines at once and print the time
+// taken and the memory held by the layout.
+static int runBenchmark(const QCommandLineParser &p_parser)
+{
+    QString text;
+    text.reserve(c_benchmarkLines * 16);
+    for (int i = 0; i < c_benchmarkLines; ++i) {
+        text += QString("line %1\n").arg(i);
+    }
+
+    VImageResourceManager2 imageMgr;
+    QTextDocument doc;
+    VTextDocumentLayout *layout = new VTextDocumentLayout(&doc, &imageMgr);
+    // Measure all the blocks instead of a frame budget of them.
+    layout->setFrameBudget(0);
+    doc.setDocumentLayout(layout);
+    doc.setPageSize(QSizeF(p_parser.value("width").toDouble(), -1));
+
+    QElapsedTimer timer;
+    timer.start();
+    doc.setPlainText(text);
+    qint64 elapsed = timer.elapsed();
+
+    VTextDocumentLayout::MemoryUsage usage = layout->memoryUsage();
+    qInfo() << "laid out" << doc.blockCount() << "blocks in" << elapsed << "ms";
+    qInfo() << "layouts" << usage.m_layoutBytes << "bytes, block infos" << usage.m_blockInfoBytes
+            << "bytes, metrics cache" << usage.m_metricsCacheBytes << "bytes";
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    // Export or benchmark without a display.
+    for (int i = 1; i < argc; ++i) {
+        QByteArray arg(argv[i]);
+        if ((arg.startsWith("--export") || arg == "--benchmark")
+            && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+            break;
+        }
+    }
+
     QApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption("export", "Export the files as <format> (pdf or png) and quit.", "format"));
+    parser.addOption(QCommandLineOption("output", "Directory of the exported files.", "dir", "."));
+    parser.addOption(QCommandLineOption("width", "Text width in pixels.", "width", "800"));
+    parser.addOption(QCommandLineOption("page-height", "Page height in pixels of png.", "height", "1130"));
+    parser.addOption(QCommandLineOption("page-size", "Page size in millimeters of pdf.", "WxH", "210x297"));
+    parser.addOption(QCommandLineOption("margin", "Page margin in millimeters of pdf.", "margin", "15"));
+    parser.addOption(QCommandLineOption("benchmark", "Lay out a document of 1M short lines, print the time taken and quit."));
+    parser.addPositionalArgument("files", "Files to export.");
+    parser.process(a);
+
+    if (parser.isSet("export")) {
+        return exportFiles(parser);
+    }
+
+    if (parser.isSet("benchmark")) {
+        return runBenchmark(parser);
+    }
+
     MainWindow w;
     w.show();
 
@@ -0,0 +1,122 @@
+#include "vcodeblockindex.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+
+#include <algorithm>
+
+#include "vtextedit.h"
+
+
+VCodeBlockIndex::VCodeBlockIndex(const QTextDocument *p_document, QObject *p_parent)
+    : QObject(p_parent),
+      m_document(p_document),
+      m_blockCount(p_document->blockCount()),
+      m_dirtyFirst(0),
+      m_dirtyLast(p_document->blockCount() - 1)
+{
+}
+
+int VCodeBlockIndex::lineNumberInCodeBlock(int p_blockNumber) const
+{
+    updateIndex();
+
+    // The last start before @p_blockNumber.
+    auto it = std::lower_bound(m_starts.constBegin(), m_starts.constEnd(), p_blockNumber);
+    if (it == m_starts.constBegin()) {
+        return 0;
+    }
+
+    --it;
+    return p_blockNumber - *it;
+}
+
+void VCodeBlockIndex::invalidate(int p_firstBlock, int p_lastBlock)
+{
+    if (p_firstBlock > p_lastBlock) {
+        return;
+    }
+
+    if (m_dirtyFirst == -1) {
+        m_dirtyFirst = p_firstBlock;
+        m_dirtyLast = p_lastBlock;
+    } else {
+        m_dirtyFirst = qMin(m_dirtyFirst, p_firstBlock);
+        m_dirtyLast = qMax(m_dirtyLast, p_lastBlock);
+    }
+}
+
+void VCodeBlockIndex::handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+
+    const int newBlockCount = m_document->blockCount();
+    const int delta = newBlockCount - m_blockCount;
+    m_blockCount = newBlockCount;
+
+    QTextBlock firstBlock = m_document->findBlock(p_from);
+    QTextBlock lastBlock = m_document->findBlock(p_from + p_charsAdded);
+    const int first = firstBlock.isValid() ? firstBlock.blockNumber() : 0;
+    const int last = lastBlock.isValid() ? lastBlock.blockNumber() : newBlockCount - 1;
+
+    // Blocks [first, oldLast] before the change are now [first, last].
+    const int oldLast = last - delta;
+
+    // Drop the starts within the changed blocks and shift the following ones.
+    auto lo = std::lower_bound(m_starts.begin(), m_starts.end(), first);
+    auto hi = std::upper_bound(lo, m_starts.end(), oldLast);
+    const int idx = lo - m_starts.begin();
+    m_starts.erase(lo, hi);
+    if (delta != 0) {
+        for (int i = idx; i < m_starts.size(); ++i) {
+            m_starts[i] += delta;
+        }
+    }
+
+    // Shift the pending dirty range.
+    if (m_dirtyFirst != -1) {
+        if (m_dirtyFirst > oldLast) {
+            m_dirtyFirst += delta;
+        }
+
+        if (m_dirtyLast > oldLast) {
+            m_dirtyLast += delta;
+        } else if (m_dirtyLast > last) {
+            m_dirtyLast = last;
+        }
+    }
+
+    invalidate(first, last);
+}
+
+void VCodeBlockIndex::updateIndex() const
+{
+    if (m_dirtyFirst == -1) {
+        return;
+    }
+
+    const int first = qMax(0, m_dirtyFirst);
+    const int last = qMin(m_dirtyLast, m_document->blockCount() - 1);
+    m_dirtyFirst = m_dirtyLast = -1;
+    if (first > last) {
+        return;
+    }
+
+    auto lo = std::lower_bound(m_starts.begin(), m_starts.end(), first);
+    auto hi = std::upper_bound(lo, m_starts.end(), last);
+    const int idx = lo - m_starts.begin();
+    m_starts.erase(lo, hi);
+
+    QVector<int> starts;
+    QTextBlock block = m_document->findBlockByNumber(first);
+    for (int i = first; i <= last && block.isValid(); ++i, block = block.next()) {
+        if (block.userState() == (int)BlockState::CodeBlockStart) {
+            starts.append(i);
+        }
+    }
+
+    if (!starts.isEmpty()) {
+        m_starts.insert(idx, starts.size(), 0);
+        std::copy(starts.constBegin(), starts.constEnd(), m_starts.begin() + idx);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef VCODEBLOCKINDEX_H
+#define VCODEBLOCKINDEX_H
+
+#include <QObject>
+#include <QVector>
+
+class QTextDocument;
+
+
+// Index of the code blocks of a document built from the BlockState user states
+// of the blocks.
+// It is updated incrementally from document changes. Changed blocks are only
+// re-scanned when the index is queried, after the states have been updated.
+class VCodeBlockIndex : public QObject
+{
+    Q_OBJECT
+public:
+    explicit VCodeBlockIndex(const QTextDocument *p_document, QObject *p_parent = nullptr);
+
+    // Return the line number of block @p_blockNumber within its code block,
+    // which is its distance to the nearest CodeBlockStart block before it.
+    // Return 0 if there is no CodeBlockStart block before it.
+    int lineNumberInCodeBlock(int p_blockNumber) const;
+
+    // Re-scan the states of blocks [@p_firstBlock, @p_lastBlock].
+    // Should be called if block states are changed without notifying the layout.
+    void invalidate(int p_firstBlock, int p_lastBlock);
+
+public slots:
+    // Should be called on each change of the document, including changes
+    // marked via QTextDocument::markContentsDirty().
+    void handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded);
+
+private:
+    // Re-scan the dirty blocks.
+    void updateIndex() const;
+
+    const QTextDocument *m_document;
+
+    // Block count when last updated.
+    int m_blockCount;
+
+    // Sorted block numbers of all the CodeBlockStart blocks.
+    mutable QVector<int> m_starts;
+
+    // Range of blocks [first, last] to re-scan. -1 for none.
+    mutable int m_dirtyFirst;
+
+    mutable int m_dirtyLast;
+};
+
+#endif // VCODEBLOCKINDEX_H
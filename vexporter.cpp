@@ -0,0 +1,134 @@
+#include "vexporter.h"
+
+#include <QTextDocument>
+#include <QImage>
+#include <QPainter>
+#include <QPdfWriter>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QtMath>
+#include <QDebug>
+
+#include "vtextdocumentlayout.h"
+
+
+// Encode a page image and write it to a PNG file in the thread pool.
+class VPageImageTask : public QRunnable
+{
+public:
+    VPageImageTask(const QImage &p_image,
+                   const QString &p_filePath,
+                   QAtomicInt *p_failures,
+                   QSemaphore *p_slots)
+        : m_image(p_image),
+          m_filePath(p_filePath),
+          m_failures(p_failures),
+          m_slots(p_slots)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        if (!m_image.save(m_filePath, "PNG")) {
+            qWarning() << "failed to write page image" << m_filePath;
+            m_failures->ref();
+        }
+
+        m_slots->release();
+    }
+
+private:
+    QImage m_image;
+
+    QString m_filePath;
+
+    QAtomicInt *m_failures;
+
+    QSemaphore *m_slots;
+};
+
+VExporter::VExporter(QTextDocument *p_document)
+    : m_document(p_document),
+      m_layout(qobject_cast<VTextDocumentLayout *>(p_document->documentLayout()))
+{
+}
+
+VExporter::~VExporter()
+{
+    m_threadPool.waitForDone();
+}
+
+bool VExporter::exportImages(const QString &p_filePathPattern, qreal p_pageHeight, qreal p_scale)
+{
+    if (!m_layout) {
+        qWarning() << "document is not laid out by VTextDocumentLayout";
+        return false;
+    }
+
+    QVector<QRectF> pages = m_layout->paginate(p_pageHeight);
+    const int width = qCeil(m_layout->documentSize().width());
+
+    // Limit the pages in flight to bound the memory.
+    QSemaphore slots(m_threadPool.maxThreadCount() * 2);
+    QAtomicInt failures(0);
+    for (int i = 0; i < pages.size(); ++i) {
+        slots.acquire();
+
+        QImage image(QSize(width, qCeil(p_pageHeight)) * p_scale, QImage::Format_ARGB32_Premultiplied);
+        image.setDevicePixelRatio(p_scale);
+        image.fill(Qt::white);
+
+        QPainter painter(&image);
+        painter.setRenderHints(QPainter::Antialiasing | QPainter::TextAntialiasing | QPainter::SmoothPixmapTransform);
+        m_layout->drawPage(&painter, pages[i]);
+        painter.end();
+
+        m_threadPool.start(new VPageImageTask(image,
+                                              p_filePathPattern.arg(i + 1),
+                                              &failures,
+                                              &slots));
+    }
+
+    m_threadPool.waitForDone();
+    return failures.load() == 0;
+}
+
+bool VExporter::exportPdf(const QString &p_filePath, const QPageLayout &p_pageLayout)
+{
+    if (!m_layout) {
+        qWarning() << "document is not laid out by VTextDocumentLayout";
+        return false;
+    }
+
+    QPdfWriter writer(p_filePath);
+    writer.setPageLayout(p_pageLayout);
+    writer.setCreator(QStringLiteral("VTextEdit"));
+
+    QPainter painter;
+    if (!painter.begin(&writer)) {
+        qWarning() << "failed to write PDF file" << p_filePath;
+        return false;
+    }
+
+    QRect paintRect = p_pageLayout.paintRectPixels(writer.resolution());
+    qreal scale = paintRect.width() / qMax(m_layout->documentSize().width(), qreal(1));
+    QVector<QRectF> pages = m_layout->paginate(paintRect.height() / scale);
+    for (int i = 0; i < pages.size(); ++i) {
+        if (i > 0) {
+            writer.newPage();
+        }
+
+        painter.save();
+        painter.scale(scale, scale);
+        m_layout->drawPage(&painter, pages[i]);
+        painter.restore();
+    }
+
+    return painter.end();
+}
+
+void VExporter::setEncodingThreadCount(int p_count)
+{
+    m_threadPool.setMaxThreadCount(qMax(1, p_count));
+}
@@ -0,0 +1,43 @@
+#ifndef VEXPORTER_H
+#define VEXPORTER_H
+
+#include <QString>
+#include <QThreadPool>
+#include <QPageLayout>
+
+class QTextDocument;
+class VTextDocumentLayout;
+
+
+// Export a document laid out by VTextDocumentLayout to PNG or PDF pages.
+// Pages are split by the block metrics of the layout. Since the document is not
+// thread-safe, pages are painted on the thread of the document, while PNG pages
+// are encoded and written on worker threads. Documents without images may live
+// on a worker thread, since pages are painted to QImage or QPdfWriter.
+class VExporter
+{
+public:
+    explicit VExporter(QTextDocument *p_document);
+
+    ~VExporter();
+
+    // Export pages of height @p_pageHeight to PNG files.
+    // @p_filePathPattern: file path with %1 for the 1-based page number.
+    // @p_scale: device pixel ratio of the images.
+    bool exportImages(const QString &p_filePathPattern, qreal p_pageHeight, qreal p_scale = 1);
+
+    // Export to PDF file @p_filePath, scaling the document to the page width.
+    bool exportPdf(const QString &p_filePath, const QPageLayout &p_pageLayout);
+
+    // Set the maximum count of the threads encoding PNG pages.
+    void setEncodingThreadCount(int p_count);
+
+private:
+    QTextDocument *m_document;
+
+    VTextDocumentLayout *m_layout;
+
+    QThreadPool m_threadPool;
+};
+
+#endif // VEXPORTER_H
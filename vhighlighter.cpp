@@ -0,0 +1,242 @@
+#include "vhighlighter.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+#include <QElapsedTimer>
+
+#include "vtextedit.h"
+#include "vtextdocumentlayout.h"
+
+
+// Time budget in ms to highlight from a block within the viewport.
+static const int c_visibleBudget = 8;
+
+// Time budget in ms of one idle slice.
+static const int c_idleBudget = 4;
+
+// Interval in ms between two idle slices.
+static const int c_idleInterval = 30;
+
+static bool isFence(const QString &p_text)
+{
+    QString text = p_text.trimmed();
+    return text.startsWith(QStringLiteral("```")) || text.startsWith(QStringLiteral("~~~"));
+}
+
+static bool isInCodeBlock(int p_state)
+{
+    return p_state == (int)BlockState::CodeBlockStart
+           || p_state == (int)BlockState::CodeBlock;
+}
+
+static void appendFormat(QVector<QTextLayout::FormatRange> &p_formats,
+                         int p_start,
+                         int p_length,
+                         const QTextCharFormat &p_format)
+{
+    QTextLayout::FormatRange o;
+    o.start = p_start;
+    o.length = p_length;
+    o.format = p_format;
+    p_formats.append(o);
+}
+
+VHighlighter::VHighlighter(QTextDocument *p_document,
+                           VTextDocumentLayout *p_layout,
+                           QObject *p_parent)
+    : QObject(p_parent),
+      m_document(p_document),
+      m_layout(p_layout),
+      m_blockCount(p_document->blockCount()),
+      m_dirtyFirst(-1),
+      m_changedLast(-1)
+{
+    m_codeBlockFormat.setBackground(QColor("#EEEEEE"));
+    m_commentFormat.setForeground(QColor("#9E9E9E"));
+
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout,
+            this, &VHighlighter::highlightDirtyBlocks);
+
+    rehighlight();
+}
+
+void VHighlighter::setCodeBlockFormat(const QTextCharFormat &p_format)
+{
+    m_codeBlockFormat = p_format;
+    rehighlight();
+}
+
+void VHighlighter::setCommentFormat(const QTextCharFormat &p_format)
+{
+    m_commentFormat = p_format;
+    rehighlight();
+}
+
+void VHighlighter::rehighlight()
+{
+    m_blockCount = m_document->blockCount();
+    m_dirtyFirst = 0;
+    m_changedLast = m_blockCount - 1;
+    scheduleHighlight();
+}
+
+void VHighlighter::handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+
+    const int newBlockCount = m_document->blockCount();
+    const int delta = newBlockCount - m_blockCount;
+    m_blockCount = newBlockCount;
+
+    QTextBlock firstBlock = m_document->findBlock(p_from);
+    QTextBlock lastBlock = m_document->findBlock(p_from + p_charsAdded);
+    const int first = firstBlock.isValid() ? firstBlock.blockNumber() : 0;
+    const int last = lastBlock.isValid() ? lastBlock.blockNumber() : newBlockCount - 1;
+
+    // Blocks [first, oldLast] before the change are now [first, last].
+    const int oldLast = last - delta;
+
+    if (m_dirtyFirst == -1) {
+        m_dirtyFirst = first;
+        m_changedLast = last;
+    } else {
+        if (m_dirtyFirst > oldLast) {
+            m_dirtyFirst += delta;
+        }
+
+        if (m_changedLast > oldLast) {
+            m_changedLast += delta;
+        }
+
+        m_dirtyFirst = qMin(m_dirtyFirst, first);
+        m_changedLast = qMax(m_changedLast, last);
+    }
+
+    scheduleHighlight();
+}
+
+bool VHighlighter::isDirtyBlockVisible() const
+{
+    int first, last;
+    return m_layout->viewportBlockRange(first, last) && m_dirtyFirst <= last;
+}
+
+void VHighlighter::scheduleHighlight()
+{
+    if (m_dirtyFirst == -1) {
+        m_timer.stop();
+        return;
+    }
+
+    // Highlight the viewport at once and the rest when idle.
+    m_timer.start(isDirtyBlockVisible() ? 0 : c_idleInterval);
+}
+
+void VHighlighter::highlightDirtyBlocks()
+{
+    if (m_dirtyFirst == -1) {
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    const int budget = isDirtyBlockVisible() ? c_visibleBudget : c_idleBudget;
+
+    QTextBlock block = m_document->findBlockByNumber(m_dirtyFirst);
+    if (!block.isValid()) {
+        m_dirtyFirst = -1;
+        return;
+    }
+
+    const int first = block.blockNumber();
+    int last = first;
+    QTextBlock prevBlock = block.previous();
+    int prevState = prevBlock.isValid() ? prevBlock.userState() : (int)BlockState::Normal;
+    while (block.isValid()) {
+        const int num = block.blockNumber();
+        const int oldState = block.userState();
+
+        VHighlightBlockData *data = dynamic_cast<VHighlightBlockData *>(block.userData());
+        if (!data) {
+            data = new VHighlightBlockData();
+            block.setUserData(data);
+        }
+
+        data->m_formats.clear();
+        int state = highlightText(block.text(), prevState, data->m_formats);
+        block.setUserState(state);
+
+        last = num;
+        prevState = state;
+        block = block.next();
+
+        if (state == oldState && num >= m_changedLast) {
+            // Converged.
+            block = QTextBlock();
+            break;
+        }
+
+        if (timer.elapsed() >= budget) {
+            break;
+        }
+    }
+
+    m_dirtyFirst = block.isValid() ? block.blockNumber() : -1;
+
+    emit highlightChanged(first, last);
+
+    scheduleHighlight();
+}
+
+int VHighlighter::highlightText(const QString &p_text,
+                                int p_prevState,
+                                QVector<QTextLayout::FormatRange> &p_formats) const
+{
+    if (isInCodeBlock(p_prevState)) {
+        appendFormat(p_formats, 0, p_text.size(), m_codeBlockFormat);
+        return isFence(p_text) ? (int)BlockState::CodeBlockEnd : (int)BlockState::CodeBlock;
+    }
+
+    if (p_prevState == (int)BlockState::Comment) {
+        int end = p_text.indexOf(QStringLiteral("-->"));
+        if (end == -1) {
+            appendFormat(p_formats, 0, p_text.size(), m_commentFormat);
+            return (int)BlockState::Comment;
+        }
+
+        appendFormat(p_formats, 0, end + 3, m_commentFormat);
+        return highlightComments(p_text, end + 3, p_formats);
+    }
+
+    if (isFence(p_text)) {
+        appendFormat(p_formats, 0, p_text.size(), m_codeBlockFormat);
+        return (int)BlockState::CodeBlockStart;
+    }
+
+    return highlightComments(p_text, 0, p_formats);
+}
+
+int VHighlighter::highlightComments(const QString &p_text,
+                                    int p_pos,
+                                    QVector<QTextLayout::FormatRange> &p_formats) const
+{
+    int pos = p_pos;
+    while (pos < p_text.size()) {
+        int start = p_text.indexOf(QStringLiteral("<!--"), pos);
+        if (start == -1) {
+            break;
+        }
+
+        int end = p_text.indexOf(QStringLiteral("-->"), start + 4);
+        if (end == -1) {
+            appendFormat(p_formats, start, p_text.size() - start, m_commentFormat);
+            return (int)BlockState::Comment;
+        }
+
+        appendFormat(p_formats, start, end + 3 - start, m_commentFormat);
+        pos = end + 3;
+    }
+
+    return (int)BlockState::Normal;
+}
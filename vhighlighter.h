@@ -0,0 +1,97 @@
+#ifndef VHIGHLIGHTER_H
+#define VHIGHLIGHTER_H
+
+#include <QObject>
+#include <QVector>
+#include <QTextLayout>
+#include <QTextBlockUserData>
+#include <QTextCharFormat>
+#include <QTimer>
+
+class QTextDocument;
+class VTextDocumentLayout;
+
+
+// Highlight formats of a block, painted by VTextDocumentLayout without
+// changing the layout of the block.
+class VHighlightBlockData : public QTextBlockUserData
+{
+public:
+    QVector<QTextLayout::FormatRange> m_formats;
+};
+
+
+// Incremental highlighter computing the BlockState of each block as its state
+// at the end of the block, which is the start state of the next block.
+// After a change, blocks are re-highlighted from the changed block until the
+// state of a block after the change is the same as before. Work starting within
+// the viewport runs at once within a frame budget, and the rest is deferred to
+// idle time in small slices.
+class VHighlighter : public QObject
+{
+    Q_OBJECT
+public:
+    VHighlighter(QTextDocument *p_document,
+                 VTextDocumentLayout *p_layout,
+                 QObject *p_parent = nullptr);
+
+    void setCodeBlockFormat(const QTextCharFormat &p_format);
+
+    void setCommentFormat(const QTextCharFormat &p_format);
+
+    // Re-highlight all the blocks.
+    void rehighlight();
+
+signals:
+    // Emitted when blocks [@p_firstBlock, @p_lastBlock] are re-highlighted.
+    // Their states may have changed.
+    void highlightChanged(int p_firstBlock, int p_lastBlock);
+
+public slots:
+    // Should be called on each change of the document, including changes
+    // marked via QTextDocument::markContentsDirty().
+    void handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded);
+
+private slots:
+    // Highlight the dirty blocks within a time budget.
+    void highlightDirtyBlocks();
+
+private:
+    // Highlight @p_text with start state @p_prevState.
+    // Return the state at the end of the text.
+    int highlightText(const QString &p_text,
+                      int p_prevState,
+                      QVector<QTextLayout::FormatRange> &p_formats) const;
+
+    // Highlight HTML comments of @p_text from @p_pos out of a code block.
+    int highlightComments(const QString &p_text,
+                          int p_pos,
+                          QVector<QTextLayout::FormatRange> &p_formats) const;
+
+    // Schedule the next slice of work.
+    void scheduleHighlight();
+
+    // Whether the first dirty block is within or above the viewport.
+    bool isDirtyBlockVisible() const;
+
+    QTextDocument *m_document;
+
+    VTextDocumentLayout *m_layout;
+
+    QTextCharFormat m_codeBlockFormat;
+
+    QTextCharFormat m_commentFormat;
+
+    // Block count when last updated.
+    int m_blockCount;
+
+    // The first block to highlight. -1 for none.
+    int m_dirtyFirst;
+
+    // Blocks until this one must be highlighted even if the state converges.
+    int m_changedLast;
+
+    QTimer m_timer;
+};
+
+#endif // VHIGHLIGHTER_H
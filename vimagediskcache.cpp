@@ -0,0 +1,248 @@
+#include "vimagediskcache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QDebug>
+
+#include <algorithm>
+
+
+// Widths of the thumbnails to generate.
+static const int c_thumbnailWidths[] = { 256, 512, 1024 };
+
+static const quint32 c_indexMagic = 0x56494443;
+
+static const quint32 c_indexVersion = 1;
+
+// Default capacity of the cache in bytes.
+static const qint64 c_defaultCapacity = 256 * 1024 * 1024;
+
+// Pruning removes files until the cache takes this ratio of its capacity.
+static const qreal c_pruneRatio = 0.75;
+
+// Add an entry to the cache in its thread pool.
+class VImageCacheTask : public QRunnable
+{
+public:
+    VImageCacheTask(VImageDiskCache *p_cache,
+                    const QString &p_filePath,
+                    const QImage &p_image,
+                    qint64 p_capacity)
+        : m_cache(p_cache),
+          m_filePath(p_filePath),
+          m_image(p_image),
+          m_capacity(p_capacity)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        // The cache waits for the pool on destruction.
+        m_cache->insertEntry(m_filePath, m_image, m_capacity);
+    }
+
+private:
+    VImageDiskCache *m_cache;
+
+    QString m_filePath;
+
+    QImage m_image;
+
+    qint64 m_capacity;
+};
+
+// Mark @p_filePath as used just now for pruning.
+static void touchFile(const QString &p_filePath)
+{
+    QFile file(p_filePath);
+    if (file.open(QIODevice::ReadWrite)) {
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    }
+}
+
+VImageDiskCache::VImageDiskCache(const QString &p_dir)
+    : m_dir(p_dir),
+      m_capacity(c_defaultCapacity)
+{
+    if (m_dir.isEmpty()) {
+        m_dir = QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("images");
+    }
+
+    QDir dir(m_dir);
+    dir.mkpath("index");
+    dir.mkpath("thumbs");
+
+    m_threadPool.setMaxThreadCount(1);
+}
+
+VImageDiskCache::~VImageDiskCache()
+{
+    m_threadPool.waitForDone();
+}
+
+VImageDiskCache *VImageDiskCache::instance()
+{
+    static VImageDiskCache cache;
+    return &cache;
+}
+
+QString VImageDiskCache::indexFilePath(const QString &p_filePath) const
+{
+    QFileInfo fi(p_filePath);
+    QByteArray key = fi.absoluteFilePath().toUtf8()
+                     + '|' + QByteArray::number(fi.lastModified().toMSecsSinceEpoch())
+                     + '|' + QByteArray::number(fi.size());
+    QByteArray hash = QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex();
+    return QDir(m_dir).filePath("index/" + QString::fromLatin1(hash));
+}
+
+QString VImageDiskCache::thumbnailFilePath(const QByteArray &p_contentHash, int p_width) const
+{
+    return QDir(m_dir).filePath(QString("thumbs/%1_%2.png").arg(QString::fromLatin1(p_contentHash.toHex()))
+                                                          .arg(p_width));
+}
+
+bool VImageDiskCache::lookup(const QString &p_filePath, Entry &p_entry) const
+{
+    QFile file(indexFilePath(p_filePath));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&file);
+    quint32 magic = 0, version = 0;
+    in >> magic >> version;
+    if (magic != c_indexMagic || version != c_indexVersion) {
+        return false;
+    }
+
+    Entry entry;
+    in >> entry.m_contentHash >> entry.m_size >> entry.m_thumbnailWidths;
+    if (in.status() != QDataStream::Ok || !entry.isValid()) {
+        return false;
+    }
+
+    file.close();
+    touchFile(file.fileName());
+
+    p_entry = entry;
+    return true;
+}
+
+void VImageDiskCache::insert(const QString &p_filePath, const QImage &p_image)
+{
+    if (p_image.isNull()) {
+        return;
+    }
+
+    m_threadPool.start(new VImageCacheTask(this, p_filePath, p_image, m_capacity));
+}
+
+void VImageDiskCache::insertEntry(const QString &p_filePath, const QImage &p_image, qint64 p_capacity)
+{
+    QFile source(p_filePath);
+    if (!source.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!hash.addData(&source)) {
+        return;
+    }
+
+    Entry entry;
+    entry.m_contentHash = hash.result();
+    entry.m_size = p_image.size();
+
+    for (auto width : c_thumbnailWidths) {
+        if (width >= entry.m_size.width()) {
+            break;
+        }
+
+        QString thumbPath = thumbnailFilePath(entry.m_contentHash, width);
+        if (QFileInfo::exists(thumbPath)) {
+            touchFile(thumbPath);
+        } else {
+            QImage thumb = p_image.scaledToWidth(width, Qt::SmoothTransformation);
+            if (!thumb.save(thumbPath, "PNG")) {
+                qWarning() << "failed to save thumbnail" << thumbPath;
+                continue;
+            }
+        }
+
+        entry.m_thumbnailWidths.append(width);
+    }
+
+    QSaveFile file(indexFilePath(p_filePath));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+
+    QDataStream out(&file);
+    out << c_indexMagic << c_indexVersion;
+    out << entry.m_contentHash << entry.m_size << entry.m_thumbnailWidths;
+    if (!file.commit()) {
+        qWarning() << "failed to save image cache index" << p_filePath;
+        return;
+    }
+
+    prune(p_capacity);
+}
+
+void VImageDiskCache::prune(qint64 p_capacity) const
+{
+    // Both index files and thumbnails, by the time they are last used.
+    QFileInfoList files;
+    qint64 total = 0;
+    const QDir dir(m_dir);
+    for (auto const & sub : { QStringLiteral("index"), QStringLiteral("thumbs") }) {
+        const QFileInfoList infos = QDir(dir.filePath(sub)).entryInfoList(QDir::Files);
+        for (auto const & fi : infos) {
+            total += fi.size();
+        }
+
+        files += infos;
+    }
+
+    if (total <= p_capacity) {
+        return;
+    }
+
+    std::sort(files.begin(), files.end(), [](const QFileInfo &p_a, const QFileInfo &p_b) {
+        return p_a.lastModified() < p_b.lastModified();
+    });
+
+    const qint64 target = (qint64)(p_capacity * c_pruneRatio);
+    for (auto const & fi : files) {
+        if (total <= target) {
+            break;
+        }
+
+        if (QFile::remove(fi.filePath())) {
+            total -= fi.size();
+        }
+    }
+}
+
+QImage VImageDiskCache::loadThumbnail(const Entry &p_entry, int p_width) const
+{
+    for (auto width : p_entry.m_thumbnailWidths) {
+        if (width >= p_width) {
+            const QString thumbPath = thumbnailFilePath(p_entry.m_contentHash, width);
+            QImage thumb(thumbPath);
+            if (!thumb.isNull()) {
+                touchFile(thumbPath);
+                return thumb;
+            }
+        }
+    }
+
+    return QImage();
+}
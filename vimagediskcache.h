@@ -0,0 +1,104 @@
+#ifndef VIMAGEDISKCACHE_H
+#define VIMAGEDISKCACHE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSize>
+#include <QVector>
+#include <QImage>
+#include <QThreadPool>
+
+
+// Local disk cache of image dimensions and pre-scaled thumbnails.
+// An entry is looked up by the source path and its modification time. Thumbnails
+// are stored by the content hash of the source file, so the same image at
+// different paths shares the thumbnails.
+// Entries are added in a worker thread. The least recently used files are
+// removed once the cache exceeds its capacity.
+class VImageDiskCache
+{
+public:
+    struct Entry
+    {
+        Entry()
+        {
+        }
+
+        bool isValid() const
+        {
+            return !m_contentHash.isEmpty() && m_size.isValid();
+        }
+
+        // SHA1 of the content of the source file.
+        QByteArray m_contentHash;
+
+        // Size of the original image.
+        QSize m_size;
+
+        // Widths of the available thumbnails in ascending order.
+        QVector<int> m_thumbnailWidths;
+    };
+
+    // @p_dir: directory to hold the cache. Empty to use the default cache location.
+    explicit VImageDiskCache(const QString &p_dir = QString());
+
+    ~VImageDiskCache();
+
+    // Cache at the default location.
+    static VImageDiskCache *instance();
+
+    // Look up the entry of image file @p_filePath without reading it.
+    bool lookup(const QString &p_filePath, Entry &p_entry) const;
+
+    // Add an entry for image file @p_filePath, which has been decoded as @p_image,
+    // and generate its thumbnails in the background. lookup() finds it once done.
+    void insert(const QString &p_filePath, const QImage &p_image);
+
+    // Load the narrowest thumbnail whose width is not less than @p_width.
+    // Return a null image if there is no such thumbnail.
+    QImage loadThumbnail(const Entry &p_entry, int p_width) const;
+
+    const QString &getDirectory() const;
+
+    // Bytes of the files the cache could hold.
+    void setCapacity(qint64 p_bytes);
+
+    qint64 getCapacity() const;
+
+    // Hash the source, write the thumbnails and the index of @p_filePath and
+    // remove the least recently used files beyond @p_capacity.
+    // Called in the worker thread.
+    void insertEntry(const QString &p_filePath, const QImage &p_image, qint64 p_capacity);
+
+private:
+    QString indexFilePath(const QString &p_filePath) const;
+
+    QString thumbnailFilePath(const QByteArray &p_contentHash, int p_width) const;
+
+    // Remove the least recently used files until the cache fits @p_capacity.
+    void prune(qint64 p_capacity) const;
+
+    QString m_dir;
+
+    qint64 m_capacity;
+
+    // One thread to add the entries.
+    QThreadPool m_threadPool;
+};
+
+inline const QString &VImageDiskCache::getDirectory() const
+{
+    return m_dir;
+}
+
+inline void VImageDiskCache::setCapacity(qint64 p_bytes)
+{
+    m_capacity = p_bytes;
+}
+
+inline qint64 VImageDiskCache::getCapacity() const
+{
+    return m_capacity;
+}
+
+#endif // VIMAGEDISKCACHE_H
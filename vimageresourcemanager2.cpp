@@ -1,22 +1,196 @@
 #include "vimageresourcemanager2.h"
 
+#include <QCryptographicHash>
 #include <QDebug>
+#include <QFile>
+#include <QImageReader>
+#include <QMovie>
+#include <QPainter>
 
 #include "vtextedit.h"
+#include "vimagestore.h"
 
 
-VImageResourceManager2::VImageResourceManager2()
+// Images with more pixels than this will be decoded by tiles.
+static const qint64 c_tilingThreshold = 4096 * 4096;
+
+// Size of one tile in the scaled image.
+static const int c_tileSize = 512;
+
+// Capacity of the scaled images cache in KB.
+static const int c_scaledCacheCapacity = 64 * 1024;
+
+// @p_col and @p_row are -1 for the whole scaled image.
+static QString tileKey(const QString &p_name, const QSize &p_scaledSize, int p_col, int p_row)
+{
+    return p_name + QChar(QChar::Null) + QString("%1x%2@%3,%4").arg(p_scaledSize.width())
+                                                                .arg(p_scaledSize.height())
+                                                                .arg(p_col)
+                                                                .arg(p_row);
+}
+
+static int pixmapCost(const QPixmap &p_pixmap)
 {
+    return qMax(1, int(qint64(p_pixmap.width()) * p_pixmap.height() * p_pixmap.depth() / 8 / 1024));
+}
+
+// SHA1 of the bytes of file @p_filePath, as the content hash of the disk cache.
+// Empty on failure.
+static QByteArray fileHash(const QString &p_filePath)
+{
+    QFile file(p_filePath);
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!file.open(QIODevice::ReadOnly) || !hash.addData(&file)) {
+        return QByteArray();
+    }
+
+    return hash.result();
+}
+
+// Release @p_key of the shared store, which may be gone with the application.
+static void releaseSharedImage(const QByteArray &p_key)
+{
+    VImageStore *store = VImageStore::instance();
+    if (store) {
+        store->release(p_key);
+    }
+}
+
+VImageResourceManager2::VImageResourceManager2(bool p_shared, QObject *p_parent)
+    : QObject(p_parent),
+      m_shared(p_shared),
+      m_scaledCache(c_scaledCacheCapacity),
+      m_diskCache(NULL)
+{
+}
+
+VImageResourceManager2::~VImageResourceManager2()
+{
+    clear();
 }
 
 void VImageResourceManager2::addImage(const QString &p_name,
-                                      const QPixmap &p_image)
+                                      const QPixmap &p_image,
+                                      const QByteArray &p_sourceHash)
 {
-    m_images.insert(p_name, p_image);
+    m_fileImages.remove(p_name);
+    m_decodedFileImages.remove(p_name);
+    removeTiles(p_name);
+    delete m_animations.take(p_name);
+
+    if (!m_shared) {
+        m_images.insert(p_name, p_image);
+        return;
+    }
+
+    VImageStore *store = VImageStore::instance();
+    if (!store) {
+        return;
+    }
+
+    QByteArray key = store->acquire(p_image, p_sourceHash);
+    auto it = m_sharedImages.find(p_name);
+    if (it != m_sharedImages.end()) {
+        store->release(it.value());
+        it.value() = key;
+    } else {
+        m_sharedImages.insert(p_name, key);
+    }
+}
+
+static bool isTilingNeeded(const QSize &p_size)
+{
+    return qint64(p_size.width()) * p_size.height() > c_tilingThreshold;
+}
+
+bool VImageResourceManager2::addImageFile(const QString &p_name, const QString &p_filePath)
+{
+    {
+        QImageReader reader(p_filePath);
+        if (reader.supportsAnimation() && reader.imageCount() != 1) {
+            QMovie *movie = new QMovie(p_filePath, QByteArray(), this);
+            movie->setCacheMode(QMovie::CacheNone);
+            // Decode the first frame only.
+            if (!movie->isValid() || !movie->jumpToFrame(0)) {
+                qWarning() << "failed to read animated image" << p_filePath;
+                delete movie;
+                return false;
+            }
+
+            removeImage(p_name);
+            m_animations.insert(p_name, movie);
+            connect(movie, &QMovie::frameChanged,
+                    this, [this, p_name]() {
+                        emit animationFrameChanged(p_name);
+                    });
+            return true;
+        }
+    }
+
+    VImageDiskCache::Entry entry;
+    if (m_diskCache && m_diskCache->lookup(p_filePath, entry)) {
+        removeImage(p_name);
+
+        // Do not decode it until a suitable thumbnail could not be found.
+        FileImage img;
+        img.m_filePath = p_filePath;
+        img.m_size = entry.m_size;
+        img.m_tiled = isTilingNeeded(entry.m_size);
+        if (img.m_tiled) {
+            img.m_clipRectSupported = QImageReader(p_filePath).supportsOption(QImageIOHandler::ClipRect);
+        }
+
+        img.m_cacheEntry = entry;
+        m_fileImages.insert(p_name, img);
+        return true;
+    }
+
+    QImageReader reader(p_filePath);
+    // Only read the header.
+    QSize size = reader.size();
+    if (!size.isValid() || !isTilingNeeded(size)) {
+        QImage image = reader.read();
+        if (image.isNull()) {
+            qWarning() << "failed to read image" << p_filePath << reader.errorString();
+            return false;
+        }
+
+        if (m_diskCache) {
+            // Added in the background. The entry is looked up when released.
+            m_diskCache->insert(p_filePath, image);
+        }
+
+        addImage(p_name, QPixmap::fromImage(image), m_shared ? fileHash(p_filePath) : QByteArray());
+
+        FileImage img;
+        img.m_filePath = p_filePath;
+        img.m_size = image.size();
+        img.m_cacheEntry = entry;
+        m_decodedFileImages.insert(p_name, img);
+        return true;
+    }
+
+    removeImage(p_name);
+
+    FileImage img;
+    img.m_filePath = p_filePath;
+    img.m_size = size;
+    img.m_tiled = true;
+    img.m_clipRectSupported = reader.supportsOption(QImageIOHandler::ClipRect);
+    m_fileImages.insert(p_name, img);
+    return true;
 }
 
 bool VImageResourceManager2::contains(const QString &p_name) const
 {
+    if (m_fileImages.contains(p_name) || m_animations.contains(p_name)) {
+        return true;
+    }
+
+    if (m_shared) {
+        return m_sharedImages.contains(p_name);
+    }
+
     return m_images.contains(p_name);
 }
 
@@ -24,31 +198,62 @@ void VImageResourceManager2::updateBlockInfos(const QVector<VBlockImageInfo2> &p
 {
     QSet<QString> usedImages;
     m_blocksInfo.clear();
+    m_inlineImagesInfo.clear();
 
     for (auto const & info : p_blocksInfo) {
-        auto it = m_blocksInfo.insert(info.m_blockNumber, info);
-        VBlockImageInfo2 &newInfo = it.value();
+        VBlockImageInfo2 *infoPtr = NULL;
+        if (info.m_inlineImage) {
+            QVector<VBlockImageInfo2> &infos = m_inlineImagesInfo[info.m_blockNumber];
+            infos.append(info);
+            infoPtr = &infos.last();
+        } else {
+            infoPtr = &m_blocksInfo.insert(info.m_blockNumber, info).value();
+        }
+
+        VBlockImageInfo2 &newInfo = *infoPtr;
         if (newInfo.m_padding < 0) {
             newInfo.m_padding = 0;
         }
 
-        auto imageIt = m_images.find(newInfo.m_imageName);
-        if (imageIt != m_images.end()) {
+        QSize size = imageSize(newInfo.m_imageName);
+        if (size.isValid()) {
             // Fill the width and height.
-            newInfo.m_imageSize = imageIt.value().size();
+            newInfo.m_imageSize = size;
             usedImages.insert(newInfo.m_imageName);
         }
     }
 
     // Clear unused images.
-    for (auto it = m_images.begin(); it != m_images.end();) {
+    QStringList unusedImages;
+    for (auto it = m_fileImages.constBegin(); it != m_fileImages.constEnd(); ++it) {
         if (!usedImages.contains(it.key())) {
-            // Remove the image.
-            it = m_images.erase(it);
-        } else {
-            ++it;
+            unusedImages << it.key();
+        }
+    }
+
+    for (auto it = m_animations.constBegin(); it != m_animations.constEnd(); ++it) {
+        if (!usedImages.contains(it.key())) {
+            unusedImages << it.key();
         }
     }
+
+    if (m_shared) {
+        for (auto it = m_sharedImages.constBegin(); it != m_sharedImages.constEnd(); ++it) {
+            if (!usedImages.contains(it.key())) {
+                unusedImages << it.key();
+            }
+        }
+    } else {
+        for (auto it = m_images.constBegin(); it != m_images.constEnd(); ++it) {
+            if (!usedImages.contains(it.key())) {
+                unusedImages << it.key();
+            }
+        }
+    }
+
+    for (auto const & name : unusedImages) {
+        removeImage(name);
+    }
 }
 
 const VBlockImageInfo2 *VImageResourceManager2::findImageInfoByBlock(int p_blockNumber) const
@@ -61,8 +266,28 @@ const VBlockImageInfo2 *VImageResourceManager2::findImageInfoByBlock(int p_block
     return NULL;
 }
 
+const QVector<VBlockImageInfo2> *VImageResourceManager2::findInlineImageInfosByBlock(int p_blockNumber) const
+{
+    auto it = m_inlineImagesInfo.find(p_blockNumber);
+    if (it != m_inlineImagesInfo.end()) {
+        return &it.value();
+    }
+
+    return NULL;
+}
+
 const QPixmap *VImageResourceManager2::findImage(const QString &p_name) const
 {
+    if (m_shared) {
+        auto it = m_sharedImages.find(p_name);
+        VImageStore *store = VImageStore::instance();
+        if (it != m_sharedImages.end() && store) {
+            return store->findImage(it.value());
+        }
+
+        return NULL;
+    }
+
     auto it = m_images.find(p_name);
     if (it != m_images.end()) {
         return &it.value();
@@ -71,8 +296,451 @@ const QPixmap *VImageResourceManager2::findImage(const QString &p_name) const
     return NULL;
 }
 
+QSize VImageResourceManager2::imageSize(const QString &p_name) const
+{
+    auto movieIt = m_animations.find(p_name);
+    if (movieIt != m_animations.end()) {
+        return movieIt.value()->currentPixmap().size();
+    }
+
+    auto it = m_fileImages.find(p_name);
+    if (it != m_fileImages.end()) {
+        return it.value().m_size;
+    }
+
+    const QPixmap *image = findImage(p_name);
+    if (image) {
+        return image->size();
+    }
+
+    return QSize();
+}
+
+void VImageResourceManager2::drawImage(QPainter *p_painter,
+                                       const QString &p_name,
+                                       const QRect &p_targetRect,
+                                       const QRectF &p_clip)
+{
+    const qreal ratio = p_painter->device() ? p_painter->device()->devicePixelRatioF() : 1.0;
+    paintImage(p_painter, p_name, p_targetRect, p_clip, ratio);
+}
+
+void VImageResourceManager2::prepareImage(const QString &p_name,
+                                          const QRect &p_targetRect,
+                                          const QRectF &p_clip,
+                                          qreal p_devicePixelRatio)
+{
+    paintImage(NULL, p_name, p_targetRect, p_clip, p_devicePixelRatio);
+}
+
+void VImageResourceManager2::paintImage(QPainter *p_painter,
+                                        const QString &p_name,
+                                        const QRect &p_targetRect,
+                                        const QRectF &p_clip,
+                                        qreal p_devicePixelRatio)
+{
+    auto movieIt = m_animations.find(p_name);
+    if (movieIt != m_animations.end()) {
+        // Frames change frequently. Do not cache the scaled ones.
+        if (p_painter) {
+            p_painter->drawPixmap(p_targetRect, movieIt.value()->currentPixmap());
+        }
+
+        return;
+    }
+
+    auto it = m_fileImages.find(p_name);
+    if (it != m_fileImages.end()) {
+        // Copy it since it may be decoded and removed from m_fileImages.
+        const FileImage img = it.value();
+        if (img.m_tiled) {
+            drawTiledImage(p_painter, p_name, img, p_targetRect, p_clip, p_devicePixelRatio);
+            return;
+        }
+
+        if (drawThumbnail(p_painter, p_name, img, p_targetRect, p_devicePixelRatio)) {
+            return;
+        }
+
+        // No suitable thumbnail. Decode the original image.
+        if (!decodeFileImage(p_name, img)) {
+            return;
+        }
+    }
+
+    const QPixmap *image = findImage(p_name);
+    Q_ASSERT(image);
+    if (!image) {
+        return;
+    }
+
+    const QSize scaledSize = (QSizeF(p_targetRect.size()) * p_devicePixelRatio).toSize();
+    if (scaledSize != image->size()) {
+        const QPixmap *scaledImage = findScaledImage(p_name, *image, scaledSize, p_devicePixelRatio);
+        if (scaledImage) {
+            image = scaledImage;
+        }
+    }
+
+    if (p_painter) {
+        p_painter->drawPixmap(p_targetRect, *image);
+    }
+}
+
+const QPixmap *VImageResourceManager2::findScaledImage(const QString &p_name,
+                                                       const QPixmap &p_image,
+                                                       const QSize &p_scaledSize,
+                                                       qreal p_devicePixelRatio)
+{
+    if (p_scaledSize.isEmpty()) {
+        return NULL;
+    }
+
+    const QString key = tileKey(p_name, p_scaledSize, -1, -1);
+    QPixmap *pixmap = m_scaledCache.object(key);
+    if (pixmap) {
+        return pixmap;
+    }
+
+    pixmap = new QPixmap(p_image.scaled(p_scaledSize,
+                                        Qt::IgnoreAspectRatio,
+                                        Qt::SmoothTransformation));
+    pixmap->setDevicePixelRatio(p_devicePixelRatio);
+    const QPixmap *ret = pixmap;
+    if (!m_scaledCache.insert(key, pixmap, pixmapCost(*pixmap))) {
+        return NULL;
+    }
+
+    return ret;
+}
+
+bool VImageResourceManager2::drawThumbnail(QPainter *p_painter,
+                                           const QString &p_name,
+                                           const FileImage &p_image,
+                                           const QRect &p_targetRect,
+                                           qreal p_devicePixelRatio)
+{
+    if (!m_diskCache || p_targetRect.isEmpty()) {
+        return false;
+    }
+
+    const qreal ratio = p_devicePixelRatio;
+    const QSize scaledSize = (QSizeF(p_targetRect.size()) * ratio).toSize();
+    const QString key = tileKey(p_name, scaledSize, -1, -1);
+    QPixmap *pixmap = m_scaledCache.object(key);
+    if (!pixmap) {
+        QImage thumb = m_diskCache->loadThumbnail(p_image.m_cacheEntry, scaledSize.width());
+        if (thumb.isNull()) {
+            return false;
+        }
+
+        pixmap = new QPixmap(QPixmap::fromImage(thumb.scaled(scaledSize,
+                                                             Qt::IgnoreAspectRatio,
+                                                             Qt::SmoothTransformation)));
+        pixmap->setDevicePixelRatio(ratio);
+        if (!m_scaledCache.insert(key, pixmap, pixmapCost(*pixmap))) {
+            return false;
+        }
+    }
+
+    if (p_painter) {
+        p_painter->drawPixmap(p_targetRect, *pixmap);
+    }
+
+    return true;
+}
+
+bool VImageResourceManager2::decodeFileImage(const QString &p_name, const FileImage &p_image)
+{
+    QImageReader reader(p_image.m_filePath);
+    QImage image = reader.read();
+    if (image.isNull()) {
+        qWarning() << "failed to read image" << p_image.m_filePath << reader.errorString();
+        return false;
+    }
+
+    QByteArray sourceHash;
+    if (m_shared) {
+        sourceHash = p_image.m_cacheEntry.m_contentHash;
+        if (sourceHash.isEmpty()) {
+            sourceHash = fileHash(p_image.m_filePath);
+        }
+    }
+
+    addImage(p_name, QPixmap::fromImage(image), sourceHash);
+    m_decodedFileImages.insert(p_name, p_image);
+    return true;
+}
+
+void VImageResourceManager2::drawTiledImage(QPainter *p_painter,
+                                            const QString &p_name,
+                                            const FileImage &p_image,
+                                            const QRect &p_targetRect,
+                                            const QRectF &p_clip,
+                                            qreal p_devicePixelRatio)
+{
+    if (p_targetRect.isEmpty() || p_image.m_size.isEmpty()) {
+        return;
+    }
+
+    QRect visibleRect = p_targetRect;
+    if (p_clip.isValid()) {
+        visibleRect &= p_clip.toAlignedRect();
+        if (visibleRect.isEmpty()) {
+            return;
+        }
+    }
+
+    // Tiles are in device pixels, indexed relative to the top-left of the
+    // target rect.
+    const qreal ratio = p_devicePixelRatio;
+    const QSize scaledSize = (QSizeF(p_targetRect.size()) * ratio).toSize();
+    const QRect scaledRect(QPoint(0, 0), scaledSize);
+    visibleRect.translate(-p_targetRect.topLeft());
+    const QRect deviceRect = QRectF(visibleRect.x() * ratio,
+                                    visibleRect.y() * ratio,
+                                    visibleRect.width() * ratio,
+                                    visibleRect.height() * ratio).toAlignedRect() & scaledRect;
+    const int firstCol = deviceRect.left() / c_tileSize;
+    const int lastCol = deviceRect.right() / c_tileSize;
+    const int firstRow = deviceRect.top() / c_tileSize;
+    const int lastRow = deviceRect.bottom() / c_tileSize;
+    for (int row = firstRow; row <= lastRow; ++row) {
+        for (int col = firstCol; col <= lastCol; ++col) {
+            const QPixmap *tile = findTile(p_name, p_image, scaledSize, col, row, ratio);
+            if (!tile || !p_painter) {
+                continue;
+            }
+
+            QRect tileRect = QRect(col * c_tileSize, row * c_tileSize, c_tileSize, c_tileSize) & scaledRect;
+            QRectF targetRect(tileRect.x() / ratio,
+                              tileRect.y() / ratio,
+                              tileRect.width() / ratio,
+                              tileRect.height() / ratio);
+            p_painter->drawPixmap(targetRect.translated(p_targetRect.topLeft()),
+                                  *tile,
+                                  QRectF(QPointF(0, 0), tile->size()));
+        }
+    }
+}
+
+const QPixmap *VImageResourceManager2::findTile(const QString &p_name,
+                                                const FileImage &p_image,
+                                                const QSize &p_scaledSize,
+                                                int p_col,
+                                                int p_row,
+                                                qreal p_devicePixelRatio)
+{
+    QString key = tileKey(p_name, p_scaledSize, p_col, p_row);
+    QPixmap *tile = m_scaledCache.object(key);
+    if (tile) {
+        return tile;
+    }
+
+    const QRect scaledRect(QPoint(0, 0), p_scaledSize);
+    const qreal sx = (qreal)p_image.m_size.width() / p_scaledSize.width();
+    const qreal sy = (qreal)p_image.m_size.height() / p_scaledSize.height();
+
+    if (p_image.m_clipRectSupported) {
+        // Decode only the region of this tile.
+        QRect tileRect = QRect(p_col * c_tileSize, p_row * c_tileSize, c_tileSize, c_tileSize) & scaledRect;
+        QRect sourceRect = QRectF(tileRect.x() * sx,
+                                  tileRect.y() * sy,
+                                  tileRect.width() * sx,
+                                  tileRect.height() * sy).toAlignedRect();
+        sourceRect &= QRect(QPoint(0, 0), p_image.m_size);
+
+        QImageReader reader(p_image.m_filePath);
+        reader.setClipRect(sourceRect);
+        reader.setScaledSize(tileRect.size());
+        QImage image = reader.read();
+        if (image.isNull()) {
+            qWarning() << "failed to decode tile of image" << p_image.m_filePath << reader.errorString();
+            return NULL;
+        }
+
+        tile = new QPixmap(QPixmap::fromImage(image));
+        tile->setDevicePixelRatio(p_devicePixelRatio);
+        const QPixmap *ret = tile;
+        if (!m_scaledCache.insert(key, tile, pixmapCost(*tile))) {
+            // Larger than the cache. It is deleted by the cache.
+            return NULL;
+        }
+
+        return ret;
+    }
+
+    // The format could not decode a region. Decode it once at the scaled size
+    // and cut all the tiles from it.
+    QImageReader reader(p_image.m_filePath);
+    reader.setScaledSize(p_scaledSize);
+    QImage image = reader.read();
+    if (image.isNull()) {
+        qWarning() << "failed to decode image" << p_image.m_filePath << reader.errorString();
+        return NULL;
+    }
+
+    const int cols = (p_scaledSize.width() + c_tileSize - 1) / c_tileSize;
+    const int rows = (p_scaledSize.height() + c_tileSize - 1) / c_tileSize;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            QRect tileRect = QRect(col * c_tileSize, row * c_tileSize, c_tileSize, c_tileSize) & scaledRect;
+            QPixmap *pixmap = new QPixmap(QPixmap::fromImage(image.copy(tileRect)));
+            pixmap->setDevicePixelRatio(p_devicePixelRatio);
+            m_scaledCache.insert(tileKey(p_name, p_scaledSize, col, row), pixmap, pixmapCost(*pixmap));
+        }
+    }
+
+    return m_scaledCache.object(key);
+}
+
+void VImageResourceManager2::removeTiles(const QString &p_name)
+{
+    const QString prefix = p_name + QChar(QChar::Null);
+    const QList<QString> keys = m_scaledCache.keys();
+    for (auto const & key : keys) {
+        if (key.startsWith(prefix)) {
+            m_scaledCache.remove(key);
+        }
+    }
+}
+
+void VImageResourceManager2::removeImage(const QString &p_name)
+{
+    m_decodedFileImages.remove(p_name);
+
+    QMovie *movie = m_animations.take(p_name);
+    if (movie) {
+        delete movie;
+        return;
+    }
+
+    if (m_fileImages.remove(p_name)) {
+        removeTiles(p_name);
+        return;
+    }
+
+    if (m_shared) {
+        auto it = m_sharedImages.find(p_name);
+        if (it != m_sharedImages.end()) {
+            releaseSharedImage(it.value());
+            m_sharedImages.erase(it);
+        }
+    } else {
+        m_images.remove(p_name);
+    }
+}
+
 void VImageResourceManager2::clear()
 {
     m_blocksInfo.clear();
+    m_inlineImagesInfo.clear();
     m_images.clear();
+    m_fileImages.clear();
+    m_decodedFileImages.clear();
+    m_scaledCache.clear();
+
+    qDeleteAll(m_animations);
+    m_animations.clear();
+
+    for (auto it = m_sharedImages.constBegin(); it != m_sharedImages.constEnd(); ++it) {
+        releaseSharedImage(it.value());
+    }
+
+    m_sharedImages.clear();
+}
+
+void VImageResourceManager2::releaseDecodedImages()
+{
+    for (auto it = m_decodedFileImages.constBegin(); it != m_decodedFileImages.constEnd(); ++it) {
+        const QString &name = it.key();
+        auto sharedIt = m_sharedImages.find(name);
+        if (sharedIt != m_sharedImages.end()) {
+            releaseSharedImage(sharedIt.value());
+            m_sharedImages.erase(sharedIt);
+        } else {
+            m_images.remove(name);
+        }
+
+        FileImage img = it.value();
+        if (m_diskCache && !img.m_cacheEntry.isValid()) {
+            // Added to the disk cache in the background when decoded.
+            m_diskCache->lookup(img.m_filePath, img.m_cacheEntry);
+        }
+
+        m_fileImages.insert(name, img);
+    }
+
+    m_decodedFileImages.clear();
+    m_scaledCache.clear();
+}
+
+qint64 VImageResourceManager2::memoryUsage() const
+{
+    qint64 bytes = 0;
+    for (auto it = m_images.constBegin(); it != m_images.constEnd(); ++it) {
+        const QPixmap &image = it.value();
+        bytes += (qint64)image.width() * image.height() * image.depth() / 8;
+    }
+
+    // The cost of the cache is in KB.
+    bytes += (qint64)m_scaledCache.totalCost() * 1024;
+    return bytes;
+}
+
+void VImageResourceManager2::setDiskCache(VImageDiskCache *p_cache)
+{
+    m_diskCache = p_cache;
+}
+
+void VImageResourceManager2::setShared(bool p_shared)
+{
+    if (m_shared == p_shared) {
+        return;
+    }
+
+    // Move the decoded images to the new storage, so the blocks keep their
+    // images and sizes without a relayout.
+    VImageStore *store = VImageStore::instance();
+    if (p_shared) {
+        if (!store) {
+            // Gone with the application.
+            return;
+        }
+
+        for (auto it = m_images.constBegin(); it != m_images.constEnd(); ++it) {
+            m_sharedImages.insert(it.key(), store->acquire(it.value()));
+        }
+
+        m_images.clear();
+    } else {
+        for (auto it = m_sharedImages.constBegin(); it != m_sharedImages.constEnd(); ++it) {
+            const QPixmap *image = store ? store->findImage(it.value()) : NULL;
+            if (image) {
+                m_images.insert(it.key(), *image);
+            }
+
+            releaseSharedImage(it.value());
+        }
+
+        m_sharedImages.clear();
+    }
+
+    m_shared = p_shared;
+}
+
+void VImageResourceManager2::setVisibleAnimations(const QSet<QString> &p_names)
+{
+    for (auto it = m_animations.begin(); it != m_animations.end(); ++it) {
+        QMovie *movie = it.value();
+        if (p_names.contains(it.key())) {
+            if (movie->state() == QMovie::NotRunning) {
+                movie->start();
+            } else if (movie->state() == QMovie::Paused) {
+                movie->setPaused(false);
+            }
+        } else if (movie->state() == QMovie::Running) {
+            movie->setPaused(true);
+        }
+    }
 }
@@ -1,23 +1,50 @@
 #ifndef VIMAGERESOURCEMANAGER2_H
 #define VIMAGERESOURCEMANAGER2_H
 
+#include <QObject>
 #include <QHash>
+#include <QSet>
 #include <QString>
 #include <QPixmap>
 #include <QTextBlock>
 #include <QVector>
+#include <QCache>
+#include <QRect>
+
+#include "vimagediskcache.h"
 
 struct VBlockImageInfo2;
+class QPainter;
+class QMovie;
 
 
-class VImageResourceManager2
+class VImageResourceManager2 : public QObject
 {
+    Q_OBJECT
 public:
-    VImageResourceManager2();
+    // @p_shared: whether hold the images in the process-wide VImageStore
+    // so that they could be shared with other editors.
+    explicit VImageResourceManager2(bool p_shared = false, QObject *p_parent = nullptr);
+
+    ~VImageResourceManager2();
 
     // Add an image to the resource with @p_name as the key.
     // If @p_name already exists in the resources, it will update it.
-    void addImage(const QString &p_name, const QPixmap &p_image);
+    // @p_sourceHash: SHA1 of the encoded source of @p_image if available, which
+    // saves hashing the pixels in the shared store.
+    void addImage(const QString &p_name,
+                  const QPixmap &p_image,
+                  const QByteArray &p_sourceHash = QByteArray());
+
+    // Add an image from file @p_filePath with @p_name as the key.
+    // Images larger than the tiling threshold are not decoded here. They will be
+    // decoded tile by tile for the region to draw only.
+    // Images found in the disk cache are not decoded either. The cached thumbnails
+    // will be drawn if possible.
+    // Animated images are played with frames decoded lazily. They are paused until
+    // they are set visible via setVisibleAnimations().
+    // Returns false if failed to read the image.
+    bool addImageFile(const QString &p_name, const QString &p_filePath);
 
     // Whether the resources contains image with name @p_name.
     bool contains(const QString &p_name) const;
@@ -28,16 +55,185 @@ public:
 
     const VBlockImageInfo2 *findImageInfoByBlock(int p_blockNumber) const;
 
+    // Return infos of the inline images of block @p_blockNumber.
+    // Return NULL if there is no inline image in that block.
+    const QVector<VBlockImageInfo2> *findInlineImageInfosByBlock(int p_blockNumber) const;
+
+    // Return NULL for images not decoded yet, which should be drawn via drawImage().
     const QPixmap *findImage(const QString &p_name) const;
 
+    // Return the original size of image @p_name.
+    QSize imageSize(const QString &p_name) const;
+
+    // Draw image @p_name scaled into @p_targetRect.
+    // Scaled images are kept in the cache so they won't be scaled on each paint.
+    // @p_clip: the region needs to be drawn in the coordinates of @p_painter.
+    // If null, the whole image will be drawn.
+    void drawImage(QPainter *p_painter,
+                   const QString &p_name,
+                   const QRect &p_targetRect,
+                   const QRectF &p_clip = QRectF());
+
+    // Decode and scale image @p_name as drawImage() does for a device of pixel
+    // ratio @p_devicePixelRatio, without drawing, so drawing it later is fast.
+    // Only the tiles of tiled images within @p_clip are decoded.
+    void prepareImage(const QString &p_name,
+                      const QRect &p_targetRect,
+                      const QRectF &p_clip,
+                      qreal p_devicePixelRatio);
+
     void clear();
 
+    bool isShared() const;
+
+    // Switch between the private and the shared storage.
+    // The images are moved to the new storage.
+    void setShared(bool p_shared);
+
+    // Set the disk cache of image sizes and thumbnails. Not owned.
+    // Null to disable it.
+    void setDiskCache(VImageDiskCache *p_cache);
+
+    // Whether image @p_name is an animated image.
+    bool isAnimation(const QString &p_name) const;
+
+    bool hasAnimations() const;
+
+    // Play the animated images in @p_names and pause all the others.
+    void setVisibleAnimations(const QSet<QString> &p_names);
+
+    // Release the images decoded from files and all the scaled images and tiles.
+    // Images from files are decoded again when drawn.
+    void releaseDecodedImages();
+
+    // Bytes of the decoded images, tiles and scaled images held by this manager.
+    // Images in the shared store are not counted.
+    qint64 memoryUsage() const;
+
+signals:
+    // Emitted when animated image @p_name moves to a new frame.
+    void animationFrameChanged(const QString &p_name);
+
 private:
+    // Image from file which is not decoded as a whole.
+    struct FileImage
+    {
+        FileImage()
+            : m_tiled(false),
+              m_clipRectSupported(false)
+        {
+        }
+
+        QString m_filePath;
+
+        // Size of the original image.
+        QSize m_size;
+
+        // Whether decode it tile by tile.
+        bool m_tiled;
+
+        // Whether the image format could decode a region of the image.
+        bool m_clipRectSupported;
+
+        // Entry in the disk cache.
+        VImageDiskCache::Entry m_cacheEntry;
+    };
+
+    void removeImage(const QString &p_name);
+
+    // Implement drawImage() and prepareImage().
+    // @p_painter: NULL to decode and scale only.
+    void paintImage(QPainter *p_painter,
+                    const QString &p_name,
+                    const QRect &p_targetRect,
+                    const QRectF &p_clip,
+                    qreal p_devicePixelRatio);
+
+    // @p_painter: NULL to decode the tiles only.
+    // The tiles are decoded at the device pixels of @p_targetRect.
+    void drawTiledImage(QPainter *p_painter,
+                        const QString &p_name,
+                        const FileImage &p_image,
+                        const QRect &p_targetRect,
+                        const QRectF &p_clip,
+                        qreal p_devicePixelRatio);
+
+    // Draw a cached thumbnail of @p_image scaled into @p_targetRect.
+    // @p_painter: NULL to load the thumbnail only.
+    // Return false if there is no suitable thumbnail.
+    bool drawThumbnail(QPainter *p_painter,
+                       const QString &p_name,
+                       const FileImage &p_image,
+                       const QRect &p_targetRect,
+                       qreal p_devicePixelRatio);
+
+    // Decode the whole image of @p_image and add it as a normal image.
+    bool decodeFileImage(const QString &p_name, const FileImage &p_image);
+
+    // Get tile (@p_col, @p_row) of image @p_name scaled to @p_scaledSize in
+    // device pixels. Decode it if it is not in the tile cache.
+    const QPixmap *findTile(const QString &p_name,
+                            const FileImage &p_image,
+                            const QSize &p_scaledSize,
+                            int p_col,
+                            int p_row,
+                            qreal p_devicePixelRatio);
+
+    // Get image @p_image named @p_name scaled to @p_scaledSize from the cache.
+    // Scale it if not cached.
+    // Return NULL if it could not be cached.
+    const QPixmap *findScaledImage(const QString &p_name,
+                                   const QPixmap &p_image,
+                                   const QSize &p_scaledSize,
+                                   qreal p_devicePixelRatio);
+
+    // Remove all the cached tiles and scaled images of image @p_name.
+    void removeTiles(const QString &p_name);
+
+    // Whether hold images in VImageStore.
+    bool m_shared;
+
     // All the images resources.
     QHash<QString, QPixmap> m_images;
 
-    // Image info of all the blocks with image.
+    // Image name -> key in VImageStore in shared mode.
+    QHash<QString, QByteArray> m_sharedImages;
+
+    // Images from file which are not decoded as a whole.
+    QHash<QString, FileImage> m_fileImages;
+
+    // Images from file which have been decoded as a whole.
+    QHash<QString, FileImage> m_decodedFileImages;
+
+    // Animated images.
+    QHash<QString, QMovie *> m_animations;
+
+    // Decoded tiles of the tiled images and scaled thumbnails.
+    // The cost is in KB.
+    QCache<QString, QPixmap> m_scaledCache;
+
+    VImageDiskCache *m_diskCache;
+
+    // Image info of all the blocks with block image.
     QHash<int, VBlockImageInfo2> m_blocksInfo;
+
+    // Image info of all the blocks with inline images.
+    QHash<int, QVector<VBlockImageInfo2>> m_inlineImagesInfo;
 };
 
+inline bool VImageResourceManager2::isShared() const
+{
+    return m_shared;
+}
+
+inline bool VImageResourceManager2::isAnimation(const QString &p_name) const
+{
+    return m_animations.contains(p_name);
+}
+
+inline bool VImageResourceManager2::hasAnimations() const
+{
+    return !m_animations.isEmpty();
+}
+
 #endif // VIMAGERESOURCEMANAGER2_H
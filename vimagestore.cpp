@@ -0,0 +1,183 @@
+#include "vimagestore.h"
+
+#include <QCryptographicHash>
+#include <QImage>
+#include <QCoreApplication>
+#include <QDebug>
+
+
+static VImageStore *s_store = NULL;
+
+// Whether the store has been destroyed with the application.
+static bool s_destroyed = false;
+
+VImageStore *VImageStore::instance()
+{
+    if (!s_store && !s_destroyed) {
+        s_store = new VImageStore();
+        qAddPostRoutine(&VImageStore::destroy);
+    }
+
+    return s_store;
+}
+
+void VImageStore::destroy()
+{
+    delete s_store;
+    s_store = NULL;
+    s_destroyed = true;
+}
+
+VImageStore::VImageStore()
+    : m_budget(256 * 1024 * 1024),
+      m_bytes(0),
+      m_clock(0)
+{
+}
+
+QByteArray VImageStore::acquire(const QPixmap &p_image, const QByteArray &p_sourceHash)
+{
+    QByteArray key = m_cacheKeys.value(p_image.cacheKey());
+    if (key.isEmpty() || !m_entries.contains(key)) {
+        if (p_sourceHash.isEmpty()) {
+            key = contentHash(p_image);
+        } else {
+            // Not to be confused with the hashes of the pixels.
+            key = 's' + p_sourceHash;
+        }
+    }
+
+    auto it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        Entry entry;
+        entry.m_image = p_image;
+        entry.m_bytes = imageBytes(p_image);
+        it = m_entries.insert(key, entry);
+        m_bytes += entry.m_bytes;
+    }
+
+    Entry &entry = it.value();
+    const qint64 cacheKey = p_image.cacheKey();
+    if (!entry.m_cacheKeys.contains(cacheKey)) {
+        entry.m_cacheKeys.append(cacheKey);
+        m_cacheKeys.insert(cacheKey, key);
+    }
+
+    if (entry.m_refCount == 0) {
+        // In use again.
+        m_unused.remove(entry.m_lastUsed);
+    }
+
+    ++entry.m_refCount;
+    entry.m_lastUsed = ++m_clock;
+
+    evict();
+    return key;
+}
+
+bool VImageStore::addRef(const QByteArray &p_key)
+{
+    auto it = m_entries.find(p_key);
+    if (it == m_entries.end()) {
+        return false;
+    }
+
+    Entry &entry = it.value();
+    if (entry.m_refCount == 0) {
+        // In use again.
+        m_unused.remove(entry.m_lastUsed);
+    }
+
+    ++entry.m_refCount;
+    entry.m_lastUsed = ++m_clock;
+    return true;
+}
+
+void VImageStore::release(const QByteArray &p_key)
+{
+    auto it = m_entries.find(p_key);
+    if (it == m_entries.end()) {
+        return;
+    }
+
+    Entry &entry = it.value();
+    Q_ASSERT(entry.m_refCount > 0);
+    if (--entry.m_refCount == 0) {
+        entry.m_lastUsed = ++m_clock;
+        m_unused.insert(entry.m_lastUsed, p_key);
+        evict();
+    }
+}
+
+bool VImageStore::contains(const QByteArray &p_key) const
+{
+    return m_entries.contains(p_key);
+}
+
+const QPixmap *VImageStore::findImage(const QByteArray &p_key)
+{
+    auto it = m_entries.find(p_key);
+    if (it != m_entries.end()) {
+        touch(p_key, it.value());
+        return &it.value().m_image;
+    }
+
+    return NULL;
+}
+
+void VImageStore::setMemoryBudget(qint64 p_bytes)
+{
+    m_budget = qMax(p_bytes, qint64(0));
+    evict();
+}
+
+void VImageStore::touch(const QByteArray &p_key, Entry &p_entry)
+{
+    if (p_entry.m_refCount == 0) {
+        m_unused.remove(p_entry.m_lastUsed);
+        p_entry.m_lastUsed = ++m_clock;
+        m_unused.insert(p_entry.m_lastUsed, p_key);
+    } else {
+        p_entry.m_lastUsed = ++m_clock;
+    }
+}
+
+void VImageStore::evict()
+{
+    // Images in use are never in m_unused.
+    while (m_bytes > m_budget && !m_unused.isEmpty()) {
+        auto victim = m_entries.find(m_unused.take(m_unused.firstKey()));
+        Q_ASSERT(victim != m_entries.end() && victim.value().m_refCount == 0);
+        if (victim == m_entries.end()) {
+            continue;
+        }
+
+        m_bytes -= victim.value().m_bytes;
+        for (auto cacheKey : victim.value().m_cacheKeys) {
+            m_cacheKeys.remove(cacheKey);
+        }
+
+        m_entries.erase(victim);
+    }
+}
+
+QByteArray VImageStore::contentHash(const QPixmap &p_image)
+{
+    QImage img = p_image.toImage();
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    int header[3] = { img.width(), img.height(), (int)img.format() };
+    hash.addData(reinterpret_cast<const char *>(header), sizeof(header));
+
+    // Hash line by line to skip the padding at the end of each line.
+    const int bytesPerLine = (img.width() * img.depth() + 7) / 8;
+    for (int y = 0; y < img.height(); ++y) {
+        hash.addData(reinterpret_cast<const char *>(img.constScanLine(y)), bytesPerLine);
+    }
+
+    return hash.result();
+}
+
+qint64 VImageStore::imageBytes(const QPixmap &p_image)
+{
+    return qint64(p_image.width()) * p_image.height() * p_image.depth() / 8;
+}
@@ -0,0 +1,115 @@
+#ifndef VIMAGESTORE_H
+#define VIMAGESTORE_H
+
+#include <QHash>
+#include <QMap>
+#include <QByteArray>
+#include <QPixmap>
+#include <QVector>
+
+
+// Process-wide image store shared by all the VImageResourceManager2 working
+// in shared mode.
+// Images are deduplicated by content hash and reference counted by their users.
+// Images no longer referenced are kept as cache until the memory budget is exceeded.
+// Must be used in the GUI thread.
+class VImageStore
+{
+public:
+    // Return NULL once the application is destroyed, which destroys the store
+    // with its pixmaps.
+    static VImageStore *instance();
+
+    // Add image @p_image to the store and return its key.
+    // If an image with the same content already exists, it will be reused.
+    // The caller holds one reference of the key which should be released via release().
+    // @p_sourceHash: hash of the encoded source of @p_image, such as its file,
+    // used as the key instead of hashing the pixels. Empty if not available.
+    QByteArray acquire(const QPixmap &p_image, const QByteArray &p_sourceHash = QByteArray());
+
+    // Add one reference to an existing image @p_key.
+    // Return false if @p_key does not exist.
+    bool addRef(const QByteArray &p_key);
+
+    // Release one reference of image @p_key.
+    void release(const QByteArray &p_key);
+
+    bool contains(const QByteArray &p_key) const;
+
+    const QPixmap *findImage(const QByteArray &p_key);
+
+    // Memory budget in bytes of all the decoded images in the store.
+    void setMemoryBudget(qint64 p_bytes);
+
+    qint64 getMemoryBudget() const;
+
+    // Bytes held by all the images in the store.
+    qint64 memoryUsage() const;
+
+private:
+    struct Entry
+    {
+        Entry()
+            : m_refCount(0),
+              m_bytes(0),
+              m_lastUsed(0)
+        {
+        }
+
+        QPixmap m_image;
+
+        // All the QPixmap::cacheKey() in m_cacheKeys mapped to this image.
+        QVector<qint64> m_cacheKeys;
+
+        int m_refCount;
+
+        qint64 m_bytes;
+
+        // For LRU eviction of unreferenced images.
+        quint64 m_lastUsed;
+    };
+
+    VImageStore();
+
+    // Destroy the store before the application, while pixmaps could still be freed.
+    static void destroy();
+
+    // Evict unreferenced images until the memory usage fits in the budget.
+    void evict();
+
+    // Mark @p_entry of @p_key as used just now without referencing it.
+    void touch(const QByteArray &p_key, Entry &p_entry);
+
+    static QByteArray contentHash(const QPixmap &p_image);
+
+    static qint64 imageBytes(const QPixmap &p_image);
+
+    QHash<QByteArray, Entry> m_entries;
+
+    // QPixmap::cacheKey() -> content hash.
+    // Copies of one pixmap share the same cache key, which saves us hashing
+    // the content again.
+    QHash<qint64, QByteArray> m_cacheKeys;
+
+    // Unreferenced images by the time they are last used, to evict the least
+    // recently used one first.
+    QMap<quint64, QByteArray> m_unused;
+
+    qint64 m_budget;
+
+    qint64 m_bytes;
+
+    quint64 m_clock;
+};
+
+inline qint64 VImageStore::getMemoryBudget() const
+{
+    return m_budget;
+}
+
+inline qint64 VImageStore::memoryUsage() const
+{
+    return m_bytes;
+}
+
+#endif // VIMAGESTORE_H
@@ -1,6 +1,8 @@
 #include "vlinenumberarea.h"
 
 #include <QPaintEvent>
+#include <QPainter>
+#include <QFontMetrics>
 #include <QTextDocument>
 
 VLineNumberArea::VLineNumberArea(VTextEditWithLineNumber *p_editor,
@@ -13,16 +15,18 @@ VLineNumberArea::VLineNumberArea(VTextEditWithLineNumber *p_editor,
       m_document(p_document),
       m_width(0),
       m_blockCount(-1),
+      m_maximumNumber(-1),
       m_digitWidth(p_digitWidth),
       m_digitHeight(p_digitHeight),
       m_foregroundColor("black"),
-      m_backgroundColor("grey")
+      m_backgroundColor("grey"),
+      m_glyphRatio(1)
 {
 }
 
 int VLineNumberArea::calculateWidth() const
 {
-    int bc = m_document->blockCount();
+    int bc = m_maximumNumber > -1 ? m_maximumNumber : m_document->blockCount();
     if (m_blockCount == bc) {
         return m_width;
     }
@@ -40,3 +44,56 @@ int VLineNumberArea::calculateWidth() const
 
     return m_width;
 }
+
+void VLineNumberArea::changeEvent(QEvent *p_event)
+{
+    if (p_event->type() == QEvent::FontChange) {
+        m_digitGlyphs.clear();
+    }
+
+    QWidget::changeEvent(p_event);
+}
+
+void VLineNumberArea::updateDigitGlyphs(qreal p_devicePixelRatio)
+{
+    m_digitGlyphs.clear();
+    m_glyphRatio = p_devicePixelRatio;
+
+    for (int i = 0; i < 2; ++i) {
+        QFont ft = font();
+        ft.setBold(i == 1);
+        QFontMetrics fm(ft);
+        for (int digit = 0; digit < 10; ++digit) {
+            QString str(QLatin1Char(char('0' + digit)));
+            int width = fm.width(str);
+            QPixmap glyph(QSize(width, m_digitHeight) * p_devicePixelRatio);
+            glyph.setDevicePixelRatio(p_devicePixelRatio);
+            glyph.fill(Qt::transparent);
+
+            QPainter painter(&glyph);
+            painter.setFont(ft);
+            painter.setPen(m_foregroundColor);
+            painter.drawText(QRect(0, 0, width, m_digitHeight), Qt::AlignRight, str);
+
+            m_digitGlyphs.append(glyph);
+        }
+    }
+}
+
+void VLineNumberArea::drawNumber(QPainter *p_painter, int p_top, int p_number, bool p_bold)
+{
+    qreal ratio = devicePixelRatioF();
+    if (m_digitGlyphs.isEmpty() || m_glyphRatio != ratio) {
+        updateDigitGlyphs(ratio);
+    }
+
+    const int base = p_bold ? 10 : 0;
+    int number = qAbs(p_number);
+    qreal x = width();
+    do {
+        const QPixmap &glyph = m_digitGlyphs[base + number % 10];
+        x -= glyph.width() / glyph.devicePixelRatio();
+        p_painter->drawPixmap(QPointF(x, p_top), glyph);
+        number /= 10;
+    } while (number > 0);
+}
@@ -3,8 +3,11 @@
 
 #include <QWidget>
 #include <QColor>
+#include <QVector>
+#include <QPixmap>
 
 class QPaintEvent;
+class QPainter;
 class QTextDocument;
 
 
@@ -14,6 +17,8 @@ enum class LineNumberType
     Absolute,
     Relative,
     CodeBlock,
+    // Number each visual line of wrapped blocks.
+    VisualLine,
     Invalid
 };
 
@@ -45,6 +50,18 @@ public:
 
     int calculateWidth() const;
 
+    void setDocument(const QTextDocument *p_document)
+    {
+        m_document = p_document;
+    }
+
+    // Set the maximum number to display for the width calculation.
+    // -1 to use the block count of the document.
+    void setMaximumNumber(int p_number)
+    {
+        m_maximumNumber = p_number;
+    }
+
     int getDigitHeight() const
     {
         return m_digitHeight;
@@ -56,21 +73,38 @@ public:
     const QColor &getForegroundColor() const;
     void setForegroundColor(const QColor &p_color);
 
+    // Draw @p_number right aligned with @p_top as the top.
+    // Digits are blitted from the cached glyphs instead of laid out as text.
+    void drawNumber(QPainter *p_painter, int p_top, int p_number, bool p_bold);
+
 protected:
     void paintEvent(QPaintEvent *p_event) Q_DECL_OVERRIDE
     {
         m_editor->paintLineNumberArea(p_event);
     }
 
+    void changeEvent(QEvent *p_event) Q_DECL_OVERRIDE;
+
 private:
+    // Render glyphs of all the digits in normal and bold fonts.
+    void updateDigitGlyphs(qreal p_devicePixelRatio);
+
     VTextEditWithLineNumber *m_editor;
     const QTextDocument *m_document;
     int m_width;
     int m_blockCount;
+    int m_maximumNumber;
     int m_digitWidth;
     int m_digitHeight;
     QColor m_foregroundColor;
     QColor m_backgroundColor;
+
+    // Glyphs of digits 0-9 followed by the bold ones.
+    // Empty if invalid.
+    QVector<QPixmap> m_digitGlyphs;
+
+    // Device pixel ratio of m_digitGlyphs.
+    qreal m_glyphRatio;
 };
 
 inline const QColor &VLineNumberArea::getBackgroundColor() const
@@ -91,6 +125,7 @@ inline const QColor &VLineNumberArea::getForegroundColor() const
 inline void VLineNumberArea::setForegroundColor(const QColor &p_color)
 {
     m_foregroundColor = p_color;
+    m_digitGlyphs.clear();
 }
 
 #endif // VLINENUMBERAREA_H
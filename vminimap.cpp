@@ -0,0 +1,372 @@
+#include "vminimap.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+#include <QStringList>
+#include <QRunnable>
+#include <QPaintEvent>
+#include <QMouseEvent>
+#include <QPainter>
+
+#include "vtextdocumentlayout.h"
+
+
+// Pixels of the minimap for one line of text.
+static const qreal c_pixelsPerLine = 2;
+
+// Columns of text for one pixel of the minimap.
+static const int c_columnsPerPixel = 2;
+
+static const int c_width = 96;
+
+static const int c_tabStop = 4;
+
+// Maximum number of blocks to summarize in one task.
+static const int c_chunkSize = 16384;
+
+// Set for summarized blocks.
+static const quint32 c_summaryValid = 0x1000000;
+
+// Pack the indentation, length in columns and the density of @p_text.
+static quint32 summarizeText(const QString &p_text)
+{
+    int column = 0;
+    int indent = -1;
+    int length = 0;
+    int filled = 0;
+    for (const QChar &ch : p_text) {
+        if (ch == QLatin1Char('\t')) {
+            column += c_tabStop - column % c_tabStop;
+        } else if (ch.isSpace()) {
+            ++column;
+        } else {
+            if (indent == -1) {
+                indent = column;
+            }
+
+            ++column;
+            ++filled;
+            length = column;
+        }
+
+        if (column >= 0xff) {
+            break;
+        }
+    }
+
+    if (indent == -1) {
+        return c_summaryValid;
+    }
+
+    int density = qMin(filled * 0xff / qMax(1, length - indent), 0xff);
+    return c_summaryValid
+           | ((quint32)density << 16)
+           | ((quint32)qMin(length, 0xff) << 8)
+           | (quint32)indent;
+}
+
+// Summarize a snapshot of the texts of blocks in the thread pool.
+class VMiniMapTask : public QRunnable
+{
+public:
+    VMiniMapTask(VMiniMap *p_receiver, int p_generation, const QStringList &p_texts)
+        : m_receiver(p_receiver),
+          m_generation(p_generation),
+          m_texts(p_texts)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        QVector<quint32> summaries;
+        summaries.reserve(m_texts.size());
+        for (const auto &text : m_texts) {
+            summaries.append(summarizeText(text));
+        }
+
+        // The receiver waits for the pool on destruction.
+        QMetaObject::invokeMethod(m_receiver,
+                                  "applySummaries",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, m_generation),
+                                  Q_ARG(QVector<quint32>, summaries));
+    }
+
+private:
+    VMiniMap *m_receiver;
+
+    int m_generation;
+
+    QStringList m_texts;
+};
+
+VMiniMap::VMiniMap(const QTextDocument *p_document, QWidget *p_parent)
+    : QWidget(p_parent),
+      m_document(p_document),
+      m_blockCount(p_document->blockCount()),
+      m_dirtyFirst(-1),
+      m_dirtyLast(-1),
+      m_pendingFirst(-1),
+      m_pendingLast(-1),
+      m_generation(0),
+      m_lineHeight(1),
+      m_foregroundColor("black"),
+      m_backgroundColor("white")
+{
+    qRegisterMetaType<QVector<quint32>>("QVector<quint32>");
+
+    m_threadPool.setMaxThreadCount(1);
+
+    m_summaries.fill(0, m_blockCount);
+    invalidate(0, m_blockCount - 1);
+}
+
+VMiniMap::~VMiniMap()
+{
+    m_threadPool.clear();
+    m_threadPool.waitForDone();
+}
+
+QSize VMiniMap::sizeHint() const
+{
+    return QSize(c_width, 0);
+}
+
+VTextDocumentLayout *VMiniMap::getLayout() const
+{
+    return qobject_cast<VTextDocumentLayout *>(m_document->documentLayout());
+}
+
+void VMiniMap::setViewportRect(const QRect &p_rect)
+{
+    if (m_viewportRect == p_rect) {
+        return;
+    }
+
+    m_viewportRect = p_rect;
+    update();
+}
+
+void VMiniMap::setLineHeight(qreal p_height)
+{
+    m_lineHeight = qMax(p_height, qreal(1));
+    update();
+}
+
+void VMiniMap::invalidate(int p_firstBlock, int p_lastBlock)
+{
+    if (p_firstBlock > p_lastBlock) {
+        return;
+    }
+
+    if (m_dirtyFirst == -1) {
+        m_dirtyFirst = p_firstBlock;
+        m_dirtyLast = p_lastBlock;
+    } else {
+        m_dirtyFirst = qMin(m_dirtyFirst, p_firstBlock);
+        m_dirtyLast = qMax(m_dirtyLast, p_lastBlock);
+    }
+
+    if (m_pendingFirst == -1) {
+        QMetaObject::invokeMethod(this, "summarizeDirtyBlocks", Qt::QueuedConnection);
+    }
+}
+
+void VMiniMap::handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+
+    const int newBlockCount = m_document->blockCount();
+    const int delta = newBlockCount - m_blockCount;
+    m_blockCount = newBlockCount;
+
+    QTextBlock firstBlock = m_document->findBlock(p_from);
+    QTextBlock lastBlock = m_document->findBlock(p_from + p_charsAdded);
+    const int first = firstBlock.isValid() ? firstBlock.blockNumber() : 0;
+    const int last = lastBlock.isValid() ? lastBlock.blockNumber() : newBlockCount - 1;
+
+    // Blocks [first, oldLast] before the change are now [first, last].
+    const int oldLast = last - delta;
+
+    // Keep the old summaries of the changed blocks until they are re-computed.
+    if (delta > 0) {
+        m_summaries.insert(oldLast + 1, delta, 0);
+    } else if (delta < 0) {
+        m_summaries.remove(last + 1, -delta);
+    }
+
+    // Shift the pending dirty range.
+    if (m_dirtyFirst != -1) {
+        if (m_dirtyFirst > oldLast) {
+            m_dirtyFirst += delta;
+        }
+
+        if (m_dirtyLast > oldLast) {
+            m_dirtyLast += delta;
+        } else if (m_dirtyLast > last) {
+            m_dirtyLast = last;
+        }
+    }
+
+    if (m_pendingFirst != -1 && m_pendingLast >= first) {
+        if (m_pendingFirst > oldLast) {
+            m_pendingFirst += delta;
+            m_pendingLast += delta;
+        } else {
+            // Discard the summaries and re-compute the pending blocks.
+            ++m_generation;
+            invalidate(qMin(m_pendingFirst, first),
+                       m_pendingLast > oldLast ? m_pendingLast + delta : last);
+        }
+    }
+
+    invalidate(first, last);
+}
+
+void VMiniMap::summarizeDirtyBlocks()
+{
+    if (m_pendingFirst != -1 || m_dirtyFirst == -1) {
+        return;
+    }
+
+    const int first = qMax(0, m_dirtyFirst);
+    const int last = qMin(qMin(m_dirtyLast, m_blockCount - 1), first + c_chunkSize - 1);
+    if (last >= m_dirtyLast || last == m_blockCount - 1) {
+        m_dirtyFirst = m_dirtyLast = -1;
+    } else {
+        m_dirtyFirst = last + 1;
+    }
+
+    if (first > last) {
+        return;
+    }
+
+    // Texts are copied here since the document is not thread-safe.
+    QStringList texts;
+    texts.reserve(last - first + 1);
+    QTextBlock block = m_document->findBlockByNumber(first);
+    for (int i = first; i <= last && block.isValid(); ++i, block = block.next()) {
+        texts.append(block.text());
+    }
+
+    m_pendingFirst = first;
+    m_pendingLast = first + texts.size() - 1;
+    m_threadPool.start(new VMiniMapTask(this, m_generation, texts));
+}
+
+void VMiniMap::applySummaries(int p_generation, const QVector<quint32> &p_summaries)
+{
+    if (p_generation == m_generation && m_pendingFirst != -1) {
+        const int cnt = qMin(p_summaries.size(), m_summaries.size() - m_pendingFirst);
+        for (int i = 0; i < cnt; ++i) {
+            m_summaries[m_pendingFirst + i] = p_summaries[i];
+        }
+
+        update();
+    }
+
+    m_pendingFirst = m_pendingLast = -1;
+    summarizeDirtyBlocks();
+}
+
+qreal VMiniMap::scale() const
+{
+    return c_pixelsPerLine / m_lineHeight;
+}
+
+int VMiniMap::contentOffsetY() const
+{
+    VTextDocumentLayout *layout = getLayout();
+    qreal docHeight = layout->documentSize().height();
+    int overflow = (int)(docHeight * scale()) - height();
+    qreal scrollable = docHeight - m_viewportRect.height();
+    if (overflow <= 0 || scrollable <= 0) {
+        return 0;
+    }
+
+    return (int)(overflow * qBound(qreal(0), m_viewportRect.top() / scrollable, qreal(1)));
+}
+
+void VMiniMap::paintEvent(QPaintEvent *p_event)
+{
+    QPainter painter(this);
+    const QRect &rect = p_event->rect();
+    painter.fillRect(rect, m_backgroundColor);
+
+    VTextDocumentLayout *layout = getLayout();
+    if (!layout || m_document->isEmpty()) {
+        return;
+    }
+
+    const qreal sc = scale();
+    const int offset = contentOffsetY();
+
+    // Only the blocks within the painted rect are visited.
+    int blockNumber = layout->findBlockByPosition(QPointF(0, (offset + rect.top()) / sc));
+    QTextBlock block = m_document->findBlockByNumber(qMax(0, blockNumber));
+    QColor color = m_foregroundColor;
+    while (block.isValid()) {
+        // Read from the block metrics. Blocks are not laid out for the overview.
+        QRectF br = layout->blockRect(block);
+        if (br.isNull()) {
+            break;
+        }
+
+        int top = (int)(br.top() * sc) - offset;
+        if (top > rect.bottom()) {
+            break;
+        }
+
+        quint32 summary = m_summaries.value(block.blockNumber());
+        int indent = summary & 0xff;
+        int length = (summary >> 8) & 0xff;
+        if (block.isVisible() && length > indent) {
+            color.setAlpha(qMax((int)((summary >> 16) & 0xff), 0x40));
+            painter.fillRect(QRect(indent / c_columnsPerPixel,
+                                   top,
+                                   (length - indent) / c_columnsPerPixel + 1,
+                                   qMax(1, (int)(br.height() * sc) - 1)),
+                             color);
+        }
+
+        block = block.next();
+    }
+
+    // Viewport indicator.
+    if (!m_viewportRect.isNull()) {
+        QColor viewportColor = m_foregroundColor;
+        viewportColor.setAlpha(0x30);
+        painter.fillRect(QRect(0,
+                               (int)(m_viewportRect.top() * sc) - offset,
+                               width(),
+                               qMax(1, (int)(m_viewportRect.height() * sc))),
+                         viewportColor);
+    }
+}
+
+void VMiniMap::requestScroll(int p_y)
+{
+    emit scrollRequested((int)((contentOffsetY() + p_y) / scale()));
+}
+
+void VMiniMap::mousePressEvent(QMouseEvent *p_event)
+{
+    if (p_event->button() == Qt::LeftButton) {
+        requestScroll(p_event->pos().y());
+        p_event->accept();
+        return;
+    }
+
+    QWidget::mousePressEvent(p_event);
+}
+
+void VMiniMap::mouseMoveEvent(QMouseEvent *p_event)
+{
+    if (p_event->buttons() & Qt::LeftButton) {
+        requestScroll(p_event->pos().y());
+        p_event->accept();
+        return;
+    }
+
+    QWidget::mouseMoveEvent(p_event);
+}
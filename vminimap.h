@@ -0,0 +1,127 @@
+#ifndef VMINIMAP_H
+#define VMINIMAP_H
+
+#include <QWidget>
+#include <QVector>
+#include <QColor>
+#include <QRect>
+#include <QThreadPool>
+
+class QTextDocument;
+class QPaintEvent;
+class QMouseEvent;
+class VTextDocumentLayout;
+
+
+// Downscaled overview of the whole document beside the editor.
+// Each block is drawn as a bar of its indentation and length, with the offset and
+// height of the block from the layout, instead of rendering its glyphs.
+// Summaries of the blocks are computed in a background thread chunk by chunk and
+// only re-computed for the changed blocks.
+class VMiniMap : public QWidget
+{
+    Q_OBJECT
+public:
+    VMiniMap(const QTextDocument *p_document, QWidget *p_parent = nullptr);
+
+    ~VMiniMap();
+
+    QSize sizeHint() const Q_DECL_OVERRIDE;
+
+    // Set the rect of the viewport of the editor in document coordinates.
+    void setViewportRect(const QRect &p_rect);
+
+    // Set the height of one line of text in the editor.
+    void setLineHeight(qreal p_height);
+
+    void setBackgroundColor(const QColor &p_color);
+
+    void setForegroundColor(const QColor &p_color);
+
+signals:
+    // Request the editor to scroll to center document Y offset @p_y.
+    void scrollRequested(int p_y);
+
+public slots:
+    // Should be called on each change of the document, including changes
+    // marked via QTextDocument::markContentsDirty().
+    void handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded);
+
+protected:
+    void paintEvent(QPaintEvent *p_event) Q_DECL_OVERRIDE;
+
+    void mousePressEvent(QMouseEvent *p_event) Q_DECL_OVERRIDE;
+
+    void mouseMoveEvent(QMouseEvent *p_event) Q_DECL_OVERRIDE;
+
+private slots:
+    // Take a snapshot of the next chunk of dirty blocks and summarize it in the
+    // thread pool.
+    void summarizeDirtyBlocks();
+
+    // Store the summaries of the pending chunk computed at @p_generation.
+    void applySummaries(int p_generation, const QVector<quint32> &p_summaries);
+
+private:
+    VTextDocumentLayout *getLayout() const;
+
+    // Mark blocks [@p_firstBlock, @p_lastBlock] to be summarized.
+    void invalidate(int p_firstBlock, int p_lastBlock);
+
+    // Ratio of the minimap to the document.
+    qreal scale() const;
+
+    // Y offset of the contents when the minimap is taller than the widget.
+    // It follows the viewport proportionally so painting never depends on the
+    // length of the document.
+    int contentOffsetY() const;
+
+    void requestScroll(int p_y);
+
+    const QTextDocument *m_document;
+
+    // Block count when last updated.
+    int m_blockCount;
+
+    // Packed indentation, length and density of each block.
+    // 0 if not summarized yet.
+    QVector<quint32> m_summaries;
+
+    // Range of blocks [first, last] to summarize. -1 for none.
+    int m_dirtyFirst;
+
+    int m_dirtyLast;
+
+    // Range of blocks [first, last] being summarized. -1 for none.
+    int m_pendingFirst;
+
+    int m_pendingLast;
+
+    // Increased when the pending blocks are changed to discard the stale summaries.
+    int m_generation;
+
+    qreal m_lineHeight;
+
+    QRect m_viewportRect;
+
+    QColor m_foregroundColor;
+
+    QColor m_backgroundColor;
+
+    // One thread to summarize the chunks in order.
+    QThreadPool m_threadPool;
+};
+
+inline void VMiniMap::setBackgroundColor(const QColor &p_color)
+{
+    m_backgroundColor = p_color;
+    update();
+}
+
+inline void VMiniMap::setForegroundColor(const QColor &p_color)
+{
+    m_foregroundColor = p_color;
+    update();
+}
+
+#endif // VMINIMAP_H
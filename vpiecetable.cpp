@@ -0,0 +1,354 @@
+#include "vpiecetable.h"
+
+#include <QSaveFile>
+#include <QDebug>
+
+#include <cstring>
+
+
+// Lines between two entries of the line index.
+static const int c_lineIndexStep = 64;
+
+VPieceTable::VPieceTable()
+    : m_data(NULL),
+      m_size(0),
+      m_originalLineCount(0),
+      m_lineBreak("\n"),
+      m_lineCount(0),
+      m_modified(false)
+{
+}
+
+VPieceTable::~VPieceTable()
+{
+    close();
+}
+
+bool VPieceTable::open(const QString &p_filePath)
+{
+    close();
+
+    m_file.setFileName(p_filePath);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        qWarning() << "failed to open file" << p_filePath;
+        return false;
+    }
+
+    m_size = m_file.size();
+    if (m_size > 0) {
+        m_data = m_file.map(0, m_size);
+        if (!m_data) {
+            qWarning() << "failed to map file" << p_filePath;
+            m_file.close();
+            return false;
+        }
+    } else {
+        // Nothing to map.
+        static const uchar empty = 0;
+        m_data = &empty;
+    }
+
+    m_filePath = p_filePath;
+
+    // Index the line starts. There is always one line after the last line break.
+    const char *data = reinterpret_cast<const char *>(m_data);
+    qint64 pos = 0;
+    int count = 0;
+    while (true) {
+        if (count % c_lineIndexStep == 0) {
+            m_lineIndex.append(pos);
+        }
+
+        ++count;
+        const void *nl = m_size > pos ? memchr(data + pos, '\n', m_size - pos) : NULL;
+        if (!nl) {
+            break;
+        }
+
+        qint64 nlPos = static_cast<const char *>(nl) - data;
+        if (count == 1 && nlPos > 0 && data[nlPos - 1] == '\r') {
+            // The first line decides the line break of the whole file.
+            m_lineBreak = "\r\n";
+        }
+
+        pos = nlPos + 1;
+    }
+
+    m_originalLineCount = count;
+    m_lineCount = count;
+    m_pieces.append(Piece(false, 0, count));
+    return true;
+}
+
+void VPieceTable::close()
+{
+    if (m_file.isOpen()) {
+        if (m_size > 0) {
+            m_file.unmap(const_cast<uchar *>(m_data));
+        }
+
+        m_file.close();
+    }
+
+    m_data = NULL;
+    m_size = 0;
+    m_filePath.clear();
+    m_lineIndex.clear();
+    m_originalLineCount = 0;
+    m_lineBreak = "\n";
+    m_addBuffer.clear();
+    m_addLineStarts.clear();
+    m_pieces.clear();
+    m_lineCount = 0;
+    m_modified = false;
+}
+
+qint64 VPieceTable::originalLineStart(int p_line) const
+{
+    Q_ASSERT(p_line >= 0 && p_line < m_originalLineCount);
+    const char *data = reinterpret_cast<const char *>(m_data);
+    qint64 pos = m_lineIndex[p_line / c_lineIndexStep];
+    for (int i = p_line % c_lineIndexStep; i > 0; --i) {
+        const void *nl = memchr(data + pos, '\n', m_size - pos);
+        Q_ASSERT(nl);
+        pos = static_cast<const char *>(nl) - data + 1;
+    }
+
+    return pos;
+}
+
+void VPieceTable::originalLine(int p_line, const char *&p_data, qint64 &p_size) const
+{
+    const char *data = reinterpret_cast<const char *>(m_data);
+    qint64 pos = originalLineStart(p_line);
+    const void *nl = m_size > pos ? memchr(data + pos, '\n', m_size - pos) : NULL;
+    qint64 end = nl ? static_cast<const char *>(nl) - data : m_size;
+    if (end > pos && data[end - 1] == '\r') {
+        --end;
+    }
+
+    p_data = data + pos;
+    p_size = end - pos;
+}
+
+void VPieceTable::addedLine(int p_line, const char *&p_data, int &p_size) const
+{
+    // Each line is terminated by '\n'.
+    int start = m_addLineStarts[p_line];
+    int end = p_line + 1 < m_addLineStarts.size() ? m_addLineStarts[p_line + 1] : m_addBuffer.size();
+    p_data = m_addBuffer.constData() + start;
+    p_size = end - start - 1;
+}
+
+int VPieceTable::findPiece(int p_line, int &p_lineInPiece) const
+{
+    int line = p_line;
+    for (int i = 0; i < m_pieces.size(); ++i) {
+        if (line < m_pieces[i].m_count) {
+            p_lineInPiece = line;
+            return i;
+        }
+
+        line -= m_pieces[i].m_count;
+    }
+
+    p_lineInPiece = 0;
+    return -1;
+}
+
+QString VPieceTable::line(int p_line) const
+{
+    int lineInPiece = 0;
+    int idx = findPiece(p_line, lineInPiece);
+    if (idx == -1) {
+        return QString();
+    }
+
+    const Piece &piece = m_pieces[idx];
+    int bufLine = piece.m_first + lineInPiece;
+    if (piece.m_added) {
+        const char *data = NULL;
+        int size = 0;
+        addedLine(bufLine, data, size);
+        return QString::fromUtf8(data, size);
+    }
+
+    const char *data = NULL;
+    qint64 size = 0;
+    originalLine(bufLine, data, size);
+    return QString::fromUtf8(data, size);
+}
+
+QStringList VPieceTable::lines(int p_first, int p_count) const
+{
+    const QVector<QByteArray> raw = rawLines(p_first, p_count);
+
+    QStringList ret;
+    ret.reserve(raw.size());
+    for (auto const & ln : raw) {
+        ret.append(QString::fromUtf8(ln));
+    }
+
+    return ret;
+}
+
+QVector<QByteArray> VPieceTable::rawLines(int p_first, int p_count) const
+{
+    QVector<QByteArray> ret;
+    int first = qMax(0, p_first);
+    int last = qMin(p_first + p_count, m_lineCount);
+    if (first >= last) {
+        return ret;
+    }
+
+    ret.reserve(last - first);
+
+    int lineInPiece = 0;
+    int idx = findPiece(first, lineInPiece);
+    if (idx == -1) {
+        return ret;
+    }
+
+    const char *data = reinterpret_cast<const char *>(m_data);
+    for (int line = first; line < last && idx < m_pieces.size(); ++idx, lineInPiece = 0) {
+        const Piece &piece = m_pieces[idx];
+        int cnt = qMin(piece.m_count - lineInPiece, last - line);
+        if (piece.m_added) {
+            for (int i = 0; i < cnt; ++i) {
+                const char *lineData = NULL;
+                int size = 0;
+                addedLine(piece.m_first + lineInPiece + i, lineData, size);
+                ret.append(QByteArray::fromRawData(lineData, size));
+            }
+        } else {
+            // Look up the first line only and scan the following ones.
+            qint64 pos = originalLineStart(piece.m_first + lineInPiece);
+            for (int i = 0; i < cnt; ++i) {
+                const void *nl = m_size > pos ? memchr(data + pos, '\n', m_size - pos) : NULL;
+                qint64 next = nl ? static_cast<const char *>(nl) - data + 1 : m_size;
+                qint64 end = nl ? next - 1 : m_size;
+                if (end > pos && data[end - 1] == '\r') {
+                    --end;
+                }
+
+                ret.append(QByteArray::fromRawData(data + pos, end - pos));
+                pos = next;
+            }
+        }
+
+        line += cnt;
+    }
+
+    return ret;
+}
+
+int VPieceTable::splitAt(int p_line)
+{
+    int lineInPiece = 0;
+    int idx = findPiece(p_line, lineInPiece);
+    if (idx == -1) {
+        return m_pieces.size();
+    }
+
+    if (lineInPiece > 0) {
+        Piece &piece = m_pieces[idx];
+        Piece tail(piece.m_added, piece.m_first + lineInPiece, piece.m_count - lineInPiece);
+        piece.m_count = lineInPiece;
+        m_pieces.insert(++idx, tail);
+    }
+
+    return idx;
+}
+
+void VPieceTable::replaceLines(int p_first, int p_count, const QStringList &p_lines)
+{
+    Q_ASSERT(p_first >= 0 && p_count >= 0 && p_first + p_count <= m_lineCount);
+
+    // Skip the lines unchanged at both ends.
+    const QVector<QByteArray> oldLines = rawLines(p_first, p_count);
+    QVector<QByteArray> newLines;
+    newLines.reserve(p_lines.size());
+    for (const auto &ln : p_lines) {
+        newLines.append(ln.toUtf8());
+    }
+
+    int head = 0;
+    const int common = qMin(oldLines.size(), newLines.size());
+    while (head < common && oldLines[head] == newLines[head]) {
+        ++head;
+    }
+
+    int tail = 0;
+    while (tail < common - head
+           && oldLines[oldLines.size() - 1 - tail] == newLines[newLines.size() - 1 - tail]) {
+        ++tail;
+    }
+
+    const int first = p_first + head;
+    const int count = p_count - head - tail;
+    const int addCount = newLines.size() - head - tail;
+    if (count == 0 && addCount == 0) {
+        return;
+    }
+
+    // Drop the pieces of the replaced lines.
+    int idx = splitAt(first);
+    int end = splitAt(first + count);
+    m_pieces.remove(idx, end - idx);
+    m_lineCount -= count;
+
+    if (addCount > 0) {
+        int addFirst = m_addLineStarts.size();
+        for (int i = head; i < head + addCount; ++i) {
+            m_addLineStarts.append(m_addBuffer.size());
+            m_addBuffer.append(newLines[i]);
+            m_addBuffer.append('\n');
+        }
+
+        m_pieces.insert(idx, Piece(true, addFirst, addCount));
+        m_lineCount += addCount;
+    }
+
+    m_modified = true;
+}
+
+bool VPieceTable::save(const QString &p_filePath) const
+{
+    QSaveFile file(p_filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "failed to save file" << p_filePath;
+        return false;
+    }
+
+    // Lines of the mapped file are copied as a whole range per piece, keeping
+    // their original line breaks. Added lines and piece boundaries get the line
+    // break detected on open.
+    for (int i = 0; i < m_pieces.size(); ++i) {
+        if (i > 0) {
+            file.write(m_lineBreak);
+        }
+
+        const Piece &piece = m_pieces[i];
+        if (piece.m_added) {
+            for (int j = 0; j < piece.m_count; ++j) {
+                if (j > 0) {
+                    file.write(m_lineBreak);
+                }
+
+                const char *data = NULL;
+                int size = 0;
+                addedLine(piece.m_first + j, data, size);
+                file.write(data, size);
+            }
+        } else {
+            const char *data = NULL;
+            qint64 size = 0;
+            originalLine(piece.m_first + piece.m_count - 1, data, size);
+            qint64 start = originalLineStart(piece.m_first);
+            qint64 end = data - reinterpret_cast<const char *>(m_data) + size;
+            file.write(reinterpret_cast<const char *>(m_data) + start, end - start);
+        }
+    }
+
+    return file.commit();
+}
@@ -0,0 +1,153 @@
+#ifndef VPIECETABLE_H
+#define VPIECETABLE_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+#include <QFile>
+
+
+// Line-based piece table over a memory-mapped UTF-8 file and an append buffer.
+// Opening a file costs only a sparse index of the line starts. Edits replace
+// whole lines and append the new lines to the append buffer, so the mapped file
+// is never modified. The line break of the file, LF or CRLF, is kept on save.
+class VPieceTable
+{
+public:
+    VPieceTable();
+
+    ~VPieceTable();
+
+    // Map file @p_filePath and index its lines.
+    bool open(const QString &p_filePath);
+
+    void close();
+
+    bool isOpen() const;
+
+    const QString &getFilePath() const;
+
+    int lineCount() const;
+
+    // Return the text of line @p_line without the line break.
+    QString line(int p_line) const;
+
+    // Return the texts of lines [@p_first, @p_first + @p_count).
+    QStringList lines(int p_first, int p_count) const;
+
+    // Replace lines [@p_first, @p_first + @p_count) with @p_lines.
+    // Only the lines differing from the current ones are added, so writing back
+    // a window with a few edits costs only those lines.
+    void replaceLines(int p_first, int p_count, const QStringList &p_lines);
+
+    bool isModified() const;
+
+    void setModified(bool p_modified);
+
+    // Write all the lines to @p_filePath.
+    bool save(const QString &p_filePath) const;
+
+private:
+    // A range of lines of the mapped file or the append buffer.
+    struct Piece
+    {
+        Piece()
+            : m_added(false),
+              m_first(0),
+              m_count(0)
+        {
+        }
+
+        Piece(bool p_added, int p_first, int p_count)
+            : m_added(p_added),
+              m_first(p_first),
+              m_count(p_count)
+        {
+        }
+
+        // Whether the lines are in the append buffer.
+        bool m_added;
+
+        // The first line in the buffer.
+        int m_first;
+
+        int m_count;
+    };
+
+    // Return the offset of line @p_line of the mapped file.
+    qint64 originalLineStart(int p_line) const;
+
+    // Get the bytes of line @p_line of the mapped file.
+    void originalLine(int p_line, const char *&p_data, qint64 &p_size) const;
+
+    // Get the bytes of line @p_line of the append buffer.
+    void addedLine(int p_line, const char *&p_data, int &p_size) const;
+
+    // Get the bytes of lines [@p_first, @p_first + @p_count) without the line
+    // breaks, walking the pieces in order. The arrays refer to the buffers.
+    QVector<QByteArray> rawLines(int p_first, int p_count) const;
+
+    // Find the piece containing line @p_line.
+    // @p_lineInPiece: the index of the line within the piece.
+    int findPiece(int p_line, int &p_lineInPiece) const;
+
+    // Split the piece at line @p_line so a piece starts at it.
+    // Return the index of that piece.
+    int splitAt(int p_line);
+
+    QString m_filePath;
+
+    QFile m_file;
+
+    const uchar *m_data;
+
+    qint64 m_size;
+
+    // Offset of every c_lineIndexStep-th line of the mapped file.
+    QVector<qint64> m_lineIndex;
+
+    int m_originalLineCount;
+
+    // Line break of the mapped file, used to join the lines on save.
+    QByteArray m_lineBreak;
+
+    // UTF-8 lines added by edits, each terminated by '\n'.
+    QByteArray m_addBuffer;
+
+    // Offset of each line in m_addBuffer.
+    QVector<int> m_addLineStarts;
+
+    QVector<Piece> m_pieces;
+
+    int m_lineCount;
+
+    bool m_modified;
+};
+
+inline bool VPieceTable::isOpen() const
+{
+    return m_data != NULL;
+}
+
+inline const QString &VPieceTable::getFilePath() const
+{
+    return m_filePath;
+}
+
+inline int VPieceTable::lineCount() const
+{
+    return m_lineCount;
+}
+
+inline bool VPieceTable::isModified() const
+{
+    return m_modified;
+}
+
+inline void VPieceTable::setModified(bool p_modified)
+{
+    m_modified = p_modified;
+}
+
+#endif // VPIECETABLE_H
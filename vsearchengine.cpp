@@ -0,0 +1,417 @@
+#include "vsearchengine.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+#include <QStringList>
+#include <QStringMatcher>
+#include <QRegularExpression>
+#include <QRunnable>
+
+
+// Maximum number of blocks to search in one task.
+static const int c_chunkSize = 4096;
+
+// Search @p_text in @p_texts of blocks from @p_firstBlock.
+// @p_matches: block number, start and length of each match.
+// Return false if cancelled, once @p_currentGeneration differs from @p_generation.
+static bool searchTexts(const QStringList &p_texts,
+                        int p_firstBlock,
+                        const QString &p_text,
+                        VSearchEngine::FindOptions p_options,
+                        const QAtomicInt *p_currentGeneration,
+                        int p_generation,
+                        QVector<int> &p_matches)
+{
+    const Qt::CaseSensitivity cs = (p_options & VSearchEngine::CaseSensitive) ? Qt::CaseSensitive
+                                                                              : Qt::CaseInsensitive;
+    QRegularExpression regExp;
+    QStringMatcher matcher;
+    const bool useRegExp = p_options & (VSearchEngine::RegularExpression | VSearchEngine::WholeWord);
+    if (useRegExp) {
+        QString pattern = (p_options & VSearchEngine::RegularExpression) ? p_text
+                                                                         : QRegularExpression::escape(p_text);
+        if (p_options & VSearchEngine::WholeWord) {
+            pattern = QString("\\b(?:%1)\\b").arg(pattern);
+        }
+
+        regExp.setPattern(pattern);
+        if (cs == Qt::CaseInsensitive) {
+            regExp.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+        }
+    } else {
+        matcher.setPattern(p_text);
+        matcher.setCaseSensitivity(cs);
+    }
+
+    // An invalid pattern matches nothing.
+    const int cnt = (!useRegExp || regExp.isValid()) ? p_texts.size() : 0;
+    for (int i = 0; i < cnt; ++i) {
+        // Stop once a new search starts.
+        if (p_currentGeneration->load() != p_generation) {
+            return false;
+        }
+
+        const QString &text = p_texts[i];
+        if (useRegExp) {
+            auto it = regExp.globalMatch(text);
+            while (it.hasNext()) {
+                auto match = it.next();
+                if (match.capturedLength() > 0) {
+                    p_matches << p_firstBlock + i << match.capturedStart() << match.capturedLength();
+                }
+            }
+        } else {
+            int pos = matcher.indexIn(text);
+            while (pos != -1) {
+                p_matches << p_firstBlock + i << pos << p_text.size();
+                pos = matcher.indexIn(text, pos + p_text.size());
+            }
+        }
+    }
+
+    return true;
+}
+
+// Search a snapshot of the texts of blocks in the thread pool.
+class VSearchTask : public QRunnable
+{
+public:
+    VSearchTask(VSearchEngine *p_receiver,
+                const QAtomicInt *p_generation,
+                int p_firstBlock,
+                const QStringList &p_texts,
+                const QString &p_text,
+                VSearchEngine::FindOptions p_options)
+        : m_receiver(p_receiver),
+          m_currentGeneration(p_generation),
+          m_generation(p_generation->load()),
+          m_firstBlock(p_firstBlock),
+          m_texts(p_texts),
+          m_text(p_text),
+          m_options(p_options)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        QVector<int> matches;
+        if (!searchTexts(m_texts, m_firstBlock, m_text, m_options, m_currentGeneration, m_generation, matches)) {
+            return;
+        }
+
+        // The receiver waits for the pool on destruction.
+        QMetaObject::invokeMethod(m_receiver,
+                                  "applyMatches",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, m_generation),
+                                  Q_ARG(int, m_firstBlock),
+                                  Q_ARG(int, m_firstBlock + m_texts.size() - 1),
+                                  Q_ARG(QVector<int>, matches));
+    }
+
+private:
+    VSearchEngine *m_receiver;
+
+    const QAtomicInt *m_currentGeneration;
+
+    int m_generation;
+
+    int m_firstBlock;
+
+    QStringList m_texts;
+
+    QString m_text;
+
+    VSearchEngine::FindOptions m_options;
+};
+
+VSearchEngine::VSearchEngine(const QTextDocument *p_document, QObject *p_parent)
+    : QObject(p_parent),
+      m_document(p_document),
+      m_options(None),
+      m_generation(0),
+      m_visibleFirst(0),
+      m_visibleLast(-1),
+      m_nextAfter(-1),
+      m_nextBefore(-1),
+      m_forward(true),
+      m_pendingChunks(0),
+      m_stale(false),
+      m_matchCount(0),
+      m_blockCount(0),
+      m_changedFirst(-1),
+      m_changedLast(-1),
+      m_restartPending(false),
+      m_changesPending(false)
+{
+    qRegisterMetaType<QVector<int>>("QVector<int>");
+}
+
+VSearchEngine::~VSearchEngine()
+{
+    m_generation.fetchAndAddOrdered(1);
+    m_threadPool.clear();
+    m_threadPool.waitForDone();
+}
+
+void VSearchEngine::search(const QString &p_text,
+                           FindOptions p_options,
+                           int p_firstBlock,
+                           int p_lastBlock)
+{
+    if (p_text.isEmpty()) {
+        clear();
+        return;
+    }
+
+    // Cancel the running search.
+    m_generation.fetchAndAddOrdered(1);
+    m_threadPool.clear();
+    m_pendingChunks = 0;
+
+    m_text = p_text;
+    m_options = p_options;
+
+    // Keep the old matches until the first chunk is searched.
+    m_stale = true;
+
+    const int cnt = m_document->blockCount();
+    m_blockCount = cnt;
+    m_changedFirst = m_changedLast = -1;
+    m_visibleFirst = qBound(0, p_firstBlock, cnt - 1);
+    m_visibleLast = qBound(m_visibleFirst, p_lastBlock, cnt - 1);
+    m_nextAfter = m_visibleLast + 1 < cnt ? m_visibleLast + 1 : -1;
+    m_nextBefore = m_visibleFirst - 1;
+    m_forward = true;
+
+    startChunk(m_visibleFirst, m_visibleLast);
+    dispatchChunks();
+}
+
+void VSearchEngine::clear()
+{
+    m_generation.fetchAndAddOrdered(1);
+    m_threadPool.clear();
+    m_pendingChunks = 0;
+    m_nextAfter = m_nextBefore = -1;
+    m_stale = false;
+    m_changedFirst = m_changedLast = -1;
+    m_text.clear();
+
+    if (!m_matches.isEmpty()) {
+        m_matches.clear();
+        m_matchCount = 0;
+        emit matchesFound(0, m_document->blockCount() - 1);
+    }
+}
+
+const QVector<VSearchEngine::Match> *VSearchEngine::findMatches(int p_blockNumber) const
+{
+    auto it = m_matches.constFind(p_blockNumber);
+    if (it == m_matches.constEnd()) {
+        return NULL;
+    }
+
+    return &it.value();
+}
+
+bool VSearchEngine::nextChunk(int &p_first, int &p_last)
+{
+    const int cnt = m_document->blockCount();
+    if (m_nextAfter >= cnt) {
+        m_nextAfter = -1;
+    }
+
+    // Alternate between the blocks after and before the visible blocks.
+    if (m_nextAfter != -1 && (m_forward || m_nextBefore == -1)) {
+        p_first = m_nextAfter;
+        p_last = qMin(p_first + c_chunkSize - 1, cnt - 1);
+        m_nextAfter = p_last + 1 < cnt ? p_last + 1 : -1;
+    } else if (m_nextBefore != -1) {
+        p_last = qMin(m_nextBefore, cnt - 1);
+        p_first = qMax(0, p_last - c_chunkSize + 1);
+        m_nextBefore = p_first - 1;
+    } else {
+        return false;
+    }
+
+    m_forward = !m_forward;
+    return true;
+}
+
+void VSearchEngine::startChunk(int p_first, int p_last)
+{
+    // Texts are copied here since the document is not thread-safe.
+    QStringList texts;
+    texts.reserve(p_last - p_first + 1);
+    QTextBlock block = m_document->findBlockByNumber(p_first);
+    for (int i = p_first; i <= p_last && block.isValid(); ++i, block = block.next()) {
+        texts.append(block.text());
+    }
+
+    ++m_pendingChunks;
+    m_threadPool.start(new VSearchTask(this, &m_generation, p_first, texts, m_text, m_options));
+}
+
+void VSearchEngine::dispatchChunks()
+{
+    // Snapshot only a few chunks ahead to keep the GUI thread responsive.
+    const int limit = m_threadPool.maxThreadCount() * 2;
+    int first, last;
+    while (m_pendingChunks < limit && nextChunk(first, last)) {
+        startChunk(first, last);
+    }
+}
+
+void VSearchEngine::applyMatches(int p_generation,
+                                 int p_firstBlock,
+                                 int p_lastBlock,
+                                 const QVector<int> &p_matches)
+{
+    if (p_generation != m_generation.load()) {
+        return;
+    }
+
+    --m_pendingChunks;
+
+    if (m_stale) {
+        m_stale = false;
+        if (!m_matches.isEmpty()) {
+            m_matches.clear();
+            m_matchCount = 0;
+            emit matchesFound(0, m_document->blockCount() - 1);
+        }
+    }
+
+    for (int i = 0; i + 2 < p_matches.size(); i += 3) {
+        m_matches[p_matches[i]].append(Match(p_matches[i + 1], p_matches[i + 2]));
+        ++m_matchCount;
+    }
+
+    if (!p_matches.isEmpty()) {
+        emit matchesFound(p_firstBlock, p_lastBlock);
+    }
+
+    dispatchChunks();
+
+    if (!isSearching()) {
+        emit finished(m_matchCount);
+    }
+}
+
+void VSearchEngine::handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+
+    if (m_text.isEmpty() || m_restartPending) {
+        return;
+    }
+
+    if (isSearching()) {
+        // The running search numbers the blocks before the change.
+        // Coalesce the changes of one edit.
+        m_restartPending = true;
+        QMetaObject::invokeMethod(this, "restart", Qt::QueuedConnection);
+        return;
+    }
+
+    // Blocks [first, last] are changed, which were [first, last - delta] before.
+    const int cnt = m_document->blockCount();
+    const int delta = cnt - m_blockCount;
+    m_blockCount = cnt;
+    const int first = qMax(0, m_document->findBlock(p_from).blockNumber());
+    QTextBlock lastBlock = m_document->findBlock(p_from + p_charsAdded);
+    const int last = qMax(first, lastBlock.isValid() ? lastBlock.blockNumber() : cnt - 1);
+    const int oldLast = last - delta;
+
+    shiftMatches(first, oldLast, delta);
+
+    // Merge into the changed blocks to search.
+    if (m_changedFirst == -1) {
+        m_changedFirst = first;
+        m_changedLast = last;
+    } else {
+        if (m_changedFirst > oldLast) {
+            m_changedFirst += delta;
+        }
+
+        if (m_changedLast > oldLast) {
+            m_changedLast += delta;
+        }
+
+        m_changedFirst = qMin(m_changedFirst, first);
+        m_changedLast = qMax(m_changedLast, last);
+    }
+
+    if (!m_changesPending) {
+        // Coalesce the changes of one edit.
+        m_changesPending = true;
+        QMetaObject::invokeMethod(this, "searchChanges", Qt::QueuedConnection);
+    }
+}
+
+void VSearchEngine::shiftMatches(int p_first, int p_last, int p_delta)
+{
+    if (m_matches.isEmpty()) {
+        return;
+    }
+
+    QHash<int, QVector<Match>> matches;
+    matches.reserve(m_matches.size());
+    for (auto it = m_matches.constBegin(); it != m_matches.constEnd(); ++it) {
+        const int num = it.key();
+        if (num < p_first) {
+            matches.insert(num, it.value());
+        } else if (num > p_last) {
+            matches.insert(num + p_delta, it.value());
+        } else {
+            m_matchCount -= it.value().size();
+        }
+    }
+
+    m_matches.swap(matches);
+}
+
+void VSearchEngine::searchChanges()
+{
+    m_changesPending = false;
+    if (m_text.isEmpty() || m_changedFirst == -1) {
+        return;
+    }
+
+    const int first = m_changedFirst;
+    const int last = qMin(m_changedLast, m_document->blockCount() - 1);
+    m_changedFirst = m_changedLast = -1;
+    if (last - first + 1 > c_chunkSize) {
+        // Search it all again in the background.
+        search(m_text, m_options, m_visibleFirst, m_visibleLast);
+        return;
+    }
+
+    // Few blocks are changed. Search them here.
+    QStringList texts;
+    texts.reserve(last - first + 1);
+    QTextBlock block = m_document->findBlockByNumber(first);
+    for (int i = first; i <= last && block.isValid(); ++i, block = block.next()) {
+        texts.append(block.text());
+    }
+
+    QVector<int> matches;
+    const int generation = m_generation.load();
+    searchTexts(texts, first, m_text, m_options, &m_generation, generation, matches);
+    for (int i = 0; i + 2 < matches.size(); i += 3) {
+        m_matches[matches[i]].append(Match(matches[i + 1], matches[i + 2]));
+        ++m_matchCount;
+    }
+
+    emit matchesFound(first, last);
+    emit finished(m_matchCount);
+}
+
+void VSearchEngine::restart()
+{
+    m_restartPending = false;
+    if (!m_text.isEmpty()) {
+        search(m_text, m_options, m_visibleFirst, m_visibleLast);
+    }
+}
@@ -0,0 +1,183 @@
+#ifndef VSEARCHENGINE_H
+#define VSEARCHENGINE_H
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QAtomicInt>
+#include <QThreadPool>
+
+class QTextDocument;
+
+
+// Search all the occurrences of a text in a document in the background.
+// Blocks are searched in chunks on worker threads, starting from the visible
+// blocks and going outward, and the matches are streamed into a store by block
+// for the layout to paint. Starting a new search cancels the running one.
+class VSearchEngine : public QObject
+{
+    Q_OBJECT
+public:
+    enum FindOption
+    {
+        None = 0,
+        CaseSensitive = 0x1,
+        WholeWord = 0x2,
+        RegularExpression = 0x4
+    };
+    Q_DECLARE_FLAGS(FindOptions, FindOption)
+
+    // A match within a block.
+    struct Match
+    {
+        Match()
+            : m_start(0),
+              m_length(0)
+        {
+        }
+
+        Match(int p_start, int p_length)
+            : m_start(p_start),
+              m_length(p_length)
+        {
+        }
+
+        int m_start;
+
+        int m_length;
+    };
+
+    explicit VSearchEngine(const QTextDocument *p_document, QObject *p_parent = nullptr);
+
+    ~VSearchEngine();
+
+    // Search @p_text with @p_options, searching blocks [@p_firstBlock, @p_lastBlock]
+    // first. Matches of the previous search are cleared.
+    void search(const QString &p_text,
+                FindOptions p_options,
+                int p_firstBlock,
+                int p_lastBlock);
+
+    // Cancel the search and clear all the matches.
+    void clear();
+
+    const QString &getText() const;
+
+    bool isSearching() const;
+
+    int matchCount() const;
+
+    // Return the matches of block @p_blockNumber in order, or NULL if none.
+    const QVector<Match> *findMatches(int p_blockNumber) const;
+
+signals:
+    // Emitted when the matches of blocks [@p_firstBlock, @p_lastBlock] are found.
+    void matchesFound(int p_firstBlock, int p_lastBlock);
+
+    // Emitted when all the blocks are searched.
+    void finished(int p_matchCount);
+
+public slots:
+    // Update the matches on document changes if there is an active search.
+    // Matches after the changed blocks are shifted and only the changed blocks
+    // are searched again, unless the search is still running.
+    void handleDocumentChange(int p_from, int p_charsRemoved, int p_charsAdded);
+
+private slots:
+    // Snapshot the next chunks of blocks and search them in the thread pool.
+    void dispatchChunks();
+
+    // Store the matches of a chunk from @p_firstBlock.
+    // @p_matches: block number, start and length of each match.
+    void applyMatches(int p_generation,
+                      int p_firstBlock,
+                      int p_lastBlock,
+                      const QVector<int> &p_matches);
+
+    // Search the text again after document changes.
+    void restart();
+
+    // Search the changed blocks again.
+    void searchChanges();
+
+private:
+    // Get the next chunk of blocks to search.
+    // Return false if all the blocks are dispatched.
+    bool nextChunk(int &p_first, int &p_last);
+
+    // Snapshot blocks [@p_first, @p_last] and search them in the thread pool.
+    void startChunk(int p_first, int p_last);
+
+    // Drop the matches of blocks [@p_first, @p_last] and shift those after by
+    // @p_delta blocks.
+    void shiftMatches(int p_first, int p_last, int p_delta);
+
+    const QTextDocument *m_document;
+
+    QString m_text;
+
+    FindOptions m_options;
+
+    // Increased on each new search. Workers stop once it changes.
+    QAtomicInt m_generation;
+
+    // Blocks [m_visibleFirst, m_visibleLast] are searched first.
+    int m_visibleFirst;
+
+    int m_visibleLast;
+
+    // Next block to dispatch after the visible blocks. -1 for none.
+    int m_nextAfter;
+
+    // Next block to dispatch before the visible blocks, going upward. -1 for none.
+    int m_nextBefore;
+
+    // Whether the next chunk goes after the visible blocks.
+    bool m_forward;
+
+    // Count of chunks being searched.
+    int m_pendingChunks;
+
+    // Whether the matches of this generation are not received yet.
+    bool m_stale;
+
+    QHash<int, QVector<Match>> m_matches;
+
+    int m_matchCount;
+
+    // Block count of the document the matches are numbered by.
+    int m_blockCount;
+
+    // Blocks [m_changedFirst, m_changedLast] are changed since searched. -1 for none.
+    int m_changedFirst;
+
+    int m_changedLast;
+
+    // Whether a restart has been queued for document changes.
+    bool m_restartPending;
+
+    // Whether a search of the changed blocks has been queued.
+    bool m_changesPending;
+
+    QThreadPool m_threadPool;
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(VSearchEngine::FindOptions)
+
+inline const QString &VSearchEngine::getText() const
+{
+    return m_text;
+}
+
+inline bool VSearchEngine::isSearching() const
+{
+    return m_pendingChunks > 0 || m_nextAfter != -1 || m_nextBefore != -1;
+}
+
+inline int VSearchEngine::matchCount() const
+{
+    return m_matchCount;
+}
+
+#endif // VSEARCHENGINE_H
@@ -9,11 +9,152 @@
 #include <QFont>
 #include <QPainter>
 #include <QDebug>
+#include <QHash>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFontMetricsF>
+#include <QtMath>
+#include <QGlyphRun>
+#include <QPaintEngine>
+#include <algorithm>
 
 #include "vimageresourcemanager2.h"
 #include "vtextedit.h"
+#include "vsearchengine.h"
+#include "vhighlighter.h"
 
 
+// Maximum number of entries of the metrics cache.
+static const int c_metricsCacheCapacity = 200000;
+
+// Delay in ms after the viewport or the document changes to cache the metrics
+// of the visible blocks.
+static const int c_metricsDelay = 100;
+
+static const quint32 c_snapshotVersion = 2;
+
+// Default time budget in ms of one slice of layout work.
+static const int c_frameBudget = 4;
+
+// Blocks around the cursor to lay out before the rest.
+static const int c_cursorNeighborhood = 64;
+
+// Default blocks around the viewports whose layouts are kept.
+static const int c_reclaimWindow = 1000;
+
+// Delay in ms after the viewport stops moving to reclaim the layouts.
+static const int c_reclaimDelay = 1000;
+
+// Default time budget in ms of one slice of prefetching.
+static const int c_prefetchBudget = 4;
+
+// Prefetch the region a view reaches within this time in ms at its velocity,
+// between one and c_prefetchPages pages ahead.
+static const int c_prefetchLookahead = 500;
+
+static const int c_prefetchPages = 3;
+
+// A view moving after a pause longer than this in ms starts a new scroll.
+static const int c_scrollPause = 200;
+
+// Approximate bytes of a QTextLayout and of one of its lines.
+static const int c_layoutBytes = 256;
+
+static const int c_lineBytes = 64;
+
+// Maximum width of a line of QTextLayout, which is QFIXED_MAX.
+static const qreal c_maxLineWidth = INT_MAX / 256;
+
+// Characters of the ASCII fast path are within [0x20, 0x7E].
+static const ushort c_firstAscii = 0x20;
+
+static const int c_asciiCount = 0x7F - c_firstAscii;
+
+// Single lines longer than this are split into chunks to be shaped separately.
+static const int c_longLineLength = 1024;
+
+// Length of a chunk of a long line, which ends at the next break within the slack.
+static const int c_lineChunkLength = 256;
+
+static const int c_lineChunkSlack = 64;
+
+// SHA1 of the texts of all the blocks.
+static QByteArray contentHash(const QTextDocument *p_doc)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (QTextBlock block = p_doc->firstBlock(); block.isValid(); block = block.next()) {
+        QString text = block.text();
+        hash.addData(reinterpret_cast<const char *>(text.utf16()), text.size() * sizeof(ushort));
+        hash.addData("\n", 1);
+    }
+
+    return hash.result();
+}
+
+// Whether any of @p_selections is a full width selection by a cursor position
+// within @p_block. Such a selection takes its range from the layout of the line.
+static bool hasFullWidthCursor(const QTextBlock &p_block,
+                               const QVector<QAbstractTextDocumentLayout::Selection> &p_selections)
+{
+    for (auto const & sel : p_selections) {
+        if (!sel.cursor.hasSelection()
+            && sel.format.hasProperty(QTextFormat::FullWidthSelection)
+            && p_block.contains(sel.cursor.position())) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Whether @p_text contains characters which may reorder the line.
+static bool hasRightToLeft(const QString &p_text)
+{
+    for (int i = 0; i < p_text.size(); ++i) {
+        switch (p_text[i].direction()) {
+        case QChar::DirR:
+        case QChar::DirAL:
+        case QChar::DirAN:
+        case QChar::DirRLE:
+        case QChar::DirRLO:
+        case QChar::DirRLI:
+            return true;
+
+        default:
+            break;
+        }
+    }
+
+    return false;
+}
+
+// Whether @p_data are all printable ASCII, without tabs or control characters.
+// Each chunk is scanned without branches so it could be vectorized.
+static bool isPrintableAscii(const ushort *p_data, int p_size)
+{
+    const int chunk = 32;
+    int i = 0;
+    for (; i + chunk <= p_size; i += chunk) {
+        ushort outside = 0;
+        for (int j = 0; j < chunk; ++j) {
+            outside |= (ushort)(p_data[i + j] - c_firstAscii) >= c_asciiCount;
+        }
+
+        if (outside) {
+            return false;
+        }
+    }
+
+    for (; i < p_size; ++i) {
+        if ((ushort)(p_data[i] - c_firstAscii) >= c_asciiCount) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 VTextDocumentLayout::VTextDocumentLayout(QTextDocument *p_doc,
                                          VImageResourceManager2 *p_imageMgr)
     : QAbstractTextDocumentLayout(p_doc),
@@ -27,8 +168,67 @@ VTextDocumentLayout::VTextDocumentLayout(QTextDocument *p_doc,
       m_cursorMargin(4),
       m_imageMgr(p_imageMgr),
       m_blockImageEnabled(false),
-      m_imageWidthConstrainted(false)
+      m_imageWidthConstrainted(false),
+      m_searchEngine(NULL),
+      m_metricsCache(c_metricsCacheCapacity),
+      m_deferredUpdateBlock(-1),
+      m_metricsParams(0),
+      m_styleParams(0),
+      m_availableWidth(0),
+      m_generation(0),
+      m_drawingCursorLine(false),
+      m_prefetchBudget(c_prefetchBudget),
+      m_prefetchBlock(-1),
+      m_prefetchUpward(false),
+      m_devicePixelRatio(1),
+      m_snapshotParams(0),
+      m_snapshotWidth(0),
+      m_snapshotApplied(false),
+      m_estimatedLineHeight(0),
+      m_estimatedCharWidth(0),
+      m_frameBudget(c_frameBudget),
+      m_backgroundLayoutPaused(false),
+      m_cursorBlock(-1),
+      m_pendingFirst(-1),
+      m_pendingLast(-1),
+      m_batchLayout(false),
+      m_batchFillFrom(-1),
+      m_shapedFirst(-1),
+      m_shapedLast(-1),
+      m_reclaimWindow(c_reclaimWindow),
+      m_lineCountIndexDirty(true)
 {
+    m_layoutTimer.setSingleShot(true);
+    m_layoutTimer.setInterval(0);
+    connect(&m_layoutTimer, &QTimer::timeout,
+            this, &VTextDocumentLayout::layoutPendingBlocks);
+
+    m_reclaimTimer.setSingleShot(true);
+    m_reclaimTimer.setInterval(c_reclaimDelay);
+    connect(&m_reclaimTimer, &QTimer::timeout,
+            this, &VTextDocumentLayout::reclaimLayouts);
+
+    m_prefetchTimer.setSingleShot(true);
+    m_prefetchTimer.setInterval(0);
+    connect(&m_prefetchTimer, &QTimer::timeout,
+            this, &VTextDocumentLayout::prefetchBlocks);
+
+    m_metricsTimer.setSingleShot(true);
+    m_metricsTimer.setInterval(c_metricsDelay);
+    connect(&m_metricsTimer, &QTimer::timeout,
+            this, &VTextDocumentLayout::cacheVisibleBlockMetrics);
+
+    m_deferredUpdateTimer.setSingleShot(true);
+    m_deferredUpdateTimer.setInterval(0);
+    connect(&m_deferredUpdateTimer, &QTimer::timeout,
+            this, &VTextDocumentLayout::updateDeferredBlocks);
+
+    m_clock.start();
+
+    updateMetricsParams();
+
+    connect(m_imageMgr, &VImageResourceManager2::animationFrameChanged,
+            this, &VTextDocumentLayout::updateAnimatedImage);
 }
 
 static void fillBackground(QPainter *p_painter,
@@ -183,6 +383,14 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
 {
     qDebug() << "VTextDocumentLayout draw()" << p_context.clip << p_context.cursorPosition << p_context.selections.size();
 
+    if (p_painter->device()) {
+        m_devicePixelRatio = p_painter->device()->devicePixelRatioF();
+    }
+
+    if (drawCursorLine(p_painter, p_context)) {
+        return;
+    }
+
     // Find out the blocks.
     int first, last;
     blockRangeFromRectBS(p_context.clip, first, last);
@@ -190,6 +398,16 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
         return;
     }
 
+    // Lay out the blocks with estimated metrics at once.
+    if (m_pendingFirst != -1 && first <= m_pendingLast && last >= m_pendingFirst) {
+        QElapsedTimer timer;
+        layoutBlocksInBatch(first, last, timer, -1);
+        blockRangeFromRectBS(p_context.clip, first, last);
+        if (first == -1) {
+            return;
+        }
+    }
+
     QTextDocument *doc = document();
     Q_ASSERT(doc->blockCount() == m_blocks.size());
     QPointF offset(m_margin, m_blocks[first].top());
@@ -204,7 +422,6 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
         Q_ASSERT(info.hasOffset());
 
         const QRectF &rect = info.m_rect;
-        QTextLayout *layout = block.layout();
 
         if (!block.isVisible()) {
             offset.ry() += rect.height();
@@ -222,31 +439,61 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
             fillBackground(p_painter, rect, bg);
         }
 
-        auto selections = formatRangeFromSelection(block, p_context.selections);
-
-        layout->draw(p_painter,
-                     offset,
-                     selections,
-                     p_context.clip.isValid() ? p_context.clip : QRectF());
+        // Blocks with metrics only are laid out for the line of a full width selection.
+        if (hasFullWidthCursor(block, p_context.selections)) {
+            ensureBlockLayout(block);
+        }
 
-        drawBlockImage(p_painter, block, offset);
+        QVector<QTextLayout::FormatRange> selections = blockSelections(block, p_context.selections);
 
-        // Draw the cursor.
         int blpos = block.position();
         int bllen = block.length();
         bool drawCursor = p_context.cursorPosition >= blpos
                           && p_context.cursorPosition < blpos + bllen;
-        if (drawCursor
-            || (p_context.cursorPosition < -1
-                && !layout->preeditAreaText().isEmpty())) {
-            int cpos = p_context.cursorPosition;
-            if (cpos < -1) {
-                cpos = layout->preeditAreaPosition() - (cpos + 2);
-            } else {
-                cpos -= blpos;
-            }
 
-            layout->drawCursor(p_painter, offset, cpos, m_cursorWidth);
+        // Plain blocks of the ASCII fast path are drawn without layout.
+        const AsciiFont *asciiFont = NULL;
+        if (selections.isEmpty() && !drawCursor) {
+            asciiFont = asciiBlockFont(block);
+        }
+
+        // Long lines measured by chunks are shaped and drawn only by the chunks
+        // within the clip until laid out, such as for the cursor.
+        const LineChunks *chunks = NULL;
+        if (!asciiFont && !drawCursor && block.layout()->lineCount() == 0) {
+            chunks = lineChunks(block);
+        }
+
+        if (asciiFont) {
+            drawAsciiBlock(p_painter, block, *asciiFont, offset, p_context.clip);
+        } else if (chunks) {
+            drawLineChunks(p_painter, block, *chunks, offset, selections, p_context.clip);
+        } else {
+            ensureBlockLayout(block);
+            QTextLayout *layout = block.layout();
+
+            layout->draw(p_painter,
+                         offset,
+                         selections,
+                         p_context.clip.isValid() ? p_context.clip : QRectF());
+
+            drawInlineImages(p_painter, block, offset, p_context.clip);
+
+            drawBlockImage(p_painter, block, offset, p_context.clip);
+
+            // Draw the cursor.
+            if (drawCursor
+                || (p_context.cursorPosition < -1
+                    && !layout->preeditAreaText().isEmpty())) {
+                int cpos = p_context.cursorPosition;
+                if (cpos < -1) {
+                    cpos = layout->preeditAreaPosition() - (cpos + 2);
+                } else {
+                    cpos -= blpos;
+                }
+
+                layout->drawCursor(p_painter, offset, cpos, m_cursorWidth);
+            }
         }
 
         offset.ry() += rect.height();
@@ -260,6 +507,153 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
     p_painter->setPen(oldPen);
 }
 
+QVector<QTextLayout::FormatRange> VTextDocumentLayout::blockSelections(const QTextBlock &p_block,
+                                                                       const QVector<Selection> &p_selections) const
+{
+    // Highlights go below the search matches, which go below the selections.
+    QVector<QTextLayout::FormatRange> selections;
+    VHighlightBlockData *highlightData = dynamic_cast<VHighlightBlockData *>(p_block.userData());
+    if (highlightData) {
+        selections = highlightData->m_formats;
+    }
+
+    formatRangeFromSearchMatches(p_block, selections);
+    selections += formatRangeFromSelection(p_block, p_selections);
+    return selections;
+}
+
+bool VTextDocumentLayout::drawCursorLine(QPainter *p_painter, const PaintContext &p_context)
+{
+    if (m_drawingCursorLine
+        || !p_context.clip.isValid()
+        || p_context.cursorPosition < -1
+        || m_cursorBlock < 0
+        || m_cursorBlock >= m_blocks.size()
+        || m_viewportRects.isEmpty()) {
+        return false;
+    }
+
+    const BlockInfo &info = m_blocks[m_cursorBlock];
+    if (!info.hasOffset()
+        || !QRectF(info.m_rect.translated(0, info.m_offset).toAlignedRect()).contains(p_context.clip)) {
+        return false;
+    }
+
+    QTextBlock block = document()->findBlockByNumber(m_cursorBlock);
+    const int blpos = block.position();
+    if (!block.isVisible()
+        || (p_context.cursorPosition > -1
+            && (p_context.cursorPosition < blpos || p_context.cursorPosition >= blpos + block.length()))) {
+        return false;
+    }
+
+    // Animated images are drawn again on each frame.
+    if (m_blockImageEnabled
+        && (m_imageMgr->findImageInfoByBlock(m_cursorBlock)
+            || m_imageMgr->findInlineImageInfosByBlock(m_cursorBlock))) {
+        return false;
+    }
+
+    ensureBlockLayout(block);
+    QTextLayout *layout = block.layout();
+    if (!layout->preeditAreaText().isEmpty()) {
+        return false;
+    }
+
+    // The line containing the clip, within the viewports horizontally.
+    // Aligned to pixels as the clip of the update of the cursor.
+    const QPointF offset(m_margin, info.m_offset);
+    QRectF lineRect;
+    for (int i = 0; i < layout->lineCount(); ++i) {
+        QTextLine line = layout->lineAt(i);
+        QRectF rect(QRectF(0, offset.y() + line.y(), info.m_rect.width(), line.height()).toAlignedRect());
+        if (rect.contains(p_context.clip)) {
+            lineRect = rect;
+            break;
+        }
+    }
+
+    qreal left = lineRect.right(), right = lineRect.left();
+    for (auto it = m_viewportRects.constBegin(); it != m_viewportRects.constEnd(); ++it) {
+        left = qMin(left, it.value().left());
+        right = qMax(right, it.value().right());
+    }
+
+    lineRect.setLeft(qMax(lineRect.left(), left));
+    lineRect.setRight(qMin(lineRect.right(), right));
+    lineRect = QRectF(lineRect.toAlignedRect());
+    if (lineRect.isEmpty() || !lineRect.contains(p_context.clip)) {
+        return false;
+    }
+
+    const QVector<QTextLayout::FormatRange> selections = blockSelections(block, p_context.selections);
+    const QColor textColor = p_context.palette.color(QPalette::Text);
+    const qreal dpr = p_painter->device()->devicePixelRatioF();
+
+    CursorLineCache &cache = m_cursorLineCache;
+    if (cache.m_pixmap.isNull()
+        || cache.m_blockNumber != m_cursorBlock
+        || cache.m_generation != m_generation
+        || cache.m_rect != lineRect
+        || cache.m_selections != selections
+        || cache.m_textColor != textColor
+        || cache.m_pixmap.devicePixelRatioF() != dpr) {
+        // Render the line without the cursor.
+        QPixmap pixmap((lineRect.size() * dpr).toSize());
+        pixmap.setDevicePixelRatio(dpr);
+        pixmap.fill(Qt::transparent);
+
+        QPainter painter(&pixmap);
+        painter.translate(-lineRect.topLeft());
+        PaintContext context = p_context;
+        context.cursorPosition = -1;
+        context.clip = lineRect;
+        m_drawingCursorLine = true;
+        draw(&painter, context);
+        m_drawingCursorLine = false;
+
+        cache.m_blockNumber = m_cursorBlock;
+        cache.m_generation = m_generation;
+        cache.m_rect = lineRect;
+        cache.m_selections = selections;
+        cache.m_textColor = textColor;
+        cache.m_pixmap = pixmap;
+        cache.m_cursorPosition = -1;
+    }
+
+    const QPointF source = (p_context.clip.topLeft() - lineRect.topLeft()) * dpr;
+    p_painter->drawPixmap(p_context.clip,
+                          cache.m_pixmap,
+                          QRectF(source, p_context.clip.size() * dpr));
+
+    if (p_context.cursorPosition > -1) {
+        const int cpos = p_context.cursorPosition - blpos;
+        if (cache.m_cursorPosition != cpos) {
+            QTextLine line = layout->lineForTextPosition(cpos);
+            if (!line.isValid()) {
+                line = layout->lineAt(layout->lineCount() - 1);
+            }
+
+            cache.m_cursorRect = QRectF(offset.x() + line.cursorToX(cpos),
+                                        offset.y() + line.y(),
+                                        m_cursorWidth,
+                                        line.ascent() + line.descent());
+            cache.m_cursorPosition = cpos;
+        }
+
+        // The same as QTextLayout::drawCursor().
+        QPainter::CompositionMode mode = p_painter->compositionMode();
+        if (p_painter->paintEngine()->hasFeature(QPaintEngine::RasterOpModes)) {
+            p_painter->setCompositionMode(QPainter::RasterOp_NotDestination);
+        }
+
+        p_painter->fillRect(cache.m_cursorRect, textColor);
+        p_painter->setCompositionMode(mode);
+    }
+
+    return true;
+}
+
 QVector<QTextLayout::FormatRange> VTextDocumentLayout::formatRangeFromSelection(const QTextBlock &p_block,
                                                                                 const QVector<Selection> &p_selections) const
 {
@@ -284,8 +678,13 @@ QVector<QTextLayout::FormatRange> VTextDocumentLayout::formatRangeFromSelection(
                    && p_block.contains(range.cursor.position())) {
             // For full width selections we don't require an actual selection, just
             // a position to specify the line. that's more convenience in usage.
-            QTextLayout::FormatRange o;
             QTextLine l = p_block.layout()->lineForTextPosition(range.cursor.position() - blpos);
+            if (!l.isValid()) {
+                // Not laid out.
+                continue;
+            }
+
+            QTextLayout::FormatRange o;
             o.start = l.textStart();
             o.length = l.textLength();
             if (o.start + o.length == bllen - 1) {
@@ -300,6 +699,32 @@ QVector<QTextLayout::FormatRange> VTextDocumentLayout::formatRangeFromSelection(
     return ret;
 }
 
+void VTextDocumentLayout::formatRangeFromSearchMatches(const QTextBlock &p_block,
+                                                       QVector<QTextLayout::FormatRange> &p_ranges) const
+{
+    if (!m_searchEngine) {
+        return;
+    }
+
+    const QVector<VSearchEngine::Match> *matches = m_searchEngine->findMatches(p_block.blockNumber());
+    if (!matches) {
+        return;
+    }
+
+    int bllen = p_block.length();
+    for (const auto &match : *matches) {
+        if (match.m_start >= bllen) {
+            break;
+        }
+
+        QTextLayout::FormatRange o;
+        o.start = match.m_start;
+        o.length = qMin(match.m_length, bllen - match.m_start);
+        o.format = m_searchMatchFormat;
+        p_ranges.append(o);
+    }
+}
+
 int VTextDocumentLayout::hitTest(const QPointF &p_point, Qt::HitTestAccuracy p_accuracy) const
 {
     Q_UNUSED(p_accuracy);
@@ -310,6 +735,19 @@ int VTextDocumentLayout::hitTest(const QPointF &p_point, Qt::HitTestAccuracy p_a
 
     QTextBlock block = document()->findBlockByNumber(bn);
     Q_ASSERT(block.isValid());
+
+    // Only shape the chunk hit of a long line not laid out.
+    const LineChunks *chunks = block.layout()->lineCount() == 0 ? lineChunks(block) : NULL;
+    if (chunks) {
+        int idx = lineChunkAt(*chunks, p_point.x());
+        QTextLayout chunkLayout;
+        layoutLineChunk(block, block.text(), *chunks, idx, chunks->m_baseline, chunkLayout);
+        return block.position()
+               + chunks->m_starts[idx]
+               + chunkLayout.lineAt(0).xToCursor(p_point.x(), QTextLine::CursorBetweenCharacters);
+    }
+
+    ensureBlockLayout(block);
     QTextLayout *layout = block.layout();
     int off = 0;
     QPointF pos = p_point - QPointF(m_margin, m_blocks[bn].top());
@@ -331,7 +769,77 @@ int VTextDocumentLayout::hitTest(const QPointF &p_point, Qt::HitTestAccuracy p_a
 
 int VTextDocumentLayout::pageCount() const
 {
-    return 1;
+    qreal pageHeight = document()->pageSize().height();
+    if (pageHeight <= 0 || pageHeight >= INT_MAX) {
+        return 1;
+    }
+
+    return paginate(pageHeight).size();
+}
+
+QVector<QRectF> VTextDocumentLayout::paginate(qreal p_pageHeight) const
+{
+    QVector<QRectF> pages;
+    if (p_pageHeight <= 0) {
+        return pages;
+    }
+
+    QTextDocument *doc = document();
+    qreal top = 0;
+    for (int i = 0; i < m_blocks.size(); ++i) {
+        const BlockInfo &info = m_blocks[i];
+        if (!info.hasOffset() || info.bottom() - top <= p_pageHeight) {
+            continue;
+        }
+
+        // Move the block to the next page if it fits in one page.
+        if (info.top() > top && info.m_rect.height() <= p_pageHeight) {
+            pages.append(QRectF(0, top, m_width, info.top() - top));
+            top = info.top();
+            continue;
+        }
+
+        // Break between the lines.
+        QTextBlock block = doc->findBlockByNumber(i);
+        ensureBlockLayout(block);
+        QTextLayout *tl = block.layout();
+        for (int j = 0; j < tl->lineCount(); ++j) {
+            QTextLine line = tl->lineAt(j);
+            qreal lineTop = info.top() + line.y();
+            while (lineTop + line.height() - top > p_pageHeight) {
+                qreal breakPos = lineTop > top ? lineTop : top + p_pageHeight;
+                pages.append(QRectF(0, top, m_width, breakPos - top));
+                top = breakPos;
+            }
+        }
+
+        // Contents below the lines, such as the block image.
+        while (info.bottom() - top > p_pageHeight) {
+            pages.append(QRectF(0, top, m_width, p_pageHeight));
+            top += p_pageHeight;
+        }
+    }
+
+    pages.append(QRectF(0, top, m_width, qMax(m_height - top, qreal(0))));
+    return pages;
+}
+
+void VTextDocumentLayout::drawPage(QPainter *p_painter, const QRectF &p_pageRect)
+{
+    const VSearchEngine *engine = m_searchEngine;
+    m_searchEngine = NULL;
+
+    p_painter->save();
+    p_painter->translate(-p_pageRect.topLeft());
+    p_painter->setClipRect(p_pageRect, Qt::IntersectClip);
+
+    PaintContext context;
+    context.clip = p_pageRect;
+    draw(p_painter, context);
+
+    p_painter->restore();
+
+    m_searchEngine = engine;
 }
 
 QSizeF VTextDocumentLayout::documentSize() const
@@ -352,6 +860,9 @@ QRectF VTextDocumentLayout::blockBoundingRect(const QTextBlock &p_block) const
         return QRectF();
     }
 
+    // Callers such as QTextCursor expect the block to be laid out after this.
+    ensureBlockLayout(p_block);
+
     const BlockInfo &info = m_blocks[p_block.blockNumber()];
     QRectF geo = info.m_rect.adjusted(0, info.m_offset, 0, info.m_offset);
     qDebug() << "blockBoundingRect()" << p_block.blockNumber()
@@ -361,14 +872,40 @@ QRectF VTextDocumentLayout::blockBoundingRect(const QTextBlock &p_block) const
     return geo;
 }
 
+QRectF VTextDocumentLayout::blockRect(const QTextBlock &p_block) const
+{
+    int num = p_block.blockNumber();
+    if (!p_block.isValid()
+        || num >= m_blocks.size()
+        || !m_blocks[num].hasOffset()) {
+        return QRectF();
+    }
+
+    const BlockInfo &info = m_blocks[num];
+    return info.m_rect.adjusted(0, info.m_offset, 0, info.m_offset);
+}
+
 void VTextDocumentLayout::documentChanged(int p_from, int p_charsRemoved, int p_charsAdded)
 {
+    emit documentContentsChanged(p_from, p_charsRemoved, p_charsAdded);
+
+    ++m_generation;
+
     QTextDocument *doc = document();
     int newBlockCount = doc->blockCount();
 
     // Update the margin.
     m_margin = doc->documentMargin();
 
+    updateMetricsParams();
+
+    // Char format indexes are reused once the whole document is replaced.
+    if (p_from == 0 && p_charsAdded >= doc->characterCount() - 1) {
+        m_separatorWidths.clear();
+        m_asciiFonts.clear();
+        m_lineChunks.clear();
+    }
+
     int charsChanged = p_charsRemoved + p_charsAdded;
 
     QTextBlock changeStartBlock = doc->findBlock(p_from);
@@ -390,15 +927,18 @@ void VTextDocumentLayout::documentChanged(int p_from, int p_charsRemoved, int p_
                 // Update document size.
                 updateDocumentSizeWithOneBlockChanged(block.blockNumber());
 
+                m_metricsTimer.start();
+
                 emit updateBlock(block);
                 return;
             }
         }
     } else {
-        // Clear layout of all affected blocks.
+        // Clear layout of all affected blocks. Their infos are reset after
+        // m_blocks is updated to the new block count.
         QTextBlock block = changeStartBlock;
         do {
-            clearBlockLayout(block);
+            block.clearLayout();
             if (block == changeEndBlock) {
                 break;
             }
@@ -411,21 +951,63 @@ void VTextDocumentLayout::documentChanged(int p_from, int p_charsRemoved, int p_
 
     updateBlockCount(newBlockCount, changeStartBlock.blockNumber());
 
+    bool useSnapshot = needRelayout && isSnapshotApplicable(p_from, p_charsRemoved, p_charsAdded);
+
     if (needRelayout) {
-        // Relayout all affected blocks.
+        int endNumber = changeEndBlock.isValid() ? changeEndBlock.blockNumber() : m_blocks.size() - 1;
+        for (int i = changeStartBlock.blockNumber(); i <= endNumber; ++i) {
+            m_blocks[i].reset();
+        }
+
+        clearOffsetFrom(endNumber + 1);
+
+        // Relayout all affected blocks. Blocks of the ASCII fast path, long lines
+        // and those laid out before, such as restored by undo, get their metrics
+        // without layout and are laid out on use.
+        // Blocks beyond the frame budget get estimated metrics.
+        QElapsedTimer timer;
+        timer.start();
+        int estimatedFirst = -1;
         QTextBlock block = changeStartBlock;
         do {
-            layoutBlock(block);
+            if (useSnapshot) {
+                applyBlockMetrics(block, m_snapshot[block.blockNumber()]);
+            } else if (!measureAsciiBlock(block)
+                       && !measureLongLine(block)
+                       && (m_metricsCache.isEmpty() || !restoreBlockMetrics(block))) {
+                if (estimatedFirst == -1
+                    && (m_frameBudget == 0 || timer.elapsed() < m_frameBudget)) {
+                    layoutBlock(block);
+                } else {
+                    if (estimatedFirst == -1) {
+                        estimatedFirst = block.blockNumber();
+                    }
+
+                    estimateBlockMetrics(block);
+                }
+            }
+
             if (block == changeEndBlock) {
                 break;
             }
 
             block = block.next();
         } while(block.isValid());
+
+        if (useSnapshot) {
+            m_snapshot.clear();
+            m_snapshotApplied = true;
+        }
+
+        if (estimatedFirst != -1) {
+            addPendingBlocks(estimatedFirst, endNumber);
+        }
     }
 
     updateDocumentSize();
 
+    m_metricsTimer.start();
+
     // TODO: Update the view of all the blocks after changeStartBlock.
     const BlockInfo &firstInfo = m_blocks[changeStartBlock.blockNumber()];
     emit update(QRectF(0., firstInfo.m_offset, 1000000000., 1000000000.));
@@ -485,49 +1067,73 @@ bool VTextDocumentLayout::validateBlocks() const
 void VTextDocumentLayout::updateBlockCount(int p_count, int p_changeStartBlock)
 {
     if (m_blockCount != p_count) {
+        const int delta = p_count - m_blockCount;
         m_blockCount = p_count;
-        m_blocks.resize(m_blockCount);
 
-        // Fix m_blocks.
-        QTextBlock block = document()->findBlockByNumber(p_changeStartBlock);
-        while (block.isValid()) {
-            BlockInfo &info = m_blocks[block.blockNumber()];
-            info.reset();
+        // Blocks after the changed blocks keep their rects. Insert or remove
+        // the infos right after the change start block, whose infos will be
+        // reset by the relayout.
+        const int pos = qMin(p_changeStartBlock + 1, m_blocks.size());
+        if (delta > 0) {
+            shiftLineCountIndex(pos, delta);
+            m_blocks.insert(pos, delta, BlockInfo());
+        } else if (pos - delta <= m_blocks.size()) {
+            shiftLineCountIndex(pos, delta);
+            m_blocks.remove(pos, -delta);
+        } else {
+            shiftLineCountIndex(m_blockCount, m_blockCount - m_blocks.size());
+            m_blocks.resize(m_blockCount);
+        }
+
+        Q_ASSERT(m_blocks.size() == m_blockCount);
 
-            QRectF br = blockRectFromTextLayout(block);
-            if (!br.isNull()) {
-                info.m_rect = br;
+        if (m_shapedFirst != -1) {
+            if (m_shapedFirst > p_changeStartBlock) {
+                m_shapedFirst = qMax(p_changeStartBlock, m_shapedFirst + delta);
             }
 
-            block = block.next();
+            if (m_shapedLast > p_changeStartBlock) {
+                m_shapedLast = qMax(p_changeStartBlock, m_shapedLast + delta);
+            }
+
+            m_shapedLast = qMin(m_shapedLast, m_blockCount - 1);
+            m_shapedFirst = qMin(m_shapedFirst, m_shapedLast);
+        }
+
+        if (m_pendingFirst != -1) {
+            if (m_pendingFirst > p_changeStartBlock) {
+                m_pendingFirst = qMax(p_changeStartBlock, m_pendingFirst + delta);
+            }
+
+            if (m_pendingLast > p_changeStartBlock) {
+                m_pendingLast = qMax(p_changeStartBlock, m_pendingLast + delta);
+            }
+
+            m_pendingLast = qMin(m_pendingLast, m_blockCount - 1);
+            m_pendingFirst = qMin(m_pendingFirst, m_pendingLast);
         }
     }
 }
 
 void VTextDocumentLayout::layoutBlock(const QTextBlock &p_block)
 {
-    QTextDocument *doc = document();
-    Q_ASSERT(m_margin == doc->documentMargin());
+    Q_ASSERT(m_margin == document()->documentMargin());
 
     // The height (y) of the next line.
     qreal height = 0;
     QTextLayout *tl = p_block.layout();
-    QTextOption option = doc->defaultTextOption();
-    tl->setTextOption(option);
+    tl->setTextOption(m_textOption);
 
-    int extraMargin = 0;
-    if (option.flags() & QTextOption::AddSpaceForLineAndParagraphSeparators) {
-        QFontMetrics fm(p_block.charFormat().font());
-        extraMargin += fm.width(QChar(0x21B5));
+    qreal availableWidth = m_availableWidth;
+    if (m_textOption.flags() & QTextOption::AddSpaceForLineAndParagraphSeparators) {
+        availableWidth -= separatorWidth(p_block);
     }
 
-    qreal availableWidth = doc->pageSize().width();
-    if (availableWidth <= 0) {
-        availableWidth = qreal(INT_MAX);
+    const QVector<VBlockImageInfo2> *inlineInfos = NULL;
+    if (m_blockImageEnabled) {
+        inlineInfos = m_imageMgr->findInlineImageInfosByBlock(p_block.blockNumber());
     }
 
-    availableWidth -= (2 * m_margin + extraMargin + m_cursorMargin);
-
     tl->beginLayout();
 
     while (true) {
@@ -541,13 +1147,28 @@ void VTextDocumentLayout::layoutBlock(const QTextBlock &p_block)
         height += m_lineLeading;
         line.setPosition(QPointF(m_margin, height));
         height += line.height();
+
+        if (inlineInfos) {
+            // Reserve space for the inline images from their cached sizes.
+            height += layoutInlineImages(*inlineInfos, line, NULL);
+        }
     }
 
     tl->endLayout();
 
+    const int num = p_block.blockNumber();
+    if (m_shapedFirst == -1) {
+        m_shapedFirst = m_shapedLast = num;
+    } else {
+        m_shapedFirst = qMin(m_shapedFirst, num);
+        m_shapedLast = qMax(m_shapedLast, num);
+    }
+
     // Set this block's line count to its layout's line count.
     // That is one block may occupy multiple visual lines.
-    const_cast<QTextBlock&>(p_block).setLineCount(p_block.isVisible() ? tl->lineCount() : 0);
+    int lineCount = p_block.isVisible() ? tl->lineCount() : 0;
+    const_cast<QTextBlock&>(p_block).setLineCount(lineCount);
+    updateLineCount(num, lineCount);
 
     // Update the info about this block.
     finishBlockLayout(p_block);
@@ -555,15 +1176,39 @@ void VTextDocumentLayout::layoutBlock(const QTextBlock &p_block)
 
 void VTextDocumentLayout::finishBlockLayout(const QTextBlock &p_block)
 {
-    // Update rect and offset.
     Q_ASSERT(p_block.isValid());
     int num = p_block.blockNumber();
     Q_ASSERT(m_blocks.size() > num);
-    BlockInfo &info = m_blocks[num];
+    QRectF rect = blockRectFromTextLayout(p_block);
+    Q_ASSERT(!rect.isNull());
+
+    updateBlockRect(num, rect);
+    m_blocks[num].m_metricsCached = false;
+    m_blocks[num].m_estimated = false;
+}
+
+void VTextDocumentLayout::updateBlockRect(int p_blockNumber, const QRectF &p_rect)
+{
+    BlockInfo &info = m_blocks[p_blockNumber];
+    if (info.hasOffset() && info.m_rect.height() == p_rect.height()) {
+        // Offsets of the following blocks remain the same.
+        info.m_rect = p_rect;
+        return;
+    }
+
+    if (m_batchLayout && info.hasOffset()) {
+        info.m_rect = p_rect;
+        if (m_batchFillFrom == -1 || p_blockNumber < m_batchFillFrom) {
+            m_batchFillFrom = p_blockNumber;
+        }
+
+        return;
+    }
+
+    // Update rect and offset.
     info.reset();
-    info.m_rect = blockRectFromTextLayout(p_block);
-    Q_ASSERT(!info.m_rect.isNull());
-    int pre = previousValidBlockNumber(num);
+    info.m_rect = p_rect;
+    int pre = previousValidBlockNumber(p_blockNumber);
     if (pre == -1) {
         info.m_offset = 0;
     } else if (m_blocks[pre].hasOffset()) {
@@ -571,36 +1216,651 @@ void VTextDocumentLayout::finishBlockLayout(const QTextBlock &p_block)
     }
 
     if (info.hasOffset()) {
-        fillOffsetFrom(num);
+        fillOffsetFrom(p_blockNumber);
     }
 }
 
-int VTextDocumentLayout::previousValidBlockNumber(int p_number) const
+void VTextDocumentLayout::updateMetricsParams()
 {
-    return p_number >= 0 ? p_number - 1 : -1;
+    QTextDocument *doc = document();
+    QTextOption option = doc->defaultTextOption();
+    uint params = qHash(m_margin);
+    params = params * 31 + qHash(m_lineLeading);
+    params = params * 31 + qHash(m_cursorMargin);
+    params = params * 31 + (uint)option.wrapMode();
+    params = params * 31 + (uint)option.flags();
+    params = params * 31 + qHash(doc->defaultFont().key());
+    m_styleParams = params;
+
+    params = params * 31 + qHash(doc->pageSize().width());
+    if (params != m_metricsParams || m_estimatedLineHeight == 0) {
+        QFontMetricsF fm(doc->defaultFont());
+        m_estimatedLineHeight = fm.lineSpacing() + m_lineLeading;
+        m_estimatedCharWidth = fm.averageCharWidth();
+        m_separatorWidths.clear();
+        m_asciiFonts.clear();
+        m_lineChunks.clear();
+    }
+
+    m_metricsParams = params;
+
+    m_textOption = option;
+
+    m_availableWidth = doc->pageSize().width();
+    if (m_availableWidth <= 0) {
+        m_availableWidth = qreal(INT_MAX);
+    }
+
+    m_availableWidth -= 2 * m_margin + m_cursorMargin;
 }
 
-int VTextDocumentLayout::nextValidBlockNumber(int p_number) const
+qreal VTextDocumentLayout::separatorWidth(const QTextBlock &p_block)
 {
-    if (p_number <= -1) {
-        return 0;
-    } else if (p_number >= m_blocks.size() - 1) {
-        return -1;
-    } else {
-        return p_number + 1;
+    const int idx = p_block.charFormatIndex();
+    auto it = m_separatorWidths.constFind(idx);
+    if (it != m_separatorWidths.constEnd()) {
+        return it.value();
     }
+
+    QFontMetrics fm(p_block.charFormat().font());
+    qreal width = fm.width(QChar(0x21B5));
+    m_separatorWidths.insert(idx, width);
+    return width;
 }
 
-void VTextDocumentLayout::updateDocumentSize()
+VTextDocumentLayout::AsciiFont VTextDocumentLayout::calibrateAsciiFont(const QTextCharFormat &p_format)
 {
-    // The last valid block.
-    int idx = previousValidBlockNumber(m_blocks.size());
-    Q_ASSERT(idx > -1);
-    if (m_blocks[idx].hasOffset()) {
-        int oldHeight = m_height;
-        int oldWidth = m_width;
+    AsciiFont font;
+    if (p_format.fontUnderline()
+        || p_format.fontOverline()
+        || p_format.fontStrikeOut()
+        || p_format.fontLetterSpacing() != 0
+        || p_format.fontWordSpacing() != 0
+        || p_format.fontCapitalization() != QFont::MixedCase
+        || p_format.verticalAlignment() != QTextCharFormat::AlignNormal
+        || p_format.background().style() != Qt::NoBrush
+        || p_format.hasProperty(QTextFormat::TextOutline)) {
+        return font;
+    }
 
-        m_height = m_blocks[idx].bottom();
+    if (p_format.hasProperty(QTextFormat::ForegroundBrush)) {
+        QBrush fg = p_format.foreground();
+        if (fg.style() != Qt::SolidPattern) {
+            return font;
+        }
+
+        font.m_color = fg.color();
+    }
+
+    // All the characters, common ligatures and trailing spaces.
+    QString sample;
+    for (int i = 0; i < c_asciiCount; ++i) {
+        sample.append(QChar(c_firstAscii + i));
+    }
+
+    sample += QStringLiteral("->=>!===<=>=&&||:://*/--++ffifl<>  ");
+
+    QTextLayout tl(sample, p_format.font());
+    QTextOption option;
+    option.setWrapMode(QTextOption::NoWrap);
+    tl.setTextOption(option);
+    tl.beginLayout();
+    QTextLine line = tl.createLine();
+    line.setLeadingIncluded(true);
+    line.setLineWidth(c_maxLineWidth);
+    line.setPosition(QPointF(0, 0));
+    tl.endLayout();
+
+    // Fallback fonts and complex shaping give more runs or glyphs.
+    QList<QGlyphRun> runs = tl.glyphRuns();
+    if (runs.size() != 1) {
+        return font;
+    }
+
+    const QVector<quint32> glyphs = runs[0].glyphIndexes();
+    const QVector<QPointF> positions = runs[0].positions();
+    if (glyphs.size() != sample.size() || positions.size() != sample.size()) {
+        return font;
+    }
+
+    const qreal advance = positions[1].x() - positions[0].x();
+    if (advance <= 0) {
+        return font;
+    }
+
+    font.m_glyphs = glyphs.mid(0, c_asciiCount);
+    for (int i = 0; i < sample.size(); ++i) {
+        if (qAbs(positions[i].x() - i * advance) > 0.01
+            || qAbs(positions[i].y() - positions[0].y()) > 0.01
+            || glyphs[i] != font.m_glyphs[sample[i].unicode() - c_firstAscii]) {
+            return font;
+        }
+    }
+
+    const qreal naturalWidth = line.naturalTextWidth();
+    if (qAbs(naturalWidth - sample.size() * advance) <= 0.01) {
+        font.m_trailingSpaces = true;
+    } else if (qAbs(naturalWidth - (sample.size() - 2) * advance) > 0.01) {
+        return font;
+    }
+
+    font.m_advance = advance;
+    font.m_lineHeight = line.height();
+    font.m_baseline = positions[0].y();
+    font.m_rawFont = runs[0].rawFont();
+    font.m_valid = true;
+    return font;
+}
+
+const VTextDocumentLayout::AsciiFont *VTextDocumentLayout::asciiBlockFont(const QTextBlock &p_block)
+{
+    if (!p_block.isVisible()
+        || (m_textOption.flags() & (QTextOption::ShowTabsAndSpaces
+                                    | QTextOption::ShowLineAndParagraphSeparators
+                                    | QTextOption::AddSpaceForLineAndParagraphSeparators))
+        || (m_textOption.alignment() & Qt::AlignHorizontal_Mask & ~(Qt::AlignLeft | Qt::AlignAbsolute))
+        || m_textOption.textDirection() == Qt::RightToLeft) {
+        return NULL;
+    }
+
+    if (m_blockImageEnabled
+        && (m_imageMgr->findImageInfoByBlock(p_block.blockNumber())
+            || m_imageMgr->findInlineImageInfosByBlock(p_block.blockNumber()))) {
+        return NULL;
+    }
+
+    if (!p_block.layout()->preeditAreaText().isEmpty()) {
+        return NULL;
+    }
+
+    // Single format.
+    int idx = -1;
+    QTextCharFormat format;
+    for (QTextBlock::iterator it = p_block.begin(); !it.atEnd(); ++it) {
+        QTextFragment fragment = it.fragment();
+        if (idx == -1) {
+            idx = fragment.charFormatIndex();
+            format = fragment.charFormat();
+        } else if (fragment.charFormatIndex() != idx) {
+            return NULL;
+        }
+    }
+
+    if (idx == -1) {
+        idx = p_block.charFormatIndex();
+        format = p_block.charFormat();
+    }
+
+    auto it = m_asciiFonts.constFind(idx);
+    if (it == m_asciiFonts.constEnd()) {
+        it = m_asciiFonts.insert(idx, calibrateAsciiFont(format));
+    }
+
+    const AsciiFont &font = it.value();
+    if (!font.m_valid) {
+        return NULL;
+    }
+
+    const QString text = p_block.text();
+    if (!isPrintableAscii(text.utf16(), text.size())) {
+        return NULL;
+    }
+
+    // A single line.
+    if (m_textOption.wrapMode() != QTextOption::NoWrap
+        && text.size() * font.m_advance >= m_availableWidth) {
+        return NULL;
+    }
+
+    return &font;
+}
+
+bool VTextDocumentLayout::measureAsciiBlock(const QTextBlock &p_block)
+{
+    const AsciiFont *font = asciiBlockFont(p_block);
+    if (!font) {
+        return false;
+    }
+
+    int length = p_block.length() - 1;
+    if (!font->m_trailingSpaces) {
+        const QString text = p_block.text();
+        while (length > 0 && text[length - 1] == QLatin1Char(' ')) {
+            --length;
+        }
+    }
+
+    // The same as blockRectFromTextLayout() for a single line.
+    const qreal textWidth = length * font->m_advance;
+    qreal lineWidth = textWidth;
+    if (m_availableWidth < c_maxLineWidth) {
+        lineWidth = qMax(m_availableWidth, textWidth);
+    }
+
+    qreal height = m_lineLeading + font->m_lineHeight;
+    if (!p_block.next().isValid()) {
+        height += m_margin;
+    }
+
+    BlockMetrics metrics;
+    metrics.m_rect = QRectF(0,
+                            0,
+                            qMax(m_margin + lineWidth, textWidth) + m_margin + m_cursorMargin,
+                            height);
+    metrics.m_lineCount = 1;
+    applyBlockMetrics(p_block, metrics);
+    return true;
+}
+
+void VTextDocumentLayout::drawAsciiBlock(QPainter *p_painter,
+                                         const QTextBlock &p_block,
+                                         const AsciiFont &p_font,
+                                         const QPointF &p_offset,
+                                         const QRectF &p_clip)
+{
+    const QString text = p_block.text();
+    const ushort *data = text.utf16();
+
+    // The line is placed at m_margin as in layoutBlock().
+    const qreal x = p_offset.x() + m_margin;
+    const qreal y = p_offset.y() + m_lineLeading + p_font.m_baseline;
+
+    int first = 0, last = text.size() - 1;
+    if (p_clip.isValid()) {
+        first = qMax(first, (int)((p_clip.left() - x) / p_font.m_advance) - 1);
+        last = qMin(last, (int)((p_clip.right() - x) / p_font.m_advance) + 1);
+    }
+
+    if (first > last) {
+        return;
+    }
+
+    QVector<quint32> glyphs;
+    QVector<QPointF> positions;
+    glyphs.reserve(last - first + 1);
+    positions.reserve(last - first + 1);
+    for (int i = first; i <= last; ++i) {
+        if (data[i] == ' ') {
+            continue;
+        }
+
+        glyphs.append(p_font.m_glyphs[data[i] - c_firstAscii]);
+        positions.append(QPointF(x + i * p_font.m_advance, y));
+    }
+
+    if (glyphs.isEmpty()) {
+        return;
+    }
+
+    QGlyphRun run;
+    run.setRawFont(p_font.m_rawFont);
+    run.setGlyphIndexes(glyphs);
+    run.setPositions(positions);
+
+    if (p_font.m_color.isValid()) {
+        QPen oldPen = p_painter->pen();
+        p_painter->setPen(p_font.m_color);
+        p_painter->drawGlyphRun(QPointF(0, 0), run);
+        p_painter->setPen(oldPen);
+    } else {
+        p_painter->drawGlyphRun(QPointF(0, 0), run);
+    }
+}
+
+const VTextDocumentLayout::LineChunks *VTextDocumentLayout::lineChunks(const QTextBlock &p_block) const
+{
+    auto it = m_lineChunks.constFind(p_block.fragmentIndex());
+    return it == m_lineChunks.constEnd() ? NULL : &it.value();
+}
+
+bool VTextDocumentLayout::measureLongLine(const QTextBlock &p_block)
+{
+    const int idx = p_block.fragmentIndex();
+    m_lineChunks.remove(idx);
+
+    if (m_textOption.wrapMode() != QTextOption::NoWrap
+        || !p_block.isVisible()
+        || p_block.length() - 1 <= c_longLineLength
+        || (m_textOption.flags() & (QTextOption::ShowTabsAndSpaces
+                                    | QTextOption::ShowLineAndParagraphSeparators
+                                    | QTextOption::AddSpaceForLineAndParagraphSeparators))
+        || (m_textOption.alignment() & Qt::AlignHorizontal_Mask & ~(Qt::AlignLeft | Qt::AlignAbsolute))
+        || m_textOption.textDirection() == Qt::RightToLeft
+        || !p_block.layout()->preeditAreaText().isEmpty()
+        || p_block.blockNumber() == m_cursorBlock) {
+        // The block of the cursor is laid out to be drawn anyway.
+        return false;
+    }
+
+    if (m_blockImageEnabled
+        && (m_imageMgr->findImageInfoByBlock(p_block.blockNumber())
+            || m_imageMgr->findInlineImageInfosByBlock(p_block.blockNumber()))) {
+        return false;
+    }
+
+    const QString text = p_block.text();
+    if (text.contains(QLatin1Char('\t')) || hasRightToLeft(text)) {
+        return false;
+    }
+
+    // Break between two ASCII characters, preferably after a separator, so
+    // no shaping crosses the chunks.
+    LineChunks chunks;
+    chunks.m_starts.append(0);
+    int pos = c_lineChunkLength;
+    while (pos < text.size() - c_lineChunkLength) {
+        const int end = pos + c_lineChunkSlack;
+        int brk = -1;
+        for (int i = pos; i < end; ++i) {
+            const ushort pre = text[i - 1].unicode();
+            if (pre >= 0x80 || text[i].unicode() >= 0x80) {
+                continue;
+            }
+
+            if (pre == ' ' || pre == ',' || pre == ';') {
+                brk = i;
+                break;
+            } else if (brk == -1) {
+                brk = i;
+            }
+        }
+
+        if (brk == -1) {
+            pos = end;
+            continue;
+        }
+
+        chunks.m_starts.append(brk);
+        pos = brk + c_lineChunkLength;
+    }
+
+    chunks.m_starts.append(text.size());
+
+    // Shape the chunks one by one for their widths and the height of the line.
+    // Only the metrics are kept.
+    qreal ascent = 0, descent = 0;
+    chunks.m_xs.append(m_margin);
+    for (int i = 0; i < chunks.m_starts.size() - 1; ++i) {
+        QTextLayout layout;
+        layoutLineChunk(p_block, text, chunks, i, 0, layout);
+        QTextLine line = layout.lineAt(0);
+        chunks.m_xs.append(chunks.m_xs.last() + line.cursorToX(line.textLength()) - line.x());
+        ascent = qMax(ascent, line.ascent());
+        descent = qMax(descent, line.height() - line.ascent());
+    }
+
+    chunks.m_baseline = m_lineLeading + ascent;
+
+    // The same as blockRectFromTextLayout() for a single line.
+    const qreal textWidth = chunks.m_xs.last() - m_margin;
+    qreal lineWidth = textWidth;
+    if (m_availableWidth < c_maxLineWidth) {
+        lineWidth = qMax(m_availableWidth, textWidth);
+    }
+
+    qreal height = m_lineLeading + ascent + descent;
+    if (!p_block.next().isValid()) {
+        height += m_margin;
+    }
+
+    BlockMetrics metrics;
+    metrics.m_rect = QRectF(0,
+                            0,
+                            qMax(m_margin + lineWidth, textWidth) + m_margin + m_cursorMargin,
+                            height);
+    metrics.m_lineCount = 1;
+    applyBlockMetrics(p_block, metrics);
+
+    m_lineChunks.insert(idx, chunks);
+    return true;
+}
+
+void VTextDocumentLayout::layoutLineChunk(const QTextBlock &p_block,
+                                          const QString &p_text,
+                                          const LineChunks &p_chunks,
+                                          int p_index,
+                                          qreal p_baseline,
+                                          QTextLayout &p_layout) const
+{
+    const int start = p_chunks.m_starts[p_index];
+    const int end = p_chunks.m_starts[p_index + 1];
+    p_layout.setText(p_text.mid(start, end - start));
+    p_layout.setFont(document()->defaultFont());
+
+    QTextOption option = m_textOption;
+    option.setWrapMode(QTextOption::NoWrap);
+    p_layout.setTextOption(option);
+
+    // Formats of the fragments within the chunk.
+    QVector<QTextLayout::FormatRange> formats;
+    const int blpos = p_block.position();
+    for (QTextBlock::iterator it = p_block.begin(); !it.atEnd(); ++it) {
+        QTextFragment fragment = it.fragment();
+        const int fs = qMax(fragment.position() - blpos, start);
+        const int fe = qMin(fragment.position() - blpos + fragment.length(), end);
+        if (fs < fe) {
+            QTextLayout::FormatRange range;
+            range.start = fs - start;
+            range.length = fe - fs;
+            range.format = fragment.charFormat();
+            formats.append(range);
+        }
+    }
+
+    p_layout.setFormats(formats);
+
+    p_layout.beginLayout();
+    QTextLine line = p_layout.createLine();
+    line.setLeadingIncluded(true);
+    line.setLineWidth(c_maxLineWidth);
+    line.setPosition(QPointF(p_chunks.m_xs.isEmpty() ? 0 : p_chunks.m_xs[p_index],
+                             p_baseline - line.ascent()));
+    p_layout.endLayout();
+}
+
+int VTextDocumentLayout::lineChunkAt(const LineChunks &p_chunks, qreal p_x) const
+{
+    // The last chunk whose start is not after @p_x.
+    auto it = std::upper_bound(p_chunks.m_xs.constBegin(), p_chunks.m_xs.constEnd() - 1, p_x);
+    int idx = it - p_chunks.m_xs.constBegin() - 1;
+    return qBound(0, idx, p_chunks.m_starts.size() - 2);
+}
+
+void VTextDocumentLayout::drawLineChunks(QPainter *p_painter,
+                                         const QTextBlock &p_block,
+                                         const LineChunks &p_chunks,
+                                         const QPointF &p_offset,
+                                         const QVector<QTextLayout::FormatRange> &p_selections,
+                                         const QRectF &p_clip)
+{
+    const QString text = p_block.text();
+
+    int first = 0, last = p_chunks.m_starts.size() - 2;
+    if (p_clip.isValid()) {
+        first = lineChunkAt(p_chunks, p_clip.left() - p_offset.x());
+        last = lineChunkAt(p_chunks, p_clip.right() - p_offset.x());
+    }
+
+    for (int i = first; i <= last; ++i) {
+        const int start = p_chunks.m_starts[i];
+        const int end = p_chunks.m_starts[i + 1];
+
+        QVector<QTextLayout::FormatRange> selections;
+        for (auto const & sel : p_selections) {
+            const int ss = qMax(sel.start, start);
+            const int se = qMin(sel.start + sel.length, end);
+            if (ss < se) {
+                QTextLayout::FormatRange range = sel;
+                range.start = ss - start;
+                range.length = se - ss;
+                selections.append(range);
+            }
+        }
+
+        QTextLayout layout;
+        layoutLineChunk(p_block, text, p_chunks, i, p_chunks.m_baseline, layout);
+        layout.draw(p_painter, p_offset, selections, p_clip);
+    }
+}
+
+bool VTextDocumentLayout::metricsKey(const QTextBlock &p_block, MetricsKey &p_key) const
+{
+    // Images and preedit text are not part of the key.
+    if (m_blockImageEnabled
+        && (m_imageMgr->findImageInfoByBlock(p_block.blockNumber())
+            || m_imageMgr->findInlineImageInfosByBlock(p_block.blockNumber()))) {
+        return false;
+    }
+
+    if (!p_block.layout()->preeditAreaText().isEmpty()) {
+        return false;
+    }
+
+    QString text = p_block.text();
+    uint formatHash = p_block.blockFormatIndex() * 31 + p_block.charFormatIndex();
+    for (QTextBlock::iterator it = p_block.begin(); !it.atEnd(); ++it) {
+        QTextFragment fragment = it.fragment();
+        formatHash = formatHash * 31 + fragment.charFormatIndex();
+        formatHash = formatHash * 31 + fragment.length();
+    }
+
+    p_key.m_textHash = qHash(text);
+    p_key.m_textHash2 = qHash(text, 0x9e3779b9);
+    p_key.m_formatHash = formatHash;
+    p_key.m_length = text.size();
+    p_key.m_params = m_metricsParams;
+    p_key.m_last = !p_block.next().isValid();
+    return true;
+}
+
+bool VTextDocumentLayout::restoreBlockMetrics(const QTextBlock &p_block)
+{
+    MetricsKey key;
+    if (!metricsKey(p_block, key)) {
+        return false;
+    }
+
+    const BlockMetrics *metrics = m_metricsCache.object(key);
+    if (!metrics) {
+        return false;
+    }
+
+    applyBlockMetrics(p_block, *metrics);
+    return true;
+}
+
+void VTextDocumentLayout::applyBlockMetrics(const QTextBlock &p_block, const BlockMetrics &p_metrics)
+{
+    m_lineChunks.remove(p_block.fragmentIndex());
+
+    const int num = p_block.blockNumber();
+    int lineCount = p_block.isVisible() ? p_metrics.m_lineCount : 0;
+    const_cast<QTextBlock&>(p_block).setLineCount(lineCount);
+    updateLineCount(num, lineCount);
+
+    updateBlockRect(num, p_metrics.m_rect);
+    m_blocks[num].m_estimated = false;
+}
+
+void VTextDocumentLayout::ensureBlockLayout(const QTextBlock &p_block) const
+{
+    int num = p_block.blockNumber();
+    if (!p_block.isValid()
+        || p_block.layout()->lineCount() > 0
+        || num >= m_blocks.size()
+        || !m_blocks[num].hasOffset()) {
+        return;
+    }
+
+    VTextDocumentLayout *that = const_cast<VTextDocumentLayout *>(this);
+    qreal oldHeight = m_blocks[num].m_rect.height();
+    that->layoutBlock(p_block);
+    if (m_blocks[num].m_rect.height() != oldHeight) {
+        // The cached metrics are out of date.
+        if (m_deferredUpdateBlock == -1 || num < m_deferredUpdateBlock) {
+            that->m_deferredUpdateBlock = num;
+        }
+
+        that->m_deferredUpdateTimer.start();
+    }
+}
+
+void VTextDocumentLayout::updateDeferredBlocks()
+{
+    if (m_deferredUpdateBlock == -1) {
+        return;
+    }
+
+    // Blocks may be removed since.
+    const int num = qMin(m_deferredUpdateBlock, m_blocks.size() - 1);
+    m_deferredUpdateBlock = -1;
+    if (num < 0) {
+        return;
+    }
+
+    updateDocumentSize();
+
+    qreal top = m_blocks[num].hasOffset() ? m_blocks[num].m_offset : 0.;
+    emit update(QRectF(0., top, 1000000000., 1000000000.));
+}
+
+void VTextDocumentLayout::cacheVisibleBlockMetrics()
+{
+    for (auto const & rect : m_viewportRects) {
+        int first, last;
+        if (!blockRangeOfViewport(rect, first, last)) {
+            continue;
+        }
+
+        QTextBlock block = document()->findBlockByNumber(first);
+        for (int i = first; i <= last && block.isValid(); ++i, block = block.next()) {
+            BlockInfo &info = m_blocks[i];
+            // Only the exact metrics of laid out blocks.
+            if (info.m_metricsCached
+                || !info.hasOffset()
+                || block.layout()->lineCount() == 0) {
+                continue;
+            }
+
+            MetricsKey key;
+            if (metricsKey(block, key)) {
+                BlockMetrics *metrics = new BlockMetrics();
+                metrics->m_rect = info.m_rect;
+                metrics->m_lineCount = block.layout()->lineCount();
+                m_metricsCache.insert(key, metrics);
+            }
+
+            info.m_metricsCached = true;
+        }
+    }
+}
+
+int VTextDocumentLayout::previousValidBlockNumber(int p_number) const
+{
+    return p_number >= 0 ? p_number - 1 : -1;
+}
+
+int VTextDocumentLayout::nextValidBlockNumber(int p_number) const
+{
+    if (p_number <= -1) {
+        return 0;
+    } else if (p_number >= m_blocks.size() - 1) {
+        return -1;
+    } else {
+        return p_number + 1;
+    }
+}
+
+void VTextDocumentLayout::updateDocumentSize()
+{
+    // The last valid block.
+    int idx = previousValidBlockNumber(m_blocks.size());
+    Q_ASSERT(idx > -1);
+    if (m_blocks[idx].hasOffset()) {
+        int oldHeight = m_height;
+        int oldWidth = m_width;
+
+        m_height = m_blocks[idx].bottom();
 
         m_width = 0;
         for (int i = 0; i < m_blocks.size(); ++i) {
@@ -644,6 +1904,16 @@ QRectF VTextDocumentLayout::blockRectFromTextLayout(const QTextBlock &p_block)
         br.setWidth(qMax(br.width(), tl->lineAt(0).naturalTextWidth()));
     }
 
+    // Handle inline images.
+    if (m_blockImageEnabled) {
+        QVector<InlineImage> images;
+        inlineImagesFromTextLayout(p_block, images);
+        for (auto const & img : images) {
+            br.setRight(qMax(br.right(), img.m_rect.right()));
+            br.setBottom(qMax(br.bottom(), img.m_rect.bottom()));
+        }
+    }
+
     // Handle block image.
     if (m_blockImageEnabled) {
         const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(p_block.blockNumber());
@@ -728,7 +1998,8 @@ void VTextDocumentLayout::adjustImagePaddingAndSize(const VBlockImageInfo2 *p_in
 
 void VTextDocumentLayout::drawBlockImage(QPainter *p_painter,
                                          const QTextBlock &p_block,
-                                         const QPointF &p_offset)
+                                         const QPointF &p_offset,
+                                         const QRectF &p_clip)
 {
     if (!m_blockImageEnabled) {
         return;
@@ -739,20 +2010,1013 @@ void VTextDocumentLayout::drawBlockImage(QPainter *p_painter,
         return;
     }
 
-    const QPixmap *image = m_imageMgr->findImage(info->m_imageName);
-    Q_ASSERT(image);
+    QRect targetRect = blockImageRect(p_block, info, p_offset);
+    m_imageMgr->drawImage(p_painter, info->m_imageName, targetRect, p_clip);
+}
 
-    // Draw block image.
+QRect VTextDocumentLayout::blockImageRect(const QTextBlock &p_block,
+                                          const VBlockImageInfo2 *p_info,
+                                          const QPointF &p_offset) const
+{
+    ensureBlockLayout(p_block);
     QTextLayout *tl = p_block.layout();
     QRectF tlRect = tl->boundingRect();
     int maximumWidth = tlRect.width();
+
+    // Block image is placed below all the contents.
+    QVector<InlineImage> images;
+    inlineImagesFromTextLayout(p_block, images);
+    for (auto const & img : images) {
+        tlRect.setBottom(qMax(tlRect.bottom(), img.m_rect.bottom()));
+    }
+
     int padding;
     QSize size;
-    adjustImagePaddingAndSize(info, maximumWidth, padding, size);
-    QRect targetRect(p_offset.x() + padding,
-                     p_offset.y() + tlRect.height() + m_lineLeading,
-                     size.width(),
-                     size.height());
+    adjustImagePaddingAndSize(p_info, maximumWidth, padding, size);
+    return QRect(p_offset.x() + padding,
+                 p_offset.y() + tlRect.height() + m_lineLeading,
+                 size.width(),
+                 size.height());
+}
+
+qreal VTextDocumentLayout::layoutInlineImages(const QVector<VBlockImageInfo2> &p_infos,
+                                              const QTextLine &p_line,
+                                              QVector<InlineImage> *p_images) const
+{
+    const int lineStart = p_line.textStart();
+    const int lineEnd = lineStart + p_line.textLength();
+    const qreal top = p_line.y() + p_line.height() + m_lineLeading;
+    qreal spaceHeight = 0;
+    // Right of the previous image in this line.
+    qreal right = p_line.x();
+    for (auto const & info : p_infos) {
+        if (info.m_imageSize.isNull()
+            || info.m_startPos < lineStart
+            || info.m_startPos >= lineEnd) {
+            continue;
+        }
+
+        // Place the image below its link and do not overlap the previous one.
+        qreal x = qMax(p_line.cursorToX(info.m_startPos), right);
+
+        VBlockImageInfo2 tmpInfo(info);
+        tmpInfo.m_padding = x - p_line.x();
+        int padding;
+        QSize size;
+        adjustImagePaddingAndSize(&tmpInfo, p_line.width(), padding, size);
+        x = p_line.x() + padding;
+
+        if (p_images) {
+            InlineImage img;
+            img.m_info = &info;
+            img.m_rect = QRectF(x, top, size.width(), size.height());
+            p_images->append(img);
+        }
+
+        right = x + size.width();
+        spaceHeight = qMax(spaceHeight, m_lineLeading + size.height());
+    }
+
+    return spaceHeight;
+}
+
+void VTextDocumentLayout::inlineImagesFromTextLayout(const QTextBlock &p_block,
+                                                     QVector<InlineImage> &p_images) const
+{
+    const QVector<VBlockImageInfo2> *inlineInfos = m_imageMgr->findInlineImageInfosByBlock(p_block.blockNumber());
+    if (!inlineInfos) {
+        return;
+    }
+
+    QTextLayout *tl = p_block.layout();
+    for (int i = 0; i < tl->lineCount(); ++i) {
+        layoutInlineImages(*inlineInfos, tl->lineAt(i), &p_images);
+    }
+}
+
+void VTextDocumentLayout::drawInlineImages(QPainter *p_painter,
+                                           const QTextBlock &p_block,
+                                           const QPointF &p_offset,
+                                           const QRectF &p_clip)
+{
+    if (!m_blockImageEnabled) {
+        return;
+    }
+
+    QVector<InlineImage> images;
+    inlineImagesFromTextLayout(p_block, images);
+    for (auto const & img : images) {
+        QRect targetRect = img.m_rect.translated(p_offset).toRect();
+        if (p_clip.isValid() && !p_clip.intersects(targetRect)) {
+            continue;
+        }
+
+        m_imageMgr->drawImage(p_painter, img.m_info->m_imageName, targetRect, p_clip);
+    }
+}
+
+void VTextDocumentLayout::setViewportRect(const QObject *p_view, const QRectF &p_rect)
+{
+    if (p_rect.isNull()) {
+        if (m_viewportRects.remove(p_view) == 0) {
+            return;
+        }
+    } else {
+        auto it = m_viewportRects.find(p_view);
+        if (it != m_viewportRects.end() && it.value() == p_rect) {
+            return;
+        }
+
+        m_viewportRects.insert(p_view, p_rect);
+    }
+
+    updateVisibleAnimations();
+
+    updatePrefetch(p_view, p_rect);
+
+    if (m_reclaimWindow >= 0) {
+        m_reclaimTimer.start();
+    }
+
+    if (!m_viewportRects.isEmpty()) {
+        m_metricsTimer.start();
+    }
+}
+
+bool VTextDocumentLayout::blockRangeOfViewport(const QRectF &p_rect, int &p_first, int &p_last) const
+{
+    p_first = p_last = -1;
+    if (p_rect.isNull()
+        || m_blocks.isEmpty()
+        || m_blocks.size() != document()->blockCount()) {
+        return false;
+    }
+
+    blockRangeFromRectBS(p_rect, p_first, p_last);
+    return p_first > -1;
+}
+
+bool VTextDocumentLayout::viewportBlockRange(int &p_first, int &p_last) const
+{
+    p_first = p_last = -1;
+    for (auto const & rect : m_viewportRects) {
+        int first, last;
+        if (blockRangeOfViewport(rect, first, last)) {
+            p_first = p_first == -1 ? first : qMin(p_first, first);
+            p_last = qMax(p_last, last);
+        }
+    }
+
+    return p_first > -1;
+}
+
+void VTextDocumentLayout::updateVisibleAnimations()
+{
+    QSet<QString> names;
+    if (m_blockImageEnabled && m_imageMgr->hasAnimations()) {
+        for (auto const & rect : m_viewportRects) {
+            int first, last;
+            if (!blockRangeOfViewport(rect, first, last)) {
+                continue;
+            }
+
+            for (int i = first; i <= last; ++i) {
+                const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(i);
+                if (info && m_imageMgr->isAnimation(info->m_imageName)) {
+                    names.insert(info->m_imageName);
+                }
+
+                const QVector<VBlockImageInfo2> *inlineInfos = m_imageMgr->findInlineImageInfosByBlock(i);
+                if (inlineInfos) {
+                    for (auto const & inlineInfo : *inlineInfos) {
+                        if (m_imageMgr->isAnimation(inlineInfo.m_imageName)) {
+                            names.insert(inlineInfo.m_imageName);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    m_imageMgr->setVisibleAnimations(names);
+}
+
+void VTextDocumentLayout::updateAnimatedImage(const QString &p_name)
+{
+    if (!m_blockImageEnabled) {
+        return;
+    }
+
+    for (auto const & rect : m_viewportRects) {
+        int first, last;
+        if (!blockRangeOfViewport(rect, first, last)) {
+            continue;
+        }
+
+        // Only update the rect of the image.
+        QTextBlock block = document()->findBlockByNumber(first);
+        for (int i = first; i <= last && block.isValid(); ++i, block = block.next()) {
+            const QPointF offset(m_margin, m_blocks[i].top());
+            const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(i);
+            if (info
+                && !info->m_imageSize.isNull()
+                && info->m_imageName == p_name) {
+                emit update(blockImageRect(block, info, offset));
+            }
+
+            if (m_imageMgr->findInlineImageInfosByBlock(i)) {
+                QVector<InlineImage> images;
+                inlineImagesFromTextLayout(block, images);
+                for (auto const & img : images) {
+                    if (img.m_info->m_imageName == p_name) {
+                        emit update(img.m_rect.translated(offset));
+                    }
+                }
+            }
+        }
+    }
+}
+
+void VTextDocumentLayout::updateLineCount(int p_blockNumber, int p_count)
+{
+    if (m_lineCountIndexDirty || m_lineCountIndex.size() != m_blocks.size() + 1) {
+        // Will be rebuilt on demand.
+        m_lineCountIndexDirty = true;
+        return;
+    }
+
+    int delta = p_count - (lineCountPrefixSum(p_blockNumber + 1) - lineCountPrefixSum(p_blockNumber));
+    if (delta == 0) {
+        return;
+    }
+
+    for (int i = p_blockNumber + 1; i < m_lineCountIndex.size(); i += (i & -i)) {
+        m_lineCountIndex[i] += delta;
+    }
+}
+
+void VTextDocumentLayout::shiftLineCountIndex(int p_pos, int p_delta)
+{
+    const int n = m_blocks.size();
+    if (m_lineCountIndexDirty || m_lineCountIndex.size() != n + 1) {
+        // Will be rebuilt on demand.
+        m_lineCountIndexDirty = true;
+        return;
+    }
+
+    Q_ASSERT(p_pos >= 0 && p_pos - qMin(p_delta, 0) <= n);
+
+    // Nodes up to @p_pos cover only the blocks before @p_pos and are kept.
+    // Turn the nodes after it into the line counts of their blocks by undoing
+    // the build, including the sums added by the nodes up to @p_pos, which are
+    // those along the prefix path of @p_pos.
+    for (int i = n; i > p_pos; --i) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            m_lineCountIndex[parent] -= m_lineCountIndex[i];
+        }
+    }
+
+    for (int i = p_pos; i > 0; i -= (i & -i)) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            m_lineCountIndex[parent] -= m_lineCountIndex[i];
+        }
+    }
+
+    // Inserted blocks have no lines until laid out.
+    if (p_delta > 0) {
+        m_lineCountIndex.insert(p_pos + 1, p_delta, 0);
+    } else {
+        m_lineCountIndex.remove(p_pos + 1, -p_delta);
+    }
+
+    // Build the nodes after @p_pos again.
+    const int count = m_lineCountIndex.size() - 1;
+    for (int i = p_pos; i > 0; i -= (i & -i)) {
+        int parent = i + (i & -i);
+        if (parent <= count) {
+            m_lineCountIndex[parent] += m_lineCountIndex[i];
+        }
+    }
+
+    for (int i = p_pos + 1; i <= count; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= count) {
+            m_lineCountIndex[parent] += m_lineCountIndex[i];
+        }
+    }
+}
+
+void VTextDocumentLayout::ensureLineCountIndex() const
+{
+    if (!m_lineCountIndexDirty && m_lineCountIndex.size() == m_blocks.size() + 1) {
+        return;
+    }
+
+    int n = m_blocks.size();
+    m_lineCountIndex.fill(0, n + 1);
+
+    QTextBlock block = document()->firstBlock();
+    while (block.isValid() && block.blockNumber() < n) {
+        m_lineCountIndex[block.blockNumber() + 1] = block.lineCount();
+        block = block.next();
+    }
+
+    // Build the tree in place in O(n).
+    for (int i = 1; i <= n; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            m_lineCountIndex[parent] += m_lineCountIndex[i];
+        }
+    }
+
+    m_lineCountIndexDirty = false;
+}
+
+int VTextDocumentLayout::lineCountPrefixSum(int p_count) const
+{
+    int sum = 0;
+    for (int i = qMin(p_count, m_lineCountIndex.size() - 1); i > 0; i -= (i & -i)) {
+        sum += m_lineCountIndex[i];
+    }
+
+    return sum;
+}
+
+int VTextDocumentLayout::visualLineCount() const
+{
+    ensureLineCountIndex();
+    return lineCountPrefixSum(m_blocks.size());
+}
+
+int VTextDocumentLayout::visualLineOfBlock(int p_blockNumber) const
+{
+    ensureLineCountIndex();
+    return lineCountPrefixSum(p_blockNumber);
+}
+
+int VTextDocumentLayout::findBlockByVisualLine(int p_line, int *p_lineInBlock) const
+{
+    ensureLineCountIndex();
+    int n = m_blocks.size();
+    if (p_line < 0 || n == 0) {
+        return -1;
+    }
+
+    // Descend the tree for the last block whose prefix sum is not greater than
+    // @p_line. Blocks with no lines are skipped naturally.
+    int step = 1;
+    while (step * 2 <= n) {
+        step *= 2;
+    }
+
+    int idx = 0;
+    int rest = p_line;
+    for (; step > 0; step /= 2) {
+        if (idx + step <= n && m_lineCountIndex[idx + step] <= rest) {
+            idx += step;
+            rest -= m_lineCountIndex[idx];
+        }
+    }
+
+    if (idx >= n) {
+        return -1;
+    }
+
+    if (p_lineInBlock) {
+        *p_lineInBlock = rest;
+    }
+
+    return idx;
+}
+
+int VTextDocumentLayout::visualLineOfPosition(int p_position) const
+{
+    QTextBlock block = document()->findBlock(p_position);
+    if (!block.isValid()) {
+        return -1;
+    }
+
+    int line = visualLineOfBlock(block.blockNumber());
+    ensureBlockLayout(block);
+    QTextLayout *tl = block.layout();
+    if (tl->lineCount() > 0) {
+        QTextLine tline = tl->lineForTextPosition(p_position - block.position());
+        if (tline.isValid()) {
+            line += tline.lineNumber();
+        }
+    }
+
+    return line;
+}
+
+int VTextDocumentLayout::positionOfVisualLine(int p_line) const
+{
+    int lineInBlock = 0;
+    int num = findBlockByVisualLine(p_line, &lineInBlock);
+    if (num == -1) {
+        return -1;
+    }
+
+    QTextBlock block = document()->findBlockByNumber(num);
+    ensureBlockLayout(block);
+    QTextLayout *tl = block.layout();
+    if (lineInBlock >= tl->lineCount()) {
+        return block.position();
+    }
+
+    return block.position() + tl->lineAt(lineInBlock).textStart();
+}
+
+void VTextDocumentLayout::setSearchEngine(const VSearchEngine *p_engine, const QTextCharFormat &p_format)
+{
+    if (m_searchEngine) {
+        disconnect(m_searchEngine, 0, this, 0);
+    }
+
+    m_searchEngine = p_engine;
+    m_searchMatchFormat = p_format;
+    if (m_searchEngine) {
+        connect(m_searchEngine, &VSearchEngine::matchesFound,
+                this, &VTextDocumentLayout::updateBlocks);
+    }
+
+    emit update(QRectF(0., 0., 1000000000., 1000000000.));
+}
+
+void VTextDocumentLayout::updateBlocks(int p_firstBlock, int p_lastBlock)
+{
+    int first = qMax(p_firstBlock, 0);
+    int last = qMin(p_lastBlock, m_blocks.size() - 1);
+    if (first > last
+        || !m_blocks[first].hasOffset()
+        || !m_blocks[last].hasOffset()) {
+        return;
+    }
+
+    // Only the visible part will be repainted.
+    qreal top = m_blocks[first].top();
+    emit update(QRectF(0., top, 1000000000., m_blocks[last].bottom() - top));
+}
+
+void VTextDocumentLayout::saveSnapshot(QDataStream &p_out) const
+{
+    p_out << c_snapshotVersion
+          << m_styleParams
+          << (double)document()->pageSize().width()
+          << contentHash(document());
+    p_out << (qint32)m_blocks.size();
+    QTextBlock block = document()->firstBlock();
+    for (int i = 0; i < m_blocks.size() && block.isValid(); ++i, block = block.next()) {
+        const BlockInfo &info = m_blocks[i];
+        p_out << (float)info.m_rect.width()
+              << (float)info.m_rect.height()
+              << (qint32)block.lineCount();
+    }
+}
+
+bool VTextDocumentLayout::loadSnapshot(QDataStream &p_in)
+{
+    m_snapshot.clear();
+    m_snapshotApplied = false;
+
+    quint32 version = 0;
+    qint32 cnt = 0;
+    p_in >> version;
+    if (version != c_snapshotVersion) {
+        return false;
+    }
+
+    double width = 0;
+    p_in >> m_snapshotParams >> width >> m_snapshotContentHash >> cnt;
+    m_snapshotWidth = width;
+    if (p_in.status() != QDataStream::Ok || cnt <= 0) {
+        return false;
+    }
+
+    // The count comes from a cache file. Bound it by the data left.
+    // Floats are streamed in the precision of the stream.
+    const qint64 floatSize = p_in.floatingPointPrecision() == QDataStream::SinglePrecision ? 4 : 8;
+    const qint64 recordSize = 2 * floatSize + sizeof(qint32);
+    QIODevice *dev = p_in.device();
+    if (dev && !dev->isSequential() && cnt > dev->bytesAvailable() / recordSize) {
+        return false;
+    }
+
+    QVector<BlockMetrics> snapshot;
+    for (qint32 i = 0; i < cnt; ++i) {
+        float width = 0, height = 0;
+        qint32 lineCount = 0;
+        p_in >> width >> height >> lineCount;
+        if (p_in.status() != QDataStream::Ok) {
+            return false;
+        }
+
+        BlockMetrics metrics;
+        metrics.m_rect = QRectF(0, 0, width, height);
+        metrics.m_lineCount = lineCount;
+        snapshot.append(metrics);
+    }
+
+    m_snapshot = snapshot;
+    return true;
+}
+
+bool VTextDocumentLayout::isSnapshotApplicable(int p_from, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+    if (m_snapshot.isEmpty()) {
+        return false;
+    }
+
+    // Wait for the change of the whole document.
+    QTextDocument *doc = document();
+    if (p_from != 0
+        || p_charsAdded < doc->characterCount() - 1
+        || m_snapshot.size() != doc->blockCount()) {
+        return false;
+    }
+
+    if (m_snapshotParams != m_styleParams) {
+        m_snapshot.clear();
+        return false;
+    }
+
+    // The widget may not reach its final width yet. Keep the snapshot for the
+    // relayout of the next width.
+    if (m_snapshotWidth != doc->pageSize().width()) {
+        return false;
+    }
+
+    if (m_snapshotContentHash != contentHash(doc)) {
+        m_snapshot.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void VTextDocumentLayout::setFrameBudget(int p_ms)
+{
+    m_frameBudget = qMax(0, p_ms);
+}
+
+void VTextDocumentLayout::setBackgroundLayoutPaused(bool p_paused)
+{
+    m_backgroundLayoutPaused = p_paused;
+    if (m_backgroundLayoutPaused) {
+        m_layoutTimer.stop();
+    } else if (m_pendingFirst != -1) {
+        m_layoutTimer.start();
+    }
+}
+
+void VTextDocumentLayout::setCursorBlock(int p_blockNumber)
+{
+    m_cursorBlock = p_blockNumber;
+}
+
+void VTextDocumentLayout::estimateBlockMetrics(const QTextBlock &p_block)
+{
+    const qreal availableWidth = m_availableWidth;
+    qreal textWidth = (p_block.length() - 1) * m_estimatedCharWidth;
+    int lineCount = 1;
+    if (availableWidth > 0 && textWidth > availableWidth) {
+        lineCount = qCeil(textWidth / availableWidth);
+        textWidth = availableWidth;
+    }
+
+    qreal height = lineCount * m_estimatedLineHeight;
+    if (!p_block.next().isValid()) {
+        height += m_margin;
+    }
+
+    BlockMetrics metrics;
+    metrics.m_rect = QRectF(0, 0, textWidth + 2 * m_margin + m_cursorMargin, height);
+    metrics.m_lineCount = lineCount;
+    applyBlockMetrics(p_block, metrics);
+    m_blocks[p_block.blockNumber()].m_estimated = true;
+}
+
+void VTextDocumentLayout::addPendingBlocks(int p_first, int p_last)
+{
+    if (m_pendingFirst == -1) {
+        m_pendingFirst = p_first;
+        m_pendingLast = p_last;
+    } else {
+        m_pendingFirst = qMin(m_pendingFirst, p_first);
+        m_pendingLast = qMax(m_pendingLast, p_last);
+    }
+
+    if (!m_backgroundLayoutPaused) {
+        m_layoutTimer.start();
+    }
+}
+
+void VTextDocumentLayout::beginBatchLayout()
+{
+    Q_ASSERT(!m_batchLayout);
+    m_batchLayout = true;
+    m_batchFillFrom = -1;
+}
+
+bool VTextDocumentLayout::endBatchLayout()
+{
+    m_batchLayout = false;
+    if (m_batchFillFrom == -1) {
+        return false;
+    }
+
+    const int from = m_batchFillFrom;
+    m_batchFillFrom = -1;
+    fillOffsetFrom(from);
+    updateDocumentSize();
+    emit update(QRectF(0., m_blocks[from].m_offset, 1000000000., 1000000000.));
+    return true;
+}
+
+int VTextDocumentLayout::layoutBlocksInBatch(int p_first,
+                                             int p_last,
+                                             const QElapsedTimer &p_timer,
+                                             int p_budget,
+                                             bool p_reclaim)
+{
+    const int first = qMax(p_first, m_pendingFirst);
+    const int last = qMin(p_last, m_pendingLast);
+    if (first > last) {
+        return p_last + 1;
+    }
+
+    // Keep all the layouts unless reclaiming with a visible viewport, as
+    // reclaimLayouts() does.
+    int keepFirst = 0, keepLast = m_blocks.size() - 1;
+    if (p_reclaim && m_reclaimWindow >= 0) {
+        int first, last;
+        if (reclaimKeepRange(first, last)) {
+            keepFirst = first;
+            keepLast = last;
+        }
+    }
+
+    beginBatchLayout();
+
+    int i = first;
+    QTextBlock block = document()->findBlockByNumber(first);
+    for (; i <= last && block.isValid(); ++i, block = block.next()) {
+        if (!m_blocks[i].m_estimated || !m_blocks[i].hasOffset()) {
+            continue;
+        }
+
+        const int shapedFirst = m_shapedFirst;
+        const int shapedLast = m_shapedLast;
+        if (!measureAsciiBlock(block) && !measureLongLine(block)) {
+            layoutBlock(block);
+        }
+
+        if (m_batchFillFrom == -1) {
+            // Only the width may change.
+            updateDocumentSizeWithOneBlockChanged(i);
+        }
+
+        if (i < keepFirst || i > keepLast) {
+            block.clearLayout();
+
+            // It held no lines before.
+            m_shapedFirst = shapedFirst;
+            m_shapedLast = shapedLast;
+        }
+
+        if (p_budget >= 0 && p_timer.elapsed() >= p_budget) {
+            ++i;
+            break;
+        }
+    }
+
+    endBatchLayout();
+    return i;
+}
+
+void VTextDocumentLayout::layoutPendingBlocks()
+{
+    if (m_pendingFirst == -1 || m_backgroundLayoutPaused) {
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    const int budget = m_frameBudget > 0 ? m_frameBudget : -1;
+
+    int first, last;
+    if (viewportBlockRange(first, last)) {
+        layoutBlocksInBatch(first, last, timer, budget);
+    }
+
+    if (m_cursorBlock > -1 && (budget < 0 || timer.elapsed() < budget)) {
+        layoutBlocksInBatch(m_cursorBlock - c_cursorNeighborhood,
+                           m_cursorBlock + c_cursorNeighborhood,
+                           timer,
+                           budget);
+    }
+
+    // The rest in order, keeping only the metrics of those out of the window.
+    int next = m_pendingFirst;
+    if (budget < 0 || timer.elapsed() < budget) {
+        next = layoutBlocksInBatch(m_pendingFirst, m_pendingLast, timer, budget, true);
+    }
+
+    // Skip the blocks with exact metrics, including those measured via the
+    // ASCII fast path, which hold no lines.
+    const int pendingLast = qMin(m_pendingLast, m_blocks.size() - 1);
+    while (next <= pendingLast && (!m_blocks[next].m_estimated || !m_blocks[next].hasOffset())) {
+        ++next;
+    }
+
+    if (next <= pendingLast) {
+        m_pendingFirst = next;
+        m_layoutTimer.start();
+    } else {
+        m_pendingFirst = m_pendingLast = -1;
+    }
+}
+
+void VTextDocumentLayout::setReclaimWindow(int p_blocks)
+{
+    m_reclaimWindow = qMax(-1, p_blocks);
+    if (m_reclaimWindow >= 0) {
+        m_reclaimTimer.start();
+    } else {
+        m_reclaimTimer.stop();
+    }
+}
+
+bool VTextDocumentLayout::reclaimKeepRange(int &p_first, int &p_last) const
+{
+    if (!viewportBlockRange(p_first, p_last)) {
+        return false;
+    }
+
+    if (m_cursorBlock > -1) {
+        p_first = qMin(p_first, m_cursorBlock);
+        p_last = qMax(p_last, m_cursorBlock);
+    }
+
+    p_first -= m_reclaimWindow;
+    p_last += m_reclaimWindow;
+    return true;
+}
+
+void VTextDocumentLayout::reclaimLayouts()
+{
+    int keepFirst, keepLast;
+    if (m_reclaimWindow < 0 || m_shapedFirst == -1 || !reclaimKeepRange(keepFirst, keepLast)) {
+        return;
+    }
+
+    // The range of the blocks still holding lines.
+    int first = -1, last = -1;
+    const int shapedLast = qMin(m_shapedLast, m_blocks.size() - 1);
+    QTextBlock block = document()->findBlockByNumber(m_shapedFirst);
+    for (int i = m_shapedFirst; i <= shapedLast && block.isValid(); ++i, block = block.next()) {
+        if (i >= keepFirst && i <= keepLast) {
+            // Skip the kept blocks.
+            if (first == -1) {
+                first = i;
+            }
+
+            i = last = qMin(keepLast, shapedLast);
+            block = document()->findBlockByNumber(i);
+            continue;
+        }
+
+        if (block.layout()->lineCount() == 0) {
+            continue;
+        }
+
+        // Blocks with estimated metrics are left to the scheduler.
+        if (i >= m_pendingFirst && i <= m_pendingLast) {
+            if (first == -1) {
+                first = i;
+            }
+
+            last = i;
+            continue;
+        }
+
+        block.clearLayout();
+    }
+
+    m_shapedFirst = first;
+    m_shapedLast = last;
+}
+
+void VTextDocumentLayout::setPrefetchBudget(int p_ms)
+{
+    m_prefetchBudget = qMax(0, p_ms);
+    if (m_prefetchBudget == 0) {
+        m_viewScrolls.clear();
+        m_prefetchRect = QRectF();
+        m_prefetchTimer.stop();
+    }
+}
+
+void VTextDocumentLayout::updatePrefetch(const QObject *p_view, const QRectF &p_rect)
+{
+    if (p_rect.isNull()) {
+        m_viewScrolls.remove(p_view);
+        if (m_viewScrolls.isEmpty()) {
+            m_prefetchRect = QRectF();
+            m_prefetchTimer.stop();
+        }
+
+        return;
+    }
+
+    if (m_prefetchBudget == 0) {
+        return;
+    }
+
+    const qint64 now = m_clock.elapsed();
+    auto it = m_viewScrolls.find(p_view);
+    if (it == m_viewScrolls.end()) {
+        ViewScroll scroll;
+        scroll.m_top = p_rect.top();
+        scroll.m_time = now;
+        scroll.m_velocity = 0;
+        m_viewScrolls.insert(p_view, scroll);
+        return;
+    }
+
+    ViewScroll &scroll = it.value();
+    const qreal delta = p_rect.top() - scroll.m_top;
+    if (delta == 0) {
+        return;
+    }
+
+    const qint64 elapsed = qMax<qint64>(1, now - scroll.m_time);
+    const qreal velocity = delta / elapsed;
+    if (elapsed > c_scrollPause || velocity * scroll.m_velocity <= 0) {
+        scroll.m_velocity = velocity;
+    } else {
+        scroll.m_velocity = (scroll.m_velocity + velocity) / 2;
+    }
+
+    scroll.m_top = p_rect.top();
+    scroll.m_time = now;
+
+    // The work left for the previous region falls behind and is dropped.
+    const qreal height = p_rect.height();
+    const qreal distance = qBound(height,
+                                  qAbs(scroll.m_velocity) * c_prefetchLookahead,
+                                  c_prefetchPages * height);
+    m_prefetchUpward = scroll.m_velocity < 0;
+    if (m_prefetchUpward) {
+        m_prefetchRect = QRectF(p_rect.left(), qMax(0.0, p_rect.top() - distance), p_rect.width(), 0);
+        m_prefetchRect.setBottom(p_rect.top());
+    } else {
+        m_prefetchRect = QRectF(p_rect.left(), p_rect.bottom(), p_rect.width(), distance);
+    }
+
+    m_prefetchBlock = -1;
+    if (m_prefetchRect.height() > 0) {
+        m_prefetchTimer.start();
+    } else {
+        m_prefetchRect = QRectF();
+    }
+}
+
+void VTextDocumentLayout::prefetchBlocks()
+{
+    if (m_prefetchRect.isNull() || m_prefetchBudget == 0) {
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    int first, last;
+    blockRangeFromRectBS(m_prefetchRect, first, last);
+    if (first == -1) {
+        m_prefetchRect = QRectF();
+        return;
+    }
+
+    // Blocks with estimated metrics first, since laying them out may move
+    // the following blocks.
+    if (m_pendingFirst != -1 && first <= m_pendingLast && last >= m_pendingFirst) {
+        layoutBlocksInBatch(first, last, timer, m_prefetchBudget);
+        if (timer.elapsed() >= m_prefetchBudget) {
+            m_prefetchTimer.start();
+            return;
+        }
+
+        blockRangeFromRectBS(m_prefetchRect, first, last);
+        if (first == -1) {
+            m_prefetchRect = QRectF();
+            return;
+        }
+    }
+
+    // Prefetch in the scroll direction.
+    int num = m_prefetchUpward ? last : first;
+    if (m_prefetchBlock >= first && m_prefetchBlock <= last) {
+        num = m_prefetchBlock;
+    }
+
+    QTextDocument *doc = document();
+    while (num >= first && num <= last) {
+        prefetchBlock(doc->findBlockByNumber(num));
+        num += m_prefetchUpward ? -1 : 1;
+
+        if (timer.elapsed() >= m_prefetchBudget) {
+            break;
+        }
+    }
+
+    if (num >= first && num <= last) {
+        m_prefetchBlock = num;
+        m_prefetchTimer.start();
+    } else {
+        m_prefetchRect = QRectF();
+        m_prefetchBlock = -1;
+    }
+}
+
+void VTextDocumentLayout::prefetchBlock(const QTextBlock &p_block)
+{
+    if (!p_block.isValid()
+        || !p_block.isVisible()
+        || !m_blocks[p_block.blockNumber()].hasOffset()) {
+        return;
+    }
+
+    // Blocks of the ASCII fast path and long lines measured by chunks are drawn
+    // without layout and have no images.
+    if (p_block.layout()->lineCount() == 0
+        && (asciiBlockFont(p_block) || lineChunks(p_block))) {
+        return;
+    }
+
+    ensureBlockLayout(p_block);
+
+    if (!m_blockImageEnabled) {
+        return;
+    }
+
+    // The same target rects as drawInlineImages() and drawBlockImage().
+    const QPointF offset(m_margin, m_blocks[p_block.blockNumber()].top());
+    QVector<InlineImage> images;
+    inlineImagesFromTextLayout(p_block, images);
+    for (auto const & img : images) {
+        m_imageMgr->prepareImage(img.m_info->m_imageName,
+                                 img.m_rect.translated(offset).toRect(),
+                                 m_prefetchRect,
+                                 m_devicePixelRatio);
+    }
+
+    const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(p_block.blockNumber());
+    if (info && !info->m_imageSize.isNull()) {
+        m_imageMgr->prepareImage(info->m_imageName,
+                                 blockImageRect(p_block, info, offset),
+                                 m_prefetchRect,
+                                 m_devicePixelRatio);
+    }
+}
+
+void VTextDocumentLayout::releaseLayouts()
+{
+    if (m_shapedFirst != -1) {
+        QTextBlock block = document()->findBlockByNumber(m_shapedFirst);
+        for (int i = m_shapedFirst; i <= m_shapedLast && block.isValid(); ++i, block = block.next()) {
+            block.clearLayout();
+        }
+
+        m_shapedFirst = m_shapedLast = -1;
+    }
+
+    m_cursorLineCache = CursorLineCache();
+    m_metricsCache.clear();
+    for (auto &info : m_blocks) {
+        info.m_metricsCached = false;
+    }
+}
+
+VTextDocumentLayout::MemoryUsage VTextDocumentLayout::memoryUsage() const
+{
+    MemoryUsage usage;
+    if (m_shapedFirst != -1) {
+        QTextBlock block = document()->findBlockByNumber(m_shapedFirst);
+        for (int i = m_shapedFirst; i <= m_shapedLast && block.isValid(); ++i, block = block.next()) {
+            int lineCount = block.layout()->lineCount();
+            if (lineCount > 0) {
+                usage.m_layoutBytes += c_layoutBytes + lineCount * c_lineBytes;
+            }
+        }
+    }
 
-    p_painter->drawPixmap(targetRect, *image);
+    usage.m_blockInfoBytes = m_blocks.capacity() * sizeof(BlockInfo)
+                             + m_lineCountIndex.capacity() * sizeof(int);
+    usage.m_metricsCacheBytes = m_metricsCache.totalCost() * (qint64)(sizeof(MetricsKey) + sizeof(BlockMetrics));
+    usage.m_imageBytes = m_imageMgr->memoryUsage();
+    return usage;
 }
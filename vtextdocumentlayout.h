@@ -4,8 +4,20 @@
 #include <QAbstractTextDocumentLayout>
 #include <QVector>
 #include <QSize>
+#include <QRectF>
+#include <QTextCharFormat>
+#include <QTextOption>
+#include <QCache>
+#include <QHash>
+#include <QTimer>
+#include <QTextBlock>
+#include <QRawFont>
+#include <QPixmap>
+#include <QElapsedTimer>
 
 class VImageResourceManager2;
+class VSearchEngine;
+class QDataStream;
 struct VBlockImageInfo2;
 
 
@@ -28,6 +40,10 @@ public:
 
     QRectF blockBoundingRect(const QTextBlock &p_block) const Q_DECL_OVERRIDE;
 
+    // Return the bounding rect of @p_block from its metrics without laying it
+    // out, for painting beside the text. Null if it has no metrics yet.
+    QRectF blockRect(const QTextBlock &p_block) const;
+
     void setCursorWidth(int p_width);
 
     int cursorWidth() const;
@@ -44,9 +60,163 @@ public:
 
     void setBlockImageEnabled(bool p_enabled);
 
+    // Set the rect of the viewport of view @p_view in document coordinates.
+    // Null if the viewport is not visible. Views sharing the layout each have
+    // their own viewport.
+    void setViewportRect(const QObject *p_view, const QRectF &p_rect);
+
+    // Get the block range [first, last] covering the viewports of all the views.
+    // Return false if no viewport is visible.
+    bool viewportBlockRange(int &p_first, int &p_last) const;
+
+    // Play the animated images within the viewports and pause the others.
+    // Should be called after the images info is updated.
+    void updateVisibleAnimations();
+
+    // Split the document into pages of height @p_pageHeight, in document
+    // coordinates. Pages break between blocks, or between the lines of blocks
+    // taller than a page.
+    QVector<QRectF> paginate(qreal p_pageHeight) const;
+
+    // Draw page @p_pageRect from paginate() at the origin of @p_painter, without
+    // the cursor and the search matches.
+    void drawPage(QPainter *p_painter, const QRectF &p_pageRect);
+
+    // Write the metrics of all the blocks with the layout parameters and the
+    // content hash to @p_out.
+    void saveSnapshot(QDataStream &p_out) const;
+
+    // Read a snapshot written by saveSnapshot(). It is used for the next layout
+    // of the whole document if the contents and parameters match, so blocks get
+    // their metrics without layout and are laid out on use.
+    // A snapshot of another page width is kept for the relayout of the next
+    // width, such as the first resize of the widget.
+    bool loadSnapshot(QDataStream &p_in);
+
+    // Drop the snapshot if not used yet.
+    void clearSnapshot();
+
+    // Whether a loaded snapshot is still pending to be used.
+    bool hasSnapshot() const;
+
+    // Whether the last loaded snapshot has been used.
+    bool isSnapshotApplied() const;
+
+    // Paint the matches of @p_engine with @p_format. NULL to disable.
+    void setSearchEngine(const VSearchEngine *p_engine, const QTextCharFormat &p_format);
+
+    // Total count of the visual lines of all the blocks.
+    // A wrapped block occupies multiple visual lines and an invisible block none.
+    int visualLineCount() const;
+
+    // Return the visual line number (0-based) of the first line of block @p_blockNumber.
+    int visualLineOfBlock(int p_blockNumber) const;
+
+    // Return the number of the block containing visual line @p_line (0-based).
+    // @p_lineInBlock: if not NULL, set to the index of the line within the block.
+    // Return -1 if @p_line is out of range.
+    int findBlockByVisualLine(int p_line, int *p_lineInBlock = NULL) const;
+
+    // Return the visual line number (0-based) of document position @p_position.
+    // Return -1 if @p_position is not in a laid out block.
+    int visualLineOfPosition(int p_position) const;
+
+    // Return the document position of the start of visual line @p_line (0-based).
+    // Return -1 if @p_line is out of range.
+    int positionOfVisualLine(int p_line) const;
+
+    // Time budget in ms of one slice of layout work. Blocks exceeding the budget
+    // in one change get estimated metrics and are laid out in later slices,
+    // visible blocks first, then those around the cursor, then the rest.
+    // 0 to lay out all the blocks at once.
+    void setFrameBudget(int p_ms);
+
+    // Pause or resume the layout of the pending blocks in the background.
+    // Blocks are still laid out when painted or hit.
+    void setBackgroundLayoutPaused(bool p_paused);
+
+    bool isBackgroundLayoutPaused() const;
+
+    // Set the block of the cursor, around which pending blocks are laid out first.
+    void setCursorBlock(int p_blockNumber);
+
+    // Whether some blocks still have estimated metrics.
+    bool hasPendingLayout() const;
+
+    // Keep the layouts of the blocks within @p_blocks blocks around the viewports
+    // and the cursor, and release the lines of the other blocks once scrolling
+    // stops. Their metrics are kept and they are laid out again when used.
+    // -1 to keep all the layouts.
+    void setReclaimWindow(int p_blocks);
+
+    // Time budget in ms of one slice of prefetching. As a view scrolls, blocks
+    // ahead of it are laid out and their images decoded and scaled in slices,
+    // further ahead the faster it scrolls. 0 to disable prefetching.
+    void setPrefetchBudget(int p_ms);
+
+    // Release the layouts of all the blocks and the metrics cache, keeping the
+    // metrics of the blocks. Blocks are laid out again when used.
+    void releaseLayouts();
+
+    struct MemoryUsage
+    {
+        MemoryUsage()
+            : m_layoutBytes(0),
+              m_blockInfoBytes(0),
+              m_metricsCacheBytes(0),
+              m_imageBytes(0)
+        {
+        }
+
+        // Approximate bytes of the lines of the laid out blocks.
+        qint64 m_layoutBytes;
+
+        // Bytes of the infos and line counts of all the blocks.
+        qint64 m_blockInfoBytes;
+
+        qint64 m_metricsCacheBytes;
+
+        // Bytes of the decoded images.
+        qint64 m_imageBytes;
+    };
+
+    MemoryUsage memoryUsage() const;
+
+public slots:
+    // Repaint the laid out blocks [@p_firstBlock, @p_lastBlock], such as after
+    // their highlights changed.
+    void updateBlocks(int p_firstBlock, int p_lastBlock);
+
+    // Release the lines of all the blocks out of the reclaim window.
+    void reclaimLayouts();
+
+signals:
+    // Emitted on each change of the document, including changes marked via
+    // QTextDocument::markContentsDirty() which do not emit contentsChange().
+    void documentContentsChanged(int p_from, int p_charsRemoved, int p_charsAdded);
+
 protected:
     void documentChanged(int p_from, int p_charsRemoved, int p_charsAdded) Q_DECL_OVERRIDE;
 
+private slots:
+    // Update the rects of animated image @p_name within the viewport.
+    void updateAnimatedImage(const QString &p_name);
+
+    // Lay out the pending blocks within one slice of the frame budget.
+    void layoutPendingBlocks();
+
+    // Prefetch the blocks of m_prefetchRect within one slice of the prefetch budget.
+    void prefetchBlocks();
+
+    // Put the metrics of the laid out blocks within the viewports into the
+    // metrics cache.
+    void cacheVisibleBlockMetrics();
+
+    // Update the document size and the view after blocks laid out on use
+    // changed their heights.
+    void updateDeferredBlocks();
+
+
 private:
     struct BlockInfo
     {
@@ -59,6 +229,8 @@ private:
         {
             m_offset = -1;
             m_rect = QRectF();
+            m_metricsCached = false;
+            m_estimated = false;
         }
 
         bool hasOffset() const
@@ -85,10 +257,179 @@ private:
         // The bounding rect of this block, including the margins.
         // Null for invalid.
         QRectF m_rect;
+
+        // Whether the metrics of its layout are in the metrics cache.
+        bool m_metricsCached;
+
+        // Whether its metrics are estimated and it is left to the scheduler.
+        bool m_estimated;
+    };
+
+    // Metrics of a laid out block to restore it without layout.
+    struct BlockMetrics
+    {
+        // The bounding rect of the block, including the margins.
+        QRectF m_rect;
+
+        int m_lineCount;
+    };
+
+    // Identify the contents and the layout parameters of a block.
+    struct MetricsKey
+    {
+        bool operator==(const MetricsKey &p_other) const
+        {
+            return m_textHash == p_other.m_textHash
+                   && m_textHash2 == p_other.m_textHash2
+                   && m_formatHash == p_other.m_formatHash
+                   && m_length == p_other.m_length
+                   && m_params == p_other.m_params
+                   && m_last == p_other.m_last;
+        }
+
+        friend uint qHash(const MetricsKey &p_key, uint p_seed = 0)
+        {
+            return p_key.m_textHash ^ p_key.m_formatHash ^ p_seed;
+        }
+
+        // Hashes of the text with two seeds.
+        uint m_textHash;
+
+        uint m_textHash2;
+
+        // Hash of the formats of the block and its fragments.
+        uint m_formatHash;
+
+        int m_length;
+
+        // m_metricsParams when laid out.
+        uint m_params;
+
+        // Whether it is the last block, which has the bottom margin.
+        bool m_last;
+    };
+
+    // Inline image laid out below the line containing its link.
+    struct InlineImage
+    {
+        const VBlockImageInfo2 *m_info;
+
+        // Rect in the coordinates of the block's text layout.
+        QRectF m_rect;
+    };
+
+    // A monospace font whose printable ASCII characters are shaped one glyph
+    // each with the same advance, calibrated against QTextLayout.
+    struct AsciiFont
+    {
+        AsciiFont()
+            : m_valid(false),
+              m_advance(0),
+              m_lineHeight(0),
+              m_baseline(0),
+              m_trailingSpaces(false)
+        {
+        }
+
+        // Whether blocks in this format could take the ASCII fast path.
+        bool m_valid;
+
+        qreal m_advance;
+
+        // Height of a line, with the leading of the font.
+        qreal m_lineHeight;
+
+        // Y of the baseline within a line.
+        qreal m_baseline;
+
+        // Whether the natural width of a line includes its trailing spaces.
+        bool m_trailingSpaces;
+
+        QRawFont m_rawFont;
+
+        // Glyph index of each printable ASCII character from 0x20.
+        QVector<quint32> m_glyphs;
+
+        // Color of the text. Invalid to use the pen of the painter.
+        QColor m_color;
+    };
+
+    // Chunks of a long single-line block measured without layout, so only the
+    // chunks within the clip are shaped to be drawn or hit.
+    struct LineChunks
+    {
+        // Start of each chunk in the block, followed by the length of the text.
+        // Empty if the block is not split.
+        QVector<int> m_starts;
+
+        // X of the start of each chunk in the layout of the block, followed by
+        // the end of the last one.
+        QVector<qreal> m_xs;
+
+        // Y of the baseline of the line within the block.
+        qreal m_baseline;
+    };
+
+    // Rendering of the line of the cursor without the cursor, so the cursor
+    // blinking or moving within the line does not draw the text again.
+    struct CursorLineCache
+    {
+        CursorLineCache()
+            : m_blockNumber(-1),
+              m_generation(0),
+              m_cursorPosition(-1)
+        {
+        }
+
+        int m_blockNumber;
+
+        // m_generation of the layout when rendered.
+        uint m_generation;
+
+        // The part of the line within the viewports in document coordinates.
+        QRectF m_rect;
+
+        // Formats drawn on the block.
+        QVector<QTextLayout::FormatRange> m_selections;
+
+        QColor m_textColor;
+
+        QPixmap m_pixmap;
+
+        // Position of the cursor within the block and its rect in document
+        // coordinates. -1 if not computed.
+        int m_cursorPosition;
+
+        QRectF m_cursorRect;
+    };
+
+    // Scrolling of a view.
+    struct ViewScroll
+    {
+        // Top of the viewport.
+        qreal m_top;
+
+        // m_clock when the viewport moved.
+        qint64 m_time;
+
+        // Smoothed velocity in pixels per ms. Negative when scrolling up.
+        qreal m_velocity;
     };
 
     void layoutBlock(const QTextBlock &p_block);
 
+    // Lay out inline images whose link starts in line @p_line.
+    // Images are placed below the line from left to right.
+    // @p_images: if not NULL, append the laid out images to it.
+    // Return the height of the space needed below the line.
+    qreal layoutInlineImages(const QVector<VBlockImageInfo2> &p_infos,
+                             const QTextLine &p_line,
+                             QVector<InlineImage> *p_images) const;
+
+    // Get the inline images of the laid out block @p_block.
+    void inlineImagesFromTextLayout(const QTextBlock &p_block,
+                                    QVector<InlineImage> &p_images) const;
+
     // Clear the layout of @p_block.
     // Also clear all the offset behind this block.
     void clearBlockLayout(QTextBlock &p_block);
@@ -108,6 +449,143 @@ private:
 
     void finishBlockLayout(const QTextBlock &p_block);
 
+    // Set the rect of block @p_blockNumber and update the offsets.
+    void updateBlockRect(int p_blockNumber, const QRectF &p_rect);
+
+    // Get the key of @p_block in the metrics cache.
+    // Return false if its metrics should not be cached.
+    bool metricsKey(const QTextBlock &p_block, MetricsKey &p_key) const;
+
+    // Restore the metrics of @p_block from the cache and defer its layout until
+    // it is used. Return false if not cached.
+    bool restoreBlockMetrics(const QTextBlock &p_block);
+
+    // Get the block range [first, last] within viewport @p_rect.
+    bool blockRangeOfViewport(const QRectF &p_rect, int &p_first, int &p_last) const;
+
+    // Set the metrics of @p_block and defer its layout until it is used.
+    void applyBlockMetrics(const QTextBlock &p_block, const BlockMetrics &p_metrics);
+
+    // Whether the pending snapshot matches the document after a change of
+    // the whole document. The snapshot is dropped if not, unless only the page
+    // width differs.
+    bool isSnapshotApplicable(int p_from, int p_charsRemoved, int p_charsAdded);
+
+    // Return the font of @p_block if it takes the ASCII fast path: a single
+    // line of printable ASCII in a single monospace format, without images.
+    // Return NULL otherwise.
+    const AsciiFont *asciiBlockFont(const QTextBlock &p_block);
+
+    // Shape a sample in @p_format to check whether it fits the ASCII fast path
+    // and get its metrics and glyphs.
+    static AsciiFont calibrateAsciiFont(const QTextCharFormat &p_format);
+
+    // Set the exact metrics of @p_block without layout if it takes the ASCII
+    // fast path, deferring its layout until it is used.
+    // Return false if it does not.
+    bool measureAsciiBlock(const QTextBlock &p_block);
+
+    // Draw @p_block of the ASCII fast path from the cached glyphs of @p_font,
+    // without its layout.
+    // @p_offset: the offset for the drawing of the block.
+    // @p_clip: the region to draw. Null for all.
+    void drawAsciiBlock(QPainter *p_painter,
+                        const QTextBlock &p_block,
+                        const AsciiFont &p_font,
+                        const QPointF &p_offset,
+                        const QRectF &p_clip);
+
+    // Return the chunks of @p_block if it is measured by measureLongLine().
+    // Return NULL otherwise.
+    const LineChunks *lineChunks(const QTextBlock &p_block) const;
+
+    // Set the metrics of @p_block without layout if it is a long single line
+    // without tabs or right-to-left text, by shaping its chunks one by one.
+    // The line is not shaped as a whole until it is used, such as by the cursor.
+    // Return false if it is not.
+    bool measureLongLine(const QTextBlock &p_block);
+
+    // Lay out chunk @p_index of @p_block in @p_layout as a single line at the X
+    // of the chunk, with its baseline at @p_baseline.
+    void layoutLineChunk(const QTextBlock &p_block,
+                         const QString &p_text,
+                         const LineChunks &p_chunks,
+                         int p_index,
+                         qreal p_baseline,
+                         QTextLayout &p_layout) const;
+
+    // Return the index of the chunk containing @p_x in the layout of the block.
+    int lineChunkAt(const LineChunks &p_chunks, qreal p_x) const;
+
+    // Draw the chunks of @p_block within @p_clip with @p_selections.
+    void drawLineChunks(QPainter *p_painter,
+                        const QTextBlock &p_block,
+                        const LineChunks &p_chunks,
+                        const QPointF &p_offset,
+                        const QVector<QTextLayout::FormatRange> &p_selections,
+                        const QRectF &p_clip);
+
+    // Give @p_block metrics estimated from the default font, to be laid out later.
+    void estimateBlockMetrics(const QTextBlock &p_block);
+
+    // Add blocks [@p_first, @p_last] to the pending blocks and schedule the layout.
+    void addPendingBlocks(int p_first, int p_last);
+
+    // Within a batch, offsets of the following blocks are filled once at its end
+    // instead of after each block whose height changes.
+    void beginBatchLayout();
+
+    // Return true if the offsets of some blocks changed.
+    bool endBatchLayout();
+
+    // Lay out the blocks not laid out in [@p_first, @p_last] in a batch.
+    // Stop once @p_timer exceeds @p_budget if it is not negative.
+    // @p_reclaim: release the lines of the blocks out of the reclaim window once
+    // they are measured.
+    // Return the number of the block next to the last one processed.
+    int layoutBlocksInBatch(int p_first,
+                            int p_last,
+                            const QElapsedTimer &p_timer,
+                            int p_budget,
+                            bool p_reclaim = false);
+
+    // Track the velocity of view @p_view whose viewport moves to @p_rect and
+    // schedule the prefetching of the region ahead of it.
+    void updatePrefetch(const QObject *p_view, const QRectF &p_rect);
+
+    // Lay out @p_block if it is not drawn via the ASCII fast path, and decode
+    // and scale its images within m_prefetchRect.
+    void prefetchBlock(const QTextBlock &p_block);
+
+    // Get the range of blocks whose layouts are kept.
+    // Return false if no viewport is visible.
+    bool reclaimKeepRange(int &p_first, int &p_last) const;
+
+    // Lay out @p_block if its layout has been deferred.
+    // It may be called within a paint or a hit test, so the changes of the
+    // document size and the view are notified later.
+    void ensureBlockLayout(const QTextBlock &p_block) const;
+
+    // Return the width of the paragraph separator in the font of @p_block.
+    qreal separatorWidth(const QTextBlock &p_block);
+
+    // Update m_metricsParams from the document.
+    void updateMetricsParams();
+
+    // Update the line count of block @p_blockNumber in the line count index.
+    void updateLineCount(int p_blockNumber, int p_count);
+
+    // Insert @p_delta blocks without lines at block @p_pos into the line count
+    // index, or remove -@p_delta blocks from it if negative. Only the nodes
+    // after @p_pos are rebuilt, from the line counts in the index itself.
+    void shiftLineCountIndex(int p_pos, int p_delta);
+
+    // Rebuild the line count index from the document if it is out of date.
+    void ensureLineCountIndex() const;
+
+    // Sum of the line counts of the first @p_count blocks.
+    int lineCountPrefixSum(int p_count) const;
+
     int previousValidBlockNumber(int p_number) const;
 
     int nextValidBlockNumber(int p_number) const;
@@ -118,6 +596,20 @@ private:
     QVector<QTextLayout::FormatRange> formatRangeFromSelection(const QTextBlock &p_block,
                                                                const QVector<Selection> &p_selections) const;
 
+    // Get the highlights, search matches and selections to draw on @p_block,
+    // in the order to draw.
+    QVector<QTextLayout::FormatRange> blockSelections(const QTextBlock &p_block,
+                                                      const QVector<Selection> &p_selections) const;
+
+    // Draw @p_context.clip from the cache of the line of the cursor and the
+    // cursor on top if the clip is within that line.
+    // Return false if not drawn.
+    bool drawCursorLine(QPainter *p_painter, const PaintContext &p_context);
+
+    // Append the format ranges of the search matches in @p_block to @p_ranges.
+    void formatRangeFromSearchMatches(const QTextBlock &p_block,
+                                      QVector<QTextLayout::FormatRange> &p_ranges) const;
+
     // Get the block range [first, last] by rect @p_rect.
     // @p_rect: a clip region in document coordinates. If null, returns all the blocks.
     // Return [-1, -1] if no valid block range found.
@@ -139,11 +631,27 @@ private:
                                    int &p_padding,
                                    QSize &p_size) const;
 
+    // Draw inline images of block @p_block.
+    // @p_offset: the offset for the drawing of the block.
+    // @p_clip: the region to draw. Null for all.
+    void drawInlineImages(QPainter *p_painter,
+                          const QTextBlock &p_block,
+                          const QPointF &p_offset,
+                          const QRectF &p_clip);
+
+    // Return the rect of the block image of @p_block.
+    // @p_offset: the offset for the drawing of the block.
+    QRect blockImageRect(const QTextBlock &p_block,
+                         const VBlockImageInfo2 *p_info,
+                         const QPointF &p_offset) const;
+
     // Draw images of block @p_block.
     // @p_offset: the offset for the drawing of the block.
+    // @p_clip: the region to draw. Null for all.
     void drawBlockImage(QPainter *p_painter,
                         const QTextBlock &p_block,
-                        const QPointF &p_offset);
+                        const QPointF &p_offset,
+                        const QRectF &p_clip);
 
     // Document margin on left/right/bottom.
     qreal m_margin;
@@ -177,6 +685,131 @@ private:
 
     // Whether constraint the width of image to the width of the page.
     bool m_imageWidthConstrainted;
+
+    // Rect of the viewport of each visible view in document coordinates.
+    QHash<const QObject *, QRectF> m_viewportRects;
+
+    const VSearchEngine *m_searchEngine;
+
+    // Metrics of laid out blocks by their contents, so blocks restored by undo
+    // and redo get their heights back without layout.
+    // Only blocks shown in the viewports, which are those to be edited, are
+    // put in once the viewports settle, so layout does not hash the text.
+    QCache<MetricsKey, BlockMetrics> m_metricsCache;
+
+    QTimer m_metricsTimer;
+
+    // The first block laid out on use whose height changed. -1 for none.
+    int m_deferredUpdateBlock;
+
+    QTimer m_deferredUpdateTimer;
+
+    // Hash of the document-wide layout parameters.
+    uint m_metricsParams;
+
+    // Hash of the layout parameters other than the page width.
+    uint m_styleParams;
+
+    // Layout context cached from the document by updateMetricsParams(), so
+    // laying out a block does no font resolution or option copy.
+    QTextOption m_textOption;
+
+    // Width for the lines without the margins.
+    qreal m_availableWidth;
+
+    // Width of the paragraph separator by char format index of the blocks.
+    // Used if the separators are shown.
+    QHash<int, qreal> m_separatorWidths;
+
+    // Fonts of the ASCII fast path by char format index.
+    QHash<int, AsciiFont> m_asciiFonts;
+
+    // Chunks of the long lines by the fragment index of their blocks.
+    QHash<int, LineChunks> m_lineChunks;
+
+    // Increased on each change of the document.
+    uint m_generation;
+
+    CursorLineCache m_cursorLineCache;
+
+    // Whether rendering the line of the cursor to its cache.
+    bool m_drawingCursorLine;
+
+    QHash<const QObject *, ViewScroll> m_viewScrolls;
+
+    QElapsedTimer m_clock;
+
+    int m_prefetchBudget;
+
+    // Region ahead of the scrolling view to prefetch. Null for none.
+    QRectF m_prefetchRect;
+
+    // The next block to prefetch in the scroll direction. -1 to start over.
+    int m_prefetchBlock;
+
+    // Whether prefetch m_prefetchRect from the bottom.
+    bool m_prefetchUpward;
+
+    QTimer m_prefetchTimer;
+
+    // Device pixel ratio of the last paint device, to scale the images.
+    qreal m_devicePixelRatio;
+
+    // Metrics of all the blocks from a snapshot pending to be used.
+    QVector<BlockMetrics> m_snapshot;
+
+    // Content hash, layout parameters and page width of m_snapshot.
+    QByteArray m_snapshotContentHash;
+
+    uint m_snapshotParams;
+
+    qreal m_snapshotWidth;
+
+    bool m_snapshotApplied;
+
+    // Line height and character width to estimate metrics of blocks.
+    qreal m_estimatedLineHeight;
+
+    qreal m_estimatedCharWidth;
+
+    int m_frameBudget;
+
+    bool m_backgroundLayoutPaused;
+
+    int m_cursorBlock;
+
+    // Blocks [m_pendingFirst, m_pendingLast] may have estimated metrics. -1 for none.
+    int m_pendingFirst;
+
+    int m_pendingLast;
+
+    QTimer m_layoutTimer;
+
+    bool m_batchLayout;
+
+    // The first block whose following offsets need to be filled in a batch. -1 for none.
+    int m_batchFillFrom;
+
+    // Blocks [m_shapedFirst, m_shapedLast] may hold lines. -1 for none.
+    // A range instead of a set so laying out a block does not allocate.
+    int m_shapedFirst;
+
+    int m_shapedLast;
+
+    // Blocks to keep around the viewports. -1 to keep all.
+    int m_reclaimWindow;
+
+    QTimer m_reclaimTimer;
+
+    QTextCharFormat m_searchMatchFormat;
+
+    // Fenwick tree (1-based) over the line counts of the blocks, so the visual line
+    // of a block and the block of a visual line are both found in O(log n).
+    mutable QVector<int> m_lineCountIndex;
+
+    // Whether m_lineCountIndex needs to be rebuilt from the document, such as
+    // before the first use.
+    mutable bool m_lineCountIndexDirty;
 };
 
 inline qreal VTextDocumentLayout::getLineLeading() const
@@ -184,4 +817,29 @@ inline qreal VTextDocumentLayout::getLineLeading() const
     return m_lineLeading;
 }
 
+inline void VTextDocumentLayout::clearSnapshot()
+{
+    m_snapshot.clear();
+}
+
+inline bool VTextDocumentLayout::hasSnapshot() const
+{
+    return !m_snapshot.isEmpty();
+}
+
+inline bool VTextDocumentLayout::isSnapshotApplied() const
+{
+    return m_snapshotApplied;
+}
+
+inline bool VTextDocumentLayout::isBackgroundLayoutPaused() const
+{
+    return m_backgroundLayoutPaused;
+}
+
+inline bool VTextDocumentLayout::hasPendingLayout() const
+{
+    return m_pendingFirst != -1;
+}
+
 #endif // VTEXTDOCUMENTLAYOUT_H
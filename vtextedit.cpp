@@ -4,68 +4,198 @@
 #include <QScrollBar>
 #include <QPainter>
 #include <QResizeEvent>
+#include <QShowEvent>
+#include <QHideEvent>
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
 
 #include "vtextdocumentlayout.h"
 #include "vimageresourcemanager2.h"
+#include "vcodeblockindex.h"
+#include "vminimap.h"
+#include "vpiecetable.h"
+#include "vhighlighter.h"
 
 
-enum class BlockState
-{
-    Normal = 0,
-    CodeBlockStart,
-    CodeBlock,
-    CodeBlockEnd,
-    Comment
-};
-
+// Lines of a large file loaded into the document at a time.
+static const int c_largeFileWindowLines = 20000;
 
 VTextEdit::VTextEdit(QWidget *p_parent)
     : QTextEdit(p_parent),
-      m_imageMgr(nullptr)
+      m_imageMgr(nullptr),
+      m_source(NULL)
 {
     init();
 }
 
 VTextEdit::VTextEdit(const QString &p_text, QWidget *p_parent)
     : QTextEdit(p_text, p_parent),
-      m_imageMgr(nullptr)
+      m_imageMgr(nullptr),
+      m_source(NULL)
+{
+    init();
+}
+
+VTextEdit::VTextEdit(VTextEdit *p_source, QWidget *p_parent)
+    : QTextEdit(p_parent),
+      m_imageMgr(nullptr),
+      m_source(p_source)
 {
     init();
 }
 
 VTextEdit::~VTextEdit()
 {
-    if (m_imageMgr) {
+    if (m_source) {
+        getLayout()->setViewportRect(this, QRectF());
+        m_source->m_sharedViews.removeAll(this);
+        m_source->updateSharedWrapWidth();
+    } else {
+        // Shared views are owned by their parents. Detach them from the
+        // document, layout and images of this view, which go away with it.
+        QVector<VTextEdit *> views = m_sharedViews;
+        m_sharedViews.clear();
+        m_sharedWrap = false;
+        for (auto view : views) {
+            view->detachFromSource();
+        }
+
         delete m_imageMgr;
     }
+
+    delete m_pieceTable;
 }
 
 void VTextEdit::init()
 {
     m_lineNumberType = LineNumberType::None;
 
+    m_lastCursorBlockNumber = -1;
+
+    m_lastScrollValue = 0;
+
+    m_lineNumberDirtyBlock = -1;
+
+    m_miniMap = NULL;
+
+    m_pieceTable = NULL;
+
+    m_highlighter = NULL;
+
+    m_windowFirstLine = 0;
+
+    m_windowLineCount = 0;
+
+    m_loadingWindow = false;
+
+    m_hibernated = false;
+
+    m_layoutPausedByHibernation = false;
+
+    m_snapshotScrollValue = -1;
+
     m_blockImageEnabled = false;
 
-    m_imageMgr = new VImageResourceManager2();
+    m_sharedWrap = false;
 
-    QTextDocument *doc = document();
-    VTextDocumentLayout *docLayout = new VTextDocumentLayout(doc, m_imageMgr);
-    docLayout->setBlockImageEnabled(m_blockImageEnabled);
-    doc->setDocumentLayout(docLayout);
+    m_sharedWrapWidth = 0;
+
+    m_userWrapMode = QTextEdit::WidgetWidth;
+
+    m_userWrapWidth = 0;
+
+    if (m_source) {
+        // Share everything bound to the document with the source view.
+        setDocument(m_source->document());
+        m_imageMgr = m_source->m_imageMgr;
+        m_blockImageEnabled = m_source->m_blockImageEnabled;
+        m_codeBlockIndex = m_source->m_codeBlockIndex;
+        m_searchEngine = m_source->m_searchEngine;
+        m_source->m_sharedViews.append(this);
+    } else {
+        initDocument();
+    }
 
     m_lineNumberArea = new VLineNumberArea(this,
                                            document(),
                                            fontMetrics().width(QLatin1Char('8')),
                                            fontMetrics().height(),
                                            this);
-    connect(doc, &QTextDocument::blockCountChanged,
-            this, &VTextEdit::updateLineNumberAreaMargin);
-    connect(this, &QTextEdit::textChanged,
-            this, &VTextEdit::updateLineNumberArea);
+    connectDocument();
     connect(verticalScrollBar(), &QScrollBar::valueChanged,
-            this, &VTextEdit::updateLineNumberArea);
+            this, &VTextEdit::scrollLineNumberArea);
     connect(this, &QTextEdit::cursorPositionChanged,
-            this, &VTextEdit::updateLineNumberArea);
+            this, &VTextEdit::handleCursorPositionChanged);
+
+    connect(verticalScrollBar(), &QScrollBar::valueChanged,
+            this, &VTextEdit::updateViewportRect);
+    connect(verticalScrollBar(), &QScrollBar::valueChanged,
+            this, &VTextEdit::handleLargeFileScroll);
+    connect(horizontalScrollBar(), &QScrollBar::valueChanged,
+            this, &VTextEdit::updateViewportRect);
+}
+
+void VTextEdit::initDocument()
+{
+    m_imageMgr = new VImageResourceManager2();
+
+    QTextDocument *doc = document();
+    VTextDocumentLayout *docLayout = new VTextDocumentLayout(doc, m_imageMgr);
+    docLayout->setBlockImageEnabled(m_blockImageEnabled);
+    doc->setDocumentLayout(docLayout);
+
+    m_codeBlockIndex = new VCodeBlockIndex(doc, this);
+    connect(docLayout, &VTextDocumentLayout::documentContentsChanged,
+            m_codeBlockIndex, &VCodeBlockIndex::handleDocumentChange);
+
+    m_searchEngine = new VSearchEngine(doc, this);
+    connect(docLayout, &VTextDocumentLayout::documentContentsChanged,
+            m_searchEngine, &VSearchEngine::handleDocumentChange);
+    QTextCharFormat matchFormat;
+    matchFormat.setBackground(QColor("yellow"));
+    docLayout->setSearchEngine(m_searchEngine, matchFormat);
+}
+
+void VTextEdit::connectDocument()
+{
+    VTextDocumentLayout *docLayout = getLayout();
+    connect(document(), &QTextDocument::blockCountChanged,
+            this, &VTextEdit::updateLineNumberAreaMargin);
+    // Visual line count may change without block count change.
+    connect(docLayout, &VTextDocumentLayout::documentSizeChanged,
+            this, &VTextEdit::updateLineNumberAreaMargin);
+    connect(docLayout, &VTextDocumentLayout::documentContentsChanged,
+            this, &VTextEdit::handleDocumentContentsChanged);
+}
+
+void VTextEdit::detachFromSource()
+{
+    Q_ASSERT(m_source);
+    bool miniMapEnabled = m_miniMap != NULL;
+    setMiniMapEnabled(false);
+
+    getLayout()->setViewportRect(this, QRectF());
+    if (m_sharedWrap) {
+        m_sharedWrap = false;
+        setLineWrapColumnOrWidth(m_userWrapWidth);
+        setLineWrapMode(m_userWrapMode);
+    }
+
+    disconnect(getLayout(), 0, this, 0);
+    disconnect(document(), &QTextDocument::blockCountChanged,
+               this, &VTextEdit::updateLineNumberAreaMargin);
+
+    // Go on with a new empty document of its own.
+    m_source = NULL;
+    setDocument(new QTextDocument(this));
+    initDocument();
+    m_lineNumberArea->setDocument(document());
+    connectDocument();
+
+    setMiniMapEnabled(miniMapEnabled);
+    updateLineNumberAreaMargin();
+    updateViewportRect();
 }
 
 VTextDocumentLayout *VTextEdit::getLayout() const
@@ -76,6 +206,10 @@ VTextDocumentLayout *VTextEdit::getLayout() const
 void VTextEdit::setLineLeading(qreal p_leading)
 {
     getLayout()->setLineLeading(p_leading);
+
+    if (m_miniMap) {
+        m_miniMap->setLineHeight(fontMetrics().lineSpacing() + p_leading);
+    }
 }
 
 void VTextEdit::resizeEvent(QResizeEvent *p_event)
@@ -89,6 +223,124 @@ void VTextEdit::resizeEvent(QResizeEvent *p_event)
                                             m_lineNumberArea->calculateWidth(),
                                             rect.height()));
     }
+
+    updateMiniMapGeometry();
+
+    updateViewportRect();
+
+    sourceView()->updateSharedWrapWidth();
+
+    if (m_snapshotScrollValue != -1) {
+        // The width of the snapshot is checked at the relayout of the resize.
+        VTextDocumentLayout *layout = getLayout();
+        if (layout->isSnapshotApplied()) {
+            verticalScrollBar()->setValue(m_snapshotScrollValue);
+        }
+
+        layout->clearSnapshot();
+        m_snapshotScrollValue = -1;
+    }
+}
+
+void VTextEdit::showEvent(QShowEvent *p_event)
+{
+    QTextEdit::showEvent(p_event);
+
+    wake();
+
+    updateViewportRect();
+
+    sourceView()->updateSharedWrapWidth();
+}
+
+void VTextEdit::hideEvent(QHideEvent *p_event)
+{
+    QTextEdit::hideEvent(p_event);
+
+    // Pause the animations.
+    getLayout()->setViewportRect(this, QRectF());
+
+    sourceView()->updateSharedWrapWidth();
+}
+
+void VTextEdit::updateSharedWrapWidth()
+{
+    Q_ASSERT(!m_source);
+    if (m_sharedViews.isEmpty() && !m_sharedWrap) {
+        // Not shared.
+        return;
+    }
+
+    QVector<VTextEdit *> views = m_sharedViews;
+    views.prepend(this);
+
+    // Views wrapped by the user at a fixed width or column are left as they are.
+    for (auto view : views) {
+        if (view->m_sharedWrap
+            && (view->lineWrapMode() != QTextEdit::FixedPixelWidth
+                || view->lineWrapColumnOrWidth() != view->m_sharedWrapWidth)) {
+            // Changed by the user since.
+            view->m_sharedWrap = false;
+        }
+    }
+
+    if (m_sharedViews.isEmpty()) {
+        // Sharing ends. Restore the wrap mode of the user.
+        if (m_sharedWrap) {
+            m_sharedWrap = false;
+            setLineWrapColumnOrWidth(m_userWrapWidth);
+            setLineWrapMode(m_userWrapMode);
+        }
+
+        return;
+    }
+
+    int width = -1;
+    for (auto view : views) {
+        if (view->isVisible()
+            && (view->m_sharedWrap || view->lineWrapMode() == QTextEdit::WidgetWidth)) {
+            int viewWidth = view->viewport()->width();
+            width = width == -1 ? viewWidth : qMin(width, viewWidth);
+        }
+    }
+
+    if (width <= 0) {
+        return;
+    }
+
+    for (auto view : views) {
+        if (!view->m_sharedWrap) {
+            if (view->lineWrapMode() != QTextEdit::WidgetWidth) {
+                continue;
+            }
+
+            view->m_sharedWrap = true;
+            view->m_userWrapMode = view->lineWrapMode();
+            view->m_userWrapWidth = view->lineWrapColumnOrWidth();
+        } else if (view->m_sharedWrapWidth == width) {
+            continue;
+        }
+
+        // Set the width first to lay out only once at the new width.
+        view->m_sharedWrapWidth = width;
+        view->setLineWrapColumnOrWidth(width);
+        view->setLineWrapMode(QTextEdit::FixedPixelWidth);
+    }
+}
+
+void VTextEdit::updateViewportRect()
+{
+    if (!isVisible()) {
+        return;
+    }
+
+    QRect rect = viewport()->rect();
+    rect.translate(horizontalScrollBar()->value(), verticalScrollBar()->value());
+    getLayout()->setViewportRect(this, rect);
+
+    if (m_miniMap) {
+        m_miniMap->setViewportRect(rect);
+    }
 }
 
 void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
@@ -110,15 +362,14 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
     VTextDocumentLayout *layout = getLayout();
     Q_ASSERT(layout);
 
+    // Blocks are read from their metrics and not laid out for the numbers.
     int blockNumber = block.blockNumber();
-    QRectF rect = layout->blockBoundingRect(block);
+    QRectF rect = layout->blockRect(block);
     int top = contentOffsetY() + (int)rect.y();
     int bottom = top + (int)rect.height();
     int eventTop = p_event->rect().top();
     int eventBtm = p_event->rect().bottom();
-    const int digitHeight = m_lineNumberArea->getDigitHeight();
     const int curBlockNumber = textCursor().block().blockNumber();
-    painter.setPen(m_lineNumberArea->getForegroundColor());
     const int leading = (int)layout->getLineLeading();
 
     // Display line number only in code block.
@@ -139,14 +390,11 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
             case (int)BlockState::CodeBlock:
                 if (number == 0) {
                     // Need to find current line number in code block.
-                    QTextBlock startBlock = block.previous();
-                    while (startBlock.isValid()) {
-                        if (startBlock.userState() == (int)BlockState::CodeBlockStart) {
-                            number = block.blockNumber() - startBlock.blockNumber();
-                            break;
-                        }
-
-                        startBlock = startBlock.previous();
+                    number = m_codeBlockIndex->lineNumberInCodeBlock(block.blockNumber());
+                    if (number == 0) {
+                        // The code block starts before the window of a large file.
+                        // Its start is unknown, so number by the line in the file.
+                        number = m_windowFirstLine + block.blockNumber() + 1;
                     }
                 }
 
@@ -158,13 +406,7 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
 
             if (blockState == (int)BlockState::CodeBlock) {
                 if (block.isVisible() && bottom >= eventTop) {
-                    QString numberStr = QString::number(number);
-                    painter.drawText(0,
-                                     top + leading,
-                                     m_lineNumberArea->width(),
-                                     digitHeight,
-                                     Qt::AlignRight,
-                                     numberStr);
+                    m_lineNumberArea->drawNumber(&painter, top + leading, number, false);
                 }
 
                 ++number;
@@ -172,7 +414,48 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
 
             block = block.next();
             top = bottom;
-            bottom = top + (int)layout->blockBoundingRect(block).height();
+            bottom = top + (int)layout->blockRect(block).height();
+        }
+
+        return;
+    }
+
+    // Number each visual line.
+    if (m_lineNumberType == LineNumberType::VisualLine) {
+        // Lines before the window of a large file are not laid out and count as
+        // one visual line each.
+        const int curLine = m_windowFirstLine + layout->visualLineOfPosition(textCursor().position());
+        int number = m_windowFirstLine + layout->visualLineOfBlock(blockNumber);
+        while (block.isValid() && top <= eventBtm) {
+            QTextLayout *tl = block.layout();
+            int lineCount = block.isVisible() ? qMax(block.lineCount(), 0) : 0;
+            if (bottom >= eventTop) {
+                if (lineCount > 1 && tl->lineCount() != lineCount) {
+                    // Lines of a wrapped block are placed by its layout.
+                    layout->blockBoundingRect(block);
+                }
+
+                for (int i = 0; i < lineCount; ++i) {
+                    int lineTop = top + leading;
+                    if (i < tl->lineCount()) {
+                        lineTop = top + (int)tl->lineAt(i).y();
+                    }
+
+                    if (lineTop > eventBtm) {
+                        break;
+                    }
+
+                    m_lineNumberArea->drawNumber(&painter,
+                                                 lineTop,
+                                                 number + i + 1,
+                                                 number + i == curLine);
+                }
+            }
+
+            number += lineCount;
+            block = block.next();
+            top = bottom;
+            bottom = top + (int)layout->blockRect(block).height();
         }
 
         return;
@@ -184,12 +467,12 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
     while (block.isValid() && top <= eventBtm) {
         if (block.isVisible() && bottom >= eventTop) {
             bool currentLine = false;
-            int number = blockNumber + 1;
+            int number = m_windowFirstLine + blockNumber + 1;
             if (m_lineNumberType == LineNumberType::Relative) {
                 number = blockNumber - curBlockNumber;
                 if (number == 0) {
                     currentLine = true;
-                    number = blockNumber + 1;
+                    number = m_windowFirstLine + blockNumber + 1;
                 } else if (number < 0) {
                     number = -number;
                 }
@@ -197,31 +480,12 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
                 currentLine = true;
             }
 
-            QString numberStr = QString::number(number);
-
-            if (currentLine) {
-                QFont font = painter.font();
-                font.setBold(true);
-                painter.setFont(font);
-            }
-
-            painter.drawText(0,
-                             top + leading,
-                             m_lineNumberArea->width(),
-                             digitHeight,
-                             Qt::AlignRight,
-                             numberStr);
-
-            if (currentLine) {
-                QFont font = painter.font();
-                font.setBold(false);
-                painter.setFont(font);
-            }
+            m_lineNumberArea->drawNumber(&painter, top + leading, number, currentLine);
         }
 
         block = block.next();
         top = bottom;
-        bottom = top + (int)layout->blockBoundingRect(block).height();
+        bottom = top + (int)layout->blockRect(block).height();
         ++blockNumber;
     }
 }
@@ -230,14 +494,81 @@ void VTextEdit::updateLineNumberAreaMargin()
 {
     int width = 0;
     if (m_lineNumberType != LineNumberType::None) {
+        if (m_lineNumberType == LineNumberType::VisualLine) {
+            int count = getLayout()->visualLineCount();
+            if (m_pieceTable) {
+                count += m_pieceTable->lineCount() - m_windowLineCount;
+            }
+
+            m_lineNumberArea->setMaximumNumber(count);
+        } else if (m_pieceTable) {
+            m_lineNumberArea->setMaximumNumber(m_pieceTable->lineCount());
+        } else {
+            m_lineNumberArea->setMaximumNumber(-1);
+        }
+
         width = m_lineNumberArea->calculateWidth();
     }
 
-    if (width != viewportMargins().left()) {
-        setViewportMargins(width, 0, 0, 0);
+    int miniMapWidth = m_miniMap ? m_miniMap->sizeHint().width() : 0;
+    if (width != viewportMargins().left() || miniMapWidth != viewportMargins().right()) {
+        setViewportMargins(width, 0, miniMapWidth, 0);
+        updateMiniMapGeometry();
+
+        if (width > 0) {
+            QRect rect = contentsRect();
+            m_lineNumberArea->setGeometry(QRect(rect.left(),
+                                                rect.top(),
+                                                width,
+                                                rect.height()));
+        }
     }
 }
 
+void VTextEdit::setMiniMapEnabled(bool p_enabled)
+{
+    if (p_enabled == (m_miniMap != NULL)) {
+        return;
+    }
+
+    if (p_enabled) {
+        VTextDocumentLayout *layout = getLayout();
+        m_miniMap = new VMiniMap(document(), this);
+        m_miniMap->setLineHeight(fontMetrics().lineSpacing() + layout->getLineLeading());
+        connect(layout, &VTextDocumentLayout::documentContentsChanged,
+                m_miniMap, &VMiniMap::handleDocumentChange);
+        connect(layout, &VTextDocumentLayout::documentSizeChanged,
+                m_miniMap, static_cast<void (QWidget::*)()>(&QWidget::update));
+        connect(m_miniMap, &VMiniMap::scrollRequested,
+                this, &VTextEdit::centerViewportAt);
+        m_miniMap->show();
+    } else {
+        delete m_miniMap;
+        m_miniMap = NULL;
+    }
+
+    updateLineNumberAreaMargin();
+    updateViewportRect();
+}
+
+void VTextEdit::updateMiniMapGeometry()
+{
+    if (!m_miniMap) {
+        return;
+    }
+
+    QRect rect = viewport()->geometry();
+    m_miniMap->setGeometry(QRect(rect.right() + 1,
+                                 rect.top(),
+                                 m_miniMap->sizeHint().width(),
+                                 rect.height()));
+}
+
+void VTextEdit::centerViewportAt(int p_y)
+{
+    verticalScrollBar()->setValue(p_y - viewport()->height() / 2);
+}
+
 void VTextEdit::updateLineNumberArea()
 {
     if (m_lineNumberType != LineNumberType::None) {
@@ -253,6 +584,455 @@ void VTextEdit::updateLineNumberArea()
     }
 }
 
+void VTextEdit::scrollLineNumberArea(int p_value)
+{
+    int dy = m_lastScrollValue - p_value;
+    m_lastScrollValue = p_value;
+    if (m_lineNumberType == LineNumberType::None || !m_lineNumberArea->isVisible()) {
+        return;
+    }
+
+    // Blit the existing contents and paint only the exposed strip.
+    if (qAbs(dy) < m_lineNumberArea->height()) {
+        m_lineNumberArea->scroll(0, dy);
+    } else {
+        m_lineNumberArea->update();
+    }
+}
+
+void VTextEdit::handleCursorPositionChanged()
+{
+    int blockNumber = textCursor().blockNumber();
+    getLayout()->setCursorBlock(blockNumber);
+
+    if (blockNumber == m_lastCursorBlockNumber) {
+        if (m_lineNumberType == LineNumberType::VisualLine
+            && m_lineNumberArea->isVisible()) {
+            // The current visual line may change within the block.
+            updateLineNumberAreaOfBlock(blockNumber);
+        }
+
+        return;
+    }
+
+    int lastBlockNumber = m_lastCursorBlockNumber;
+    m_lastCursorBlockNumber = blockNumber;
+    if (!m_lineNumberArea->isVisible()) {
+        return;
+    }
+
+    switch (m_lineNumberType) {
+    case LineNumberType::Absolute:
+    case LineNumberType::VisualLine:
+        // Only the bold current line changes.
+        updateLineNumberAreaOfBlock(lastBlockNumber);
+        updateLineNumberAreaOfBlock(blockNumber);
+        break;
+
+    case LineNumberType::Relative:
+        m_lineNumberArea->update();
+        break;
+
+    default:
+        break;
+    }
+}
+
+void VTextEdit::updateLineNumberAreaOfBlock(int p_blockNumber)
+{
+    QTextBlock block = document()->findBlockByNumber(p_blockNumber);
+    if (!block.isValid()) {
+        return;
+    }
+
+    QRectF rect = getLayout()->blockBoundingRect(block);
+    int top = contentOffsetY() + (int)rect.y();
+    m_lineNumberArea->update(0, top, m_lineNumberArea->width(), (int)rect.height() + 1);
+}
+
+void VTextEdit::handleDocumentContentsChanged(int p_from, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+    Q_UNUSED(p_charsAdded);
+
+    if (m_lineNumberType == LineNumberType::None) {
+        return;
+    }
+
+    // The layout has not been updated yet. Update the line number area later.
+    QTextBlock block = document()->findBlock(p_from);
+    int blockNumber = block.isValid() ? block.blockNumber() : 0;
+    if (m_lineNumberDirtyBlock == -1) {
+        m_lineNumberDirtyBlock = blockNumber;
+        QMetaObject::invokeMethod(this, "updateLineNumberAreaFromDirtyBlock", Qt::QueuedConnection);
+    } else {
+        m_lineNumberDirtyBlock = qMin(m_lineNumberDirtyBlock, blockNumber);
+    }
+}
+
+void VTextEdit::updateLineNumberAreaFromDirtyBlock()
+{
+    int blockNumber = m_lineNumberDirtyBlock;
+    m_lineNumberDirtyBlock = -1;
+    if (blockNumber == -1
+        || m_lineNumberType == LineNumberType::None
+        || !m_lineNumberArea->isVisible()) {
+        return;
+    }
+
+    updateLineNumberAreaBelowBlock(blockNumber);
+}
+
+void VTextEdit::updateLineNumberAreaBelowBlock(int p_blockNumber)
+{
+    QTextBlock block = document()->findBlockByNumber(p_blockNumber);
+    QRectF rect = getLayout()->blockRect(block);
+    if (rect.isNull()) {
+        m_lineNumberArea->update();
+        return;
+    }
+
+    // Numbers of the blocks above the changed block remain the same.
+    int top = qMax(0, contentOffsetY() + (int)rect.y());
+    int height = m_lineNumberArea->height();
+    if (top < height) {
+        m_lineNumberArea->update(0, top, m_lineNumberArea->width(), height - top);
+    }
+}
+
+void VTextEdit::gotoVisualLine(int p_line)
+{
+    // Lines out of the window of a large file count as one visual line each,
+    // as numbered in the line number area.
+    VTextDocumentLayout *layout = getLayout();
+    const int line = p_line - m_windowFirstLine;
+    const int windowLines = layout->visualLineCount();
+    if (m_pieceTable && (line < 0 || line >= windowLines)) {
+        int fileLine = p_line;
+        if (line >= windowLines) {
+            fileLine = m_windowFirstLine + document()->blockCount() + line - windowLines;
+        }
+
+        if (fileLine >= m_pieceTable->lineCount()) {
+            return;
+        }
+
+        loadLargeFileWindow(fileLine - c_largeFileWindowLines / 2);
+
+        QTextBlock block = document()->findBlockByNumber(fileLine - m_windowFirstLine);
+        if (block.isValid()) {
+            QTextCursor cursor = textCursor();
+            cursor.setPosition(block.position());
+            setTextCursor(cursor);
+        }
+
+        return;
+    }
+
+    int pos = layout->positionOfVisualLine(line);
+    if (pos == -1) {
+        return;
+    }
+
+    QTextCursor cursor = textCursor();
+    cursor.setPosition(pos);
+    setTextCursor(cursor);
+}
+
+bool VTextEdit::openLargeFile(const QString &p_filePath)
+{
+    // Keep the edits of the current large file in its piece table, which is
+    // kept as is if @p_filePath fails to open.
+    flushLargeFileWindow();
+
+    VPieceTable *table = new VPieceTable();
+    if (!table->open(p_filePath)) {
+        delete table;
+        return false;
+    }
+
+    delete m_pieceTable;
+    m_pieceTable = table;
+
+    // Drop the current contents.
+    m_windowLineCount = 0;
+    document()->setModified(false);
+    loadLargeFileWindow(0);
+    return true;
+}
+
+bool VTextEdit::isLargeFileModified() const
+{
+    return m_pieceTable && (m_pieceTable->isModified() || document()->isModified());
+}
+
+bool VTextEdit::saveLargeFile(const QString &p_filePath)
+{
+    if (!m_pieceTable) {
+        return false;
+    }
+
+    flushLargeFileWindow();
+    if (!m_pieceTable->save(p_filePath)) {
+        return false;
+    }
+
+    m_pieceTable->setModified(false);
+    return true;
+}
+
+void VTextEdit::setLayoutFrameBudget(int p_ms)
+{
+    getLayout()->setFrameBudget(p_ms);
+}
+
+void VTextEdit::setBackgroundLayoutPaused(bool p_paused)
+{
+    // The caller takes over the pause from hibernate().
+    sourceView()->m_layoutPausedByHibernation = false;
+    getLayout()->setBackgroundLayoutPaused(p_paused);
+}
+
+void VTextEdit::hibernate()
+{
+    if (m_hibernated || isVisible()) {
+        return;
+    }
+
+    m_hibernated = true;
+
+    // Other views may still show the document.
+    VTextEdit *source = sourceView();
+    bool shared = source != this && source->isVisible();
+    for (auto view : source->m_sharedViews) {
+        if (view != this && view->isVisible()) {
+            shared = true;
+            break;
+        }
+    }
+
+    if (shared) {
+        return;
+    }
+
+    VTextDocumentLayout *layout = getLayout();
+    if (!layout->isBackgroundLayoutPaused()) {
+        layout->setBackgroundLayoutPaused(true);
+        source->m_layoutPausedByHibernation = true;
+    }
+
+    layout->releaseLayouts();
+
+    m_imageMgr->releaseDecodedImages();
+}
+
+void VTextEdit::wake()
+{
+    if (!m_hibernated) {
+        return;
+    }
+
+    m_hibernated = false;
+
+    // Leave a pause of the caller alone.
+    VTextEdit *source = sourceView();
+    if (source->m_layoutPausedByHibernation) {
+        source->m_layoutPausedByHibernation = false;
+        getLayout()->setBackgroundLayoutPaused(false);
+    }
+
+    viewport()->update();
+}
+
+void VTextEdit::setLayoutReclaimWindow(int p_blocks)
+{
+    getLayout()->setReclaimWindow(p_blocks);
+}
+
+void VTextEdit::setPrefetchBudget(int p_ms)
+{
+    getLayout()->setPrefetchBudget(p_ms);
+}
+
+bool VTextEdit::saveLayoutSnapshot(const QString &p_filePath) const
+{
+    QSaveFile file(p_filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "failed to save layout snapshot" << p_filePath;
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << (qint32)verticalScrollBar()->value();
+    getLayout()->saveSnapshot(out);
+    return file.commit();
+}
+
+bool VTextEdit::setPlainTextWithSnapshot(const QString &p_text, const QString &p_filePath)
+{
+    QFile file(p_filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        setPlainText(p_text);
+        return false;
+    }
+
+    QDataStream in(&file);
+    qint32 scrollValue = 0;
+    in >> scrollValue;
+    VTextDocumentLayout *layout = getLayout();
+    bool loaded = layout->loadSnapshot(in);
+    file.close();
+
+    m_snapshotScrollValue = -1;
+    setPlainText(p_text);
+
+    bool used = loaded && layout->isSnapshotApplied();
+    if (used) {
+        verticalScrollBar()->setValue(scrollValue);
+    } else if (layout->hasSnapshot()) {
+        // Saved at another width. Wait for the first resize.
+        m_snapshotScrollValue = scrollValue;
+        return false;
+    }
+
+    layout->clearSnapshot();
+    return used;
+}
+
+int VTextEdit::largeFileLineCount() const
+{
+    return m_pieceTable ? m_pieceTable->lineCount() : 0;
+}
+
+void VTextEdit::flushLargeFileWindow()
+{
+    if (!m_pieceTable || !document()->isModified()) {
+        return;
+    }
+
+    QStringList lines;
+    lines.reserve(document()->blockCount());
+    for (QTextBlock block = document()->firstBlock(); block.isValid(); block = block.next()) {
+        lines.append(block.text());
+    }
+
+    m_pieceTable->replaceLines(m_windowFirstLine, m_windowLineCount, lines);
+    m_windowLineCount = lines.size();
+    document()->setModified(false);
+}
+
+void VTextEdit::loadLargeFileWindow(int p_firstLine)
+{
+    if (!m_pieceTable) {
+        return;
+    }
+
+    flushLargeFileWindow();
+
+    int first = qBound(0, p_firstLine, qMax(0, m_pieceTable->lineCount() - c_largeFileWindowLines));
+    QStringList lines = m_pieceTable->lines(first, c_largeFileWindowLines);
+
+    m_loadingWindow = true;
+    m_windowFirstLine = first;
+    m_windowLineCount = lines.size();
+    setPlainText(lines.join(QLatin1Char('\n')));
+    document()->setModified(false);
+    m_loadingWindow = false;
+
+    updateLineNumberAreaMargin();
+}
+
+void VTextEdit::handleLargeFileScroll(int p_value)
+{
+    if (!m_pieceTable || m_loadingWindow) {
+        return;
+    }
+
+    QScrollBar *bar = verticalScrollBar();
+    int shift = 0;
+    if (p_value == bar->maximum()
+        && m_windowFirstLine + m_windowLineCount < m_pieceTable->lineCount()) {
+        shift = c_largeFileWindowLines / 2;
+    } else if (p_value == bar->minimum() && m_windowFirstLine > 0) {
+        shift = -qMin(c_largeFileWindowLines / 2, m_windowFirstLine);
+    } else {
+        return;
+    }
+
+    // Keep the first visible line in place.
+    QTextBlock block = firstVisibleBlock();
+    int line = m_windowFirstLine + (block.isValid() ? block.blockNumber() : 0);
+    VTextDocumentLayout *layout = getLayout();
+    int delta = block.isValid() ? p_value - (int)layout->blockBoundingRect(block).y() : 0;
+
+    loadLargeFileWindow(m_windowFirstLine + shift);
+
+    block = document()->findBlockByNumber(line - m_windowFirstLine);
+    if (block.isValid()) {
+        m_loadingWindow = true;
+        bar->setValue((int)layout->blockBoundingRect(block).y() + delta);
+        m_loadingWindow = false;
+    }
+}
+
+void VTextEdit::findAll(const QString &p_text, VSearchEngine::FindOptions p_options)
+{
+    int first = 0, last = -1;
+    QTextBlock block = firstVisibleBlock();
+    if (block.isValid()) {
+        first = block.blockNumber();
+        last = getLayout()->findBlockByPosition(QPointF(0, verticalScrollBar()->value()
+                                                            + viewport()->height()));
+    }
+
+    m_searchEngine->search(p_text, p_options, first, qMax(first, last));
+}
+
+void VTextEdit::clearFindAll()
+{
+    m_searchEngine->clear();
+}
+
+void VTextEdit::setSearchMatchFormat(const QTextCharFormat &p_format)
+{
+    getLayout()->setSearchEngine(m_searchEngine, p_format);
+}
+
+void VTextEdit::setSyntaxHighlightEnabled(bool p_enabled)
+{
+    if (m_source) {
+        m_source->setSyntaxHighlightEnabled(p_enabled);
+        return;
+    }
+
+    if (p_enabled == (m_highlighter != NULL)) {
+        return;
+    }
+
+    VTextDocumentLayout *layout = getLayout();
+    if (p_enabled) {
+        m_highlighter = new VHighlighter(document(), layout, this);
+        connect(layout, &VTextDocumentLayout::documentContentsChanged,
+                m_highlighter, &VHighlighter::handleDocumentChange);
+        connect(m_highlighter, &VHighlighter::highlightChanged,
+                layout, &VTextDocumentLayout::updateBlocks);
+        connect(m_highlighter, &VHighlighter::highlightChanged,
+                this, &VTextEdit::blockStatesChanged);
+    } else {
+        delete m_highlighter;
+        m_highlighter = NULL;
+
+        // Drop the highlights.
+        for (QTextBlock block = document()->firstBlock(); block.isValid(); block = block.next()) {
+            if (dynamic_cast<VHighlightBlockData *>(block.userData())) {
+                block.setUserData(NULL);
+            }
+        }
+
+        layout->updateBlocks(0, document()->blockCount() - 1);
+    }
+}
+
 QTextBlock VTextEdit::firstVisibleBlock() const
 {
     VTextDocumentLayout *layout = getLayout();
@@ -261,6 +1041,23 @@ QTextBlock VTextEdit::firstVisibleBlock() const
     return document()->findBlockByNumber(blockNumber);
 }
 
+void VTextEdit::blockStatesChanged(int p_firstBlock, int p_lastBlock)
+{
+    m_codeBlockIndex->invalidate(p_firstBlock, p_lastBlock);
+
+    // Only the numbers in code blocks depend on the states. A change of the
+    // states may renumber the blocks below.
+    VTextEdit *source = sourceView();
+    QVector<VTextEdit *> views = source->m_sharedViews;
+    views.prepend(source);
+    for (auto view : views) {
+        if (view->m_lineNumberType == LineNumberType::CodeBlock
+            && view->m_lineNumberArea->isVisible()) {
+            view->updateLineNumberAreaBelowBlock(p_firstBlock);
+        }
+    }
+}
+
 int VTextEdit::contentOffsetY() const
 {
     QScrollBar *sb = verticalScrollBar();
@@ -271,6 +1068,8 @@ void VTextEdit::updateBlockImages(const QVector<VBlockImageInfo2> &p_blocksInfo)
 {
     if (m_blockImageEnabled) {
         m_imageMgr->updateBlockInfos(p_blocksInfo);
+
+        getLayout()->updateVisibleAnimations();
     }
 }
 
@@ -291,6 +1090,15 @@ void VTextEdit::addImage(const QString &p_imageName, const QPixmap &p_image)
     }
 }
 
+bool VTextEdit::addImageFile(const QString &p_imageName, const QString &p_filePath)
+{
+    if (m_blockImageEnabled) {
+        return m_imageMgr->addImageFile(p_imageName, p_filePath);
+    }
+
+    return false;
+}
+
 void VTextEdit::setBlockImageEnabled(bool p_enabled)
 {
     if (m_blockImageEnabled == p_enabled) {
@@ -310,3 +1118,13 @@ void VTextEdit::setImageWidthConstrainted(bool p_enabled)
 {
     getLayout()->setImageWidthConstrainted(p_enabled);
 }
+
+void VTextEdit::setSharedImageStoreEnabled(bool p_enabled)
+{
+    m_imageMgr->setShared(p_enabled);
+}
+
+void VTextEdit::setImageDiskCacheEnabled(bool p_enabled)
+{
+    m_imageMgr->setDiskCache(p_enabled ? VImageDiskCache::instance() : nullptr);
+}
@@ -5,13 +5,30 @@
 #include <QTextBlock>
 
 #include "vlinenumberarea.h"
+#include "vsearchengine.h"
 
 class VTextDocumentLayout;
 class QPainter;
 class QResizeEvent;
+class QShowEvent;
+class QHideEvent;
 class VImageResourceManager2;
+class VCodeBlockIndex;
+class VMiniMap;
+class VPieceTable;
+class VHighlighter;
 
 
+// User state of a block.
+enum class BlockState
+{
+    Normal = 0,
+    CodeBlockStart,
+    CodeBlock,
+    CodeBlockEnd,
+    Comment
+};
+
 struct VBlockImageInfo2
 {
 public:
@@ -74,6 +91,15 @@ public:
 
     explicit VTextEdit(const QString &p_text, QWidget *p_parent = nullptr);
 
+    // Create a view of the document of @p_source, sharing its layout, images,
+    // search matches and highlights. Each view keeps its own scroll position,
+    // cursor and viewport. Views are wrapped at the width of the narrowest
+    // visible one so all the block layouts are shared. Views wrapped by the user
+    // at a fixed width or column keep it.
+    // Large files are only managed by @p_source. If @p_source is destroyed
+    // first, the view is left to its parent with a new empty document.
+    explicit VTextEdit(VTextEdit *p_source, QWidget *p_parent = nullptr);
+
     virtual ~VTextEdit();
 
     void init();
@@ -88,6 +114,16 @@ public:
 
     QTextBlock firstVisibleBlock() const;
 
+    // Move the cursor to the start of visual line @p_line (0-based), counting
+    // each line of wrapped blocks. For a large file, @p_line is numbered from
+    // the start of the file as in the line number area, and the window moves
+    // to it if needed.
+    void gotoVisualLine(int p_line);
+
+    // Should be called if block states are changed via QTextBlock::setUserState()
+    // without marking the contents dirty.
+    void blockStatesChanged(int p_firstBlock, int p_lastBlock);
+
     // Update images of these given blocks.
     // Images of blocks not given here will be clear.
     void updateBlockImages(const QVector<VBlockImageInfo2> &p_blocksInfo);
@@ -100,22 +136,160 @@ public:
     // Add an image to the resources.
     void addImage(const QString &p_imageName, const QPixmap &p_image);
 
+    // Add an image from file to the resources.
+    // Large images will be decoded only by the tiles to draw.
+    bool addImageFile(const QString &p_imageName, const QString &p_filePath);
+
     void setBlockImageEnabled(bool p_enabled);
 
     void setImageWidthConstrainted(bool p_enabled);
 
+    // Whether hold the images in the process-wide image store shared with
+    // other editors. The images are kept on switching.
+    void setSharedImageStoreEnabled(bool p_enabled);
+
+    // Whether use the local disk cache of image sizes and thumbnails for
+    // images added via addImageFile().
+    void setImageDiskCacheEnabled(bool p_enabled);
+
+    // Whether show a minimap of the whole document on the right of the viewport.
+    void setMiniMapEnabled(bool p_enabled);
+
+    // Open file @p_filePath as a large file.
+    // The file is memory-mapped and only a window of its lines is loaded into
+    // the document, which moves when scrolled to its top or bottom. Edits are
+    // written back to the mapped lines via a piece table.
+    // Unsaved edits of the current large file are discarded on success, so check
+    // isLargeFileModified() and save it first.
+    bool openLargeFile(const QString &p_filePath);
+
+    bool saveLargeFile(const QString &p_filePath);
+
+    // Whether the opened large file has edits not saved yet.
+    bool isLargeFileModified() const;
+
+    // Line count of the opened large file. 0 if no large file is opened.
+    int largeFileLineCount() const;
+
+    // Load the window of lines from @p_firstLine of the large file.
+    void loadLargeFileWindow(int p_firstLine);
+
+    // Highlight all the occurrences of @p_text in the background, starting from
+    // the visible blocks. Matches are updated as the document changes.
+    void findAll(const QString &p_text, VSearchEngine::FindOptions p_options = VSearchEngine::None);
+
+    void clearFindAll();
+
+    VSearchEngine *getSearchEngine() const;
+
+    void setSearchMatchFormat(const QTextCharFormat &p_format);
+
+    // Whether compute the block states and highlights of code blocks and comments
+    // in the background. Block states set by others will be overwritten.
+    void setSyntaxHighlightEnabled(bool p_enabled);
+
+    // Time budget in ms of one slice of layout work, so a large change or load
+    // only lays out blocks within the budget and the rest in later slices.
+    // 0 to lay out all the changed blocks at once.
+    void setLayoutFrameBudget(int p_ms);
+
+    // Pause or resume the layout of the remaining blocks in the background.
+    void setBackgroundLayoutPaused(bool p_paused);
+
+    // Keep the layouts of the blocks within @p_blocks blocks around the viewport
+    // and release the others' once scrolling stops. -1 to keep all.
+    void setLayoutReclaimWindow(int p_blocks);
+
+    // Time budget in ms of one slice of prefetching the blocks and images ahead
+    // of the scrolling, further ahead the faster it scrolls. 0 to disable.
+    void setPrefetchBudget(int p_ms);
+
+    // Release the block layouts, decoded images and caches of a hidden editor,
+    // keeping the metrics of the blocks and the scroll position. Layouts and
+    // images shared with other visible views are kept.
+    void hibernate();
+
+    // Resume a hibernated editor. Only the blocks painted are laid out again.
+    // Called when the editor is shown.
+    void wake();
+
+    bool isHibernated() const;
+
+    // Save the block metrics and the scroll position to the cache file
+    // @p_filePath for setPlainTextWithSnapshot().
+    bool saveLayoutSnapshot(const QString &p_filePath) const;
+
+    // Set @p_text as the contents. If the snapshot in @p_filePath matches the
+    // text and the layout parameters, blocks take their metrics from it and are
+    // laid out on use, and the scroll position is restored.
+    // A snapshot saved at another width waits for the first resize and is
+    // dropped if the width still differs then.
+    // Return true if the snapshot is used at once.
+    bool setPlainTextWithSnapshot(const QString &p_text, const QString &p_filePath);
+
 protected:
     void resizeEvent(QResizeEvent *p_event) Q_DECL_OVERRIDE;
 
+    void showEvent(QShowEvent *p_event) Q_DECL_OVERRIDE;
+
+    void hideEvent(QHideEvent *p_event) Q_DECL_OVERRIDE;
+
 private slots:
-    // Update viewport margin to hold the line number area.
+    // Update viewport margin to hold the line number area and the minimap.
     void updateLineNumberAreaMargin();
 
     void updateLineNumberArea();
 
+    // Tell the layout the rect of the viewport in document coordinates.
+    void updateViewportRect();
+
+    // Blit the line number area by the scrolled distance.
+    void scrollLineNumberArea(int p_value);
+
+    void handleCursorPositionChanged();
+
+    void handleDocumentContentsChanged(int p_from, int p_charsRemoved, int p_charsAdded);
+
+    // Update the line number area from m_lineNumberDirtyBlock to the bottom.
+    void updateLineNumberAreaFromDirtyBlock();
+
+    // Scroll to center document Y offset @p_y in the viewport.
+    void centerViewportAt(int p_y);
+
+    // Move the window of the large file when scrolled to its top or bottom.
+    void handleLargeFileScroll(int p_value);
+
 private:
     VTextDocumentLayout *getLayout() const;
 
+    // Create the layout, images, code block index and search engine of the
+    // document of its own.
+    void initDocument();
+
+    // Connect the signals of the document and its layout to this view.
+    void connectDocument();
+
+    // Called when the source view goes away. Show a new empty document.
+    void detachFromSource();
+
+    // Update the line number area of block @p_blockNumber only.
+    void updateLineNumberAreaOfBlock(int p_blockNumber);
+
+    // Repaint the line number area from block @p_blockNumber down.
+    void updateLineNumberAreaBelowBlock(int p_blockNumber);
+
+    // Place the minimap on the right of the viewport.
+    void updateMiniMapGeometry();
+
+    // Write the modified window back to the large file's piece table.
+    void flushLargeFileWindow();
+
+    // Return the view owning the document.
+    VTextEdit *sourceView();
+
+    // Wrap this view and its shared views at the width of the narrowest visible one.
+    void updateSharedWrapWidth();
+
     // Return the Y offset of the content via the scrollbar.
     int contentOffsetY() const;
 
@@ -123,9 +297,67 @@ private:
 
     LineNumberType m_lineNumberType;
 
+    // Block number of the cursor when last updated the line number area.
+    int m_lastCursorBlockNumber;
+
+    // Value of the vertical scrollbar when last scrolled the line number area.
+    int m_lastScrollValue;
+
+    // First changed block whose line number needs to be updated. -1 for none.
+    int m_lineNumberDirtyBlock;
+
     VImageResourceManager2 *m_imageMgr;
 
+    // Index of code blocks for LineNumberType::CodeBlock.
+    VCodeBlockIndex *m_codeBlockIndex;
+
+    VSearchEngine *m_searchEngine;
+
+    // NULL if the syntax highlight is disabled.
+    VHighlighter *m_highlighter;
+
+    // NULL if the minimap is disabled.
+    VMiniMap *m_miniMap;
+
+    // Backing lines of the large file. NULL if no large file is opened.
+    VPieceTable *m_pieceTable;
+
+    // The first line of the large file loaded into the document.
+    int m_windowFirstLine;
+
+    // Count of the lines of the large file loaded into the document.
+    int m_windowLineCount;
+
+    // Whether the window is being moved.
+    bool m_loadingWindow;
+
     bool m_blockImageEnabled;
+
+    // The view owning the document. NULL if this view owns it.
+    VTextEdit *m_source;
+
+    // Views sharing the document of this view.
+    QVector<VTextEdit *> m_sharedViews;
+
+    // Whether the wrap width is set by updateSharedWrapWidth().
+    bool m_sharedWrap;
+
+    // The wrap width set by updateSharedWrapWidth().
+    int m_sharedWrapWidth;
+
+    // Wrap mode and width of the user to restore when sharing ends.
+    LineWrapMode m_userWrapMode;
+
+    int m_userWrapWidth;
+
+    bool m_hibernated;
+
+    // Whether hibernate() paused the background layout, which is resumed on
+    // wake(). Kept by the source view since the views share the layout.
+    bool m_layoutPausedByHibernation;
+
+    // Scroll position of the snapshot waiting for the first resize, or -1.
+    int m_snapshotScrollValue;
 };
 
 inline void VTextEdit::setLineNumberType(LineNumberType p_type)
@@ -136,9 +368,25 @@ inline void VTextEdit::setLineNumberType(LineNumberType p_type)
 
     m_lineNumberType = p_type;
 
+    updateLineNumberAreaMargin();
     updateLineNumberArea();
 }
 
+inline VTextEdit *VTextEdit::sourceView()
+{
+    return m_source ? m_source : this;
+}
+
+inline bool VTextEdit::isHibernated() const
+{
+    return m_hibernated;
+}
+
+inline VSearchEngine *VTextEdit::getSearchEngine() const
+{
+    return m_searchEngine;
+}
+
 inline void VTextEdit::setLineNumberColor(const QColor &p_foreground,
                                           const QColor &p_background)
 {